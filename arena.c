@@ -0,0 +1,122 @@
+/*
+ *  Buffer arena: one anonymous mapping per worker, optionally on 2 MiB
+ *  hugepages, that period and packet buffers are carved from before
+ *  streaming starts.  Nothing on the send path allocates from the heap.
+ */
+
+#include "sineserver.h"
+
+int arena_init(struct arena *a, size_t size, int hugepages)
+{
+        size_t page = hugepages ? ARENA_HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE);
+        unsigned int c;
+        memset(a, 0, sizeof(*a));
+        size = (size + page - 1) / page * page;
+        a->base = MAP_FAILED;
+        if (hugepages) {
+                a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                a->huge = a->base != MAP_FAILED;
+        }
+        if (a->base == MAP_FAILED) {
+                a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (a->base == MAP_FAILED) {
+                        a->base = NULL;
+                        return -errno;
+                }
+                /* no hugepages reserved (vm.nr_hugepages): let THP back it */
+                a->thp = hugepages && madvise(a->base, size, MADV_HUGEPAGE) == 0;
+        }
+        a->size = size;
+        atomic_store(&a->used, 0);
+        for (c = 0; c < ARENA_CLASSES; c++)
+                atomic_store(&a->free[c], 0);
+        return 0;
+}
+
+/*
+ *   A block of 'size' bytes for good, NULL once the arena is used up
+ */
+void *arena_carve(struct arena *a, size_t size)
+{
+        size_t used = atomic_load_explicit(&a->used, memory_order_relaxed);
+        size = arena_round(size);
+        do {
+                if (size > a->size - used)
+                        return NULL;
+        } while (!atomic_compare_exchange_weak_explicit(&a->used, &used, used + size,
+                                                        memory_order_relaxed, memory_order_relaxed));
+        return a->base + used;
+}
+
+static unsigned int size_class(size_t size)
+{
+        unsigned int c = 6;             /* ARENA_ALIGN */
+        while (((size_t)1 << c) < size)
+                c++;
+        return c;
+}
+
+/*
+ *   A block of at least 'size' bytes from its free-list, or carved when
+ *   the list is empty.  The head carries a tag bumped on every change,
+ *   so a block popped and pushed back meanwhile fails the exchange.
+ */
+void *arena_get(struct arena *a, size_t size)
+{
+        unsigned int c = size_class(size);
+        uint64_t head, next;
+        unsigned char *b;
+        if (c >= ARENA_CLASSES)
+                return NULL;
+        head = atomic_load_explicit(&a->free[c], memory_order_acquire);
+        while ((uint32_t)head != 0) {
+                b = a->base + (size_t)((uint32_t)head - 1) * ARENA_ALIGN;
+                next = ((head >> 32) + 1) << 32 |
+                       atomic_load_explicit((_Atomic uint32_t *)b, memory_order_relaxed);
+                if (atomic_compare_exchange_weak_explicit(&a->free[c], &head, next,
+                                                          memory_order_acquire, memory_order_acquire))
+                        return b;
+        }
+        return arena_carve(a, (size_t)1 << c);
+}
+
+/*
+ *   Give back a block arena_get() returned for the same size
+ */
+void arena_put(struct arena *a, void *p, size_t size)
+{
+        unsigned int c = size_class(size);
+        uint32_t block = ((unsigned char *)p - a->base) / ARENA_ALIGN + 1;
+        uint64_t head = atomic_load_explicit(&a->free[c], memory_order_relaxed), next;
+        do {
+                atomic_store_explicit((_Atomic uint32_t *)p, (uint32_t)head, memory_order_relaxed);
+                next = ((head >> 32) + 1) << 32 | block;
+        } while (!atomic_compare_exchange_weak_explicit(&a->free[c], &head, next,
+                                                        memory_order_release, memory_order_relaxed));
+}
+
+int arena_owns(const struct arena *a, const void *p)
+{
+        return a->base != NULL && (const unsigned char *)p >= a->base &&
+               (const unsigned char *)p < a->base + a->size;
+}
+
+/*
+ *   Fault every page in from the calling thread: under the default NUMA
+ *   policy they are placed on its node
+ */
+void arena_touch(struct arena *a)
+{
+        size_t page = a->huge ? ARENA_HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE), i;
+        for (i = 0; i < a->size; i += page)
+                ((volatile unsigned char *)a->base)[i] = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+        if (a->base != NULL)
+                munmap(a->base, a->size);
+        a->base = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef ARENA_H_   /* Include guard */
+#define ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define   ARENA_ALIGN    64             /* every block starts a cache line */
+#define   ARENA_HUGEPAGE (2UL << 20)
+#define   ARENA_CLASSES  32             /* free-lists, one per power of two */
+
+/*
+ *  One mapping the buffers of a worker's streams are carved from, on
+ *  2 MiB pages if asked for.  Buffers that live as long as the stream
+ *  are carved once; blocks that come and go (subscriber arrays) are
+ *  rounded up to a power of two and recycled through lock-free
+ *  free-lists.  Carving and both free-list operations may race.
+ */
+struct arena {
+        unsigned char *base;
+        size_t size;
+        _Atomic size_t used;                    /* carved so far */
+        int huge;                               /* on explicit 2 MiB pages */
+        int thp;                                /* transparent huge pages advised instead */
+        _Atomic uint64_t free[ARENA_CLASSES];   /* tag << 32 | first block / ARENA_ALIGN + 1 */
+};
+
+/* room carve() takes for 'size' bytes */
+static inline size_t arena_round(size_t size)
+{
+        return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+int arena_init(struct arena *a, size_t size, int hugepages);
+void *arena_carve(struct arena *a, size_t size);
+void *arena_get(struct arena *a, size_t size);
+void arena_put(struct arena *a, void *p, size_t size);
+int arena_owns(const struct arena *a, const void *p);
+void arena_touch(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif //ARENA_H_
@@ -0,0 +1,855 @@
+/*
+ *  Micro-benchmark of the sine engines and packing kernels: frames per
+ *  second for every engine, sample format and kernel, the error of each
+ *  engine against the libm reference and a byte-exact check of the SIMD
+ *  kernels against the portable one, then the parity coding rate and the
+ *  payload codec's ratio and cost.  With -x it instead compares the
+ *  loopback transmit paths: a copy per sendto(), sendmmsg() batches and
+ *  sendmmsg() with MSG_ZEROCOPY.  With -s it sweeps rate, channels,
+ *  format and period size through the server's own period and send code
+ *  and prints one CSV line per case.
+ *  compile: make bench, make sweep for the full sweep into sweep.csv
+ */
+
+#include "sineserver.h"
+
+static double freq = 261.626;
+static double seconds = 0.5;                            /* time spent per case */
+static int transmit = 0;                                /* benchmark the socket paths */
+static int sweep = 0;                                   /* CSV sweep of the generate and send path */
+static int format_set = -1;                             /* sweep only this format */
+static int sweep_compress = 0;                          /* sweep with payloads compressed */
+static int rate_set = 0, channels_set = 0, period_set = 0, time_set = 0;
+
+#define   TX_BATCH   64                 /* datagrams per sendmmsg() */
+#define   TX_BUFS    8                  /* batches in flight with zero-copy */
+
+enum tx_mode { TX_SENDTO, TX_SENDMMSG, TX_ZEROCOPY, TX_LAST };
+static const char *const tx_names[] = { "sendto", "sendmmsg", "zerocopy" };
+
+struct tx_state {
+        int fd;
+        volatile int done;
+        uint64_t received;
+        uint64_t completed;             /* zero-copy IDs released by the kernel */
+        uint64_t copied;
+};
+
+static const snd_pcm_format_t formats[] = {
+        SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_BE, SND_PCM_FORMAT_U16_LE,
+        SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE,
+        SND_PCM_FORMAT_S32_BE, SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_FLOAT_BE,
+};
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *   Interleaved areas over a buffer of one period
+ */
+static snd_pcm_channel_area_t *make_areas(void *buf, snd_pcm_format_t format)
+{
+        snd_pcm_channel_area_t *areas = calloc(channels, sizeof(*areas));
+        unsigned int chn;
+        int width = snd_pcm_format_physical_width(format);
+        if (areas == NULL)
+                return NULL;
+        for (chn = 0; chn < channels; chn++) {
+                areas[chn].addr = buf;
+                areas[chn].first = chn * width;
+                areas[chn].step = channels * width;
+        }
+        return areas;
+}
+
+/*
+ *   Frames per second of generate_sine() for one engine and format
+ */
+static double bench_case(enum sine_engine engine, snd_pcm_format_t format)
+{
+        struct generator gen;
+        snd_pcm_channel_area_t *areas;
+        void *buf;
+        uint64_t frames = 0;
+        double start, elapsed;
+        buf = malloc(period_size * channels * snd_pcm_format_physical_width(format) / 8);
+        areas = make_areas(buf, format);
+        if (buf == NULL || areas == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        generator_init(&gen, engine, format, channels, rate, freq);
+        start = now();
+        do {
+                generate_sine(&gen, areas, 0, period_size);
+                frames += period_size;
+                elapsed = now() - start;
+        } while (elapsed < seconds);
+        free(areas);
+        free(buf);
+        return frames / elapsed;
+}
+
+/*
+ *   Largest deviation from the libm engine over 'count' frames, as a
+ *   fraction of full scale and in LSBs of a 32 and a 16 bit sample
+ */
+static void validate(enum sine_engine engine, int count)
+{
+        struct generator ref, gen;
+        double a[GEN_BLOCK], b[GEN_BLOCK], err, max_err = 0;
+        long long lsb32, lsb16, max32 = 0, max16 = 0;
+        int i, n;
+        generator_init(&ref, ENGINE_LIBM, SND_PCM_FORMAT_S32, 1, rate, freq);
+        generator_init(&gen, engine, SND_PCM_FORMAT_S32, 1, rate, freq);
+        while (count > 0) {
+                n = count < GEN_BLOCK ? count : GEN_BLOCK;
+                generator_fill(&ref, a, n);
+                generator_fill(&gen, b, n);
+                for (i = 0; i < n; i++) {
+                        err = fabs(a[i] - b[i]);
+                        max_err = err > max_err ? err : max_err;
+                        lsb32 = llabs((long long)(a[i] * 2147483647.) - (long long)(b[i] * 2147483647.));
+                        lsb16 = llabs((long long)(a[i] * 32767.) - (long long)(b[i] * 32767.));
+                        max32 = lsb32 > max32 ? lsb32 : max32;
+                        max16 = lsb16 > max16 ? lsb16 : max16;
+                }
+                count -= n;
+        }
+        printf("%-10s max error %.3e, S32 %lld LSB, S16 %lld LSB\n",
+               engine_name(engine), max_err, max32, max16);
+}
+
+/*
+ *   Every channel at its own frequency and phase, 'tones' tones each,
+ *   sweeping when 'sweep' is set
+ */
+static struct voices bank_voices(enum waveform wave, unsigned int tones, int sweep)
+{
+        struct voices v = { .wave = wave, .sweep = 0.1 };
+        char *freqs = malloc(channels * tones * 32 + 1), *phases = malloc(channels * 8 + 1);
+        unsigned int c, t;
+        size_t f = 0, p = 0;
+        if (freqs == NULL || phases == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        for (c = 0; c < channels; c++) {
+                for (t = 0; t < tones; t++)
+                        f += sprintf(freqs + f, sweep ? "%s%.3f~%.3f" : "%s%.3f", t ? "+" : "",
+                                     freq * (1 + c * 0.01) * (t + 1), freq * (1 + c * 0.01) * (t + 2));
+                p += sprintf(phases + p, "%u,", c % 360);
+                freqs[f++] = ',';
+        }
+        freqs[f - 1] = phases[p - 1] = '\0';
+        v.freqs = freqs;
+        v.phases = phases;
+        return v;
+}
+
+static void free_voices(struct voices *v)
+{
+        free((char *)v->freqs);
+        free((char *)v->phases);
+}
+
+/*
+ *   Render 'frames' frames with the given kernel into a new buffer, from
+ *   an oscillator bank when 'v' is given
+ */
+static unsigned char *render(enum pack_kernel kernel, snd_pcm_format_t format,
+                             snd_pcm_uframes_t frames, size_t *bytes,
+                             const struct voices *v)
+{
+        struct generator gen;
+        snd_pcm_channel_area_t *areas;
+        unsigned char *buf;
+        *bytes = frames * channels * snd_pcm_format_physical_width(format) / 8;
+        buf = calloc(1, *bytes);
+        areas = make_areas(buf, format);
+        if (buf == NULL || areas == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        pack_select(kernel);
+        generator_init(&gen, ENGINE_TABLE, format, channels, rate, freq);
+        if (v != NULL && generator_voices(&gen, v) < 0)
+                exit(EXIT_FAILURE);
+        generate_sine(&gen, areas, 0, frames);
+        generator_free(&gen);
+        free(areas);
+        return buf;
+}
+
+/*
+ *   Frames per second of generate_sine() from an oscillator bank
+ */
+static double bench_bank(enum waveform wave, unsigned int tones, int sweep)
+{
+        struct generator gen;
+        struct voices v = bank_voices(wave, tones, sweep);
+        snd_pcm_channel_area_t *areas;
+        void *buf;
+        uint64_t frames = 0;
+        double start, elapsed;
+        buf = malloc(period_size * channels * 4);
+        areas = make_areas(buf, SND_PCM_FORMAT_S32_LE);
+        if (buf == NULL || areas == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        generator_init(&gen, ENGINE_TABLE, SND_PCM_FORMAT_S32_LE, channels, rate, freq);
+        if (generator_voices(&gen, &v) < 0)
+                exit(EXIT_FAILURE);
+        start = now();
+        do {
+                generate_sine(&gen, areas, 0, period_size);
+                frames += period_size;
+                elapsed = now() - start;
+        } while (elapsed < seconds);
+        generator_free(&gen);
+        free_voices(&v);
+        free(areas);
+        free(buf);
+        return frames / elapsed;
+}
+
+/*
+ *   Parity bytes coded per second for groups of k datagrams with m
+ *   parity datagrams each
+ */
+static double bench_fec(unsigned int k, unsigned int m)
+{
+        size_t len = PACKETSIZE - SINE_HDR_SIZE;
+        unsigned char *data, *code;
+        unsigned int i, j;
+        uint64_t bytes = 0;
+        double start, elapsed;
+        data = malloc(k * len);
+        code = malloc(m * len);
+        if (data == NULL || code == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < k * len; i++)
+                data[i] = i * 131 + (i >> 9);
+        start = now();
+        do {
+                memset(code, 0, m * len);
+                for (i = 0; i < k; i++)
+                        for (j = 0; j < m; j++)
+                                fec_mul_add(code + j * len, data + i * len, fec_coef(k, m, j, i), len);
+                bytes += k * len;
+                elapsed = now() - start;
+        } while (elapsed < seconds);
+        free(data);
+        free(code);
+        return bytes / elapsed;
+}
+
+/*
+ *   The AVX2 parity kernel against the scalar one, and a group of k + m
+ *   rebuilt from its parity after losing m data blocks
+ */
+static int check_fec(void)
+{
+        enum { K = 10, M = 4, LEN = 1000 };
+        static uint8_t data[K][LEN], ref[M][LEN], code[M][LEN], block[M][LEN];
+        uint8_t a[M * M];
+        unsigned int i, j, r, c;
+        int failed = 0;
+        for (i = 0; i < K; i++)
+                for (j = 0; j < LEN; j++)
+                        data[i][j] = i * 37 + j * 11 + (j >> 3);
+        memset(ref, 0, sizeof(ref));
+        memset(code, 0, sizeof(code));
+        fec_select(0);
+        for (i = 0; i < K; i++)
+                for (j = 0; j < M; j++)
+                        fec_mul_add(ref[j], data[i], fec_coef(K, M, j, i), LEN - i);
+        if (fec_select(1) == 0) {
+                for (i = 0; i < K; i++)
+                        for (j = 0; j < M; j++)
+                                fec_mul_add(code[j], data[i], fec_coef(K, M, j, i), LEN - i);
+                if (memcmp(ref, code, sizeof(ref))) {
+                        printf("%s parity kernel differs\n", fec_kernel_name());
+                        failed = 1;
+                }
+        }
+        /* lose data blocks 0 to M - 1 */
+        memcpy(block, ref, sizeof(block));
+        for (i = M; i < K; i++)
+                for (r = 0; r < M; r++)
+                        fec_mul_add(block[r], data[i], fec_coef(K, M, r, i), LEN - i);
+        for (r = 0; r < M; r++)
+                for (c = 0; c < M; c++)
+                        a[r * M + c] = fec_coef(K, M, r, c);
+        if (fec_invert(a, M) < 0)
+                return 1;
+        memset(code, 0, sizeof(code));
+        for (c = 0; c < M; c++)
+                for (r = 0; r < M; r++)
+                        fec_mul_add(code[c], block[r], a[c * M + r], LEN);
+        for (c = 0; c < M; c++)
+                if (memcmp(code[c], data[c], LEN - c)) {
+                        printf("Parity does not rebuild data block %u\n", c);
+                        failed = 1;
+                }
+        return failed;
+}
+
+/*
+ *   Compress one period of 'format' datagram by datagram: the ratio, the
+ *   encode and decode time per frame, and whether it decoded back exactly
+ */
+static int bench_codec(snd_pcm_format_t format, double *ratio, double *enc_ns, double *dec_ns)
+{
+        struct codec_layout l;
+        size_t bytes, frame_bytes = channels * snd_pcm_format_physical_width(format) / 8;
+        snd_pcm_uframes_t packet = (PACKETSIZE - SINE_HDR_SIZE) / frame_bytes, off, n;
+        unsigned char *pcm, *coded, *back;
+        size_t *lens, coded_bytes = 0;
+        unsigned int i, p, rounds = 0;
+        double start;
+        int ok = 1;
+        if (codec_layout(format, &l) < 0)
+                return -EINVAL;
+        pcm = render(KERNEL_AUTO, format, period_size, &bytes, NULL);
+        coded = malloc(bytes);
+        back = malloc(bytes);
+        lens = calloc(period_size / packet + 1, sizeof(*lens));
+        if (coded == NULL || back == NULL || lens == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        start = now();
+        do {
+                for (off = 0, p = 0; off < period_size; off += n, p++) {
+                        n = period_size - off < packet ? period_size - off : packet;
+                        lens[p] = codec_encode(&l, channels, pcm + off * frame_bytes, n,
+                                               coded + off * frame_bytes, n * frame_bytes);
+                }
+                rounds++;
+        } while (now() - start < seconds / 2);
+        *enc_ns = (now() - start) * 1e9 / rounds / period_size;
+        for (off = 0, p = 0; off < period_size; off += n, p++) {
+                n = period_size - off < packet ? period_size - off : packet;
+                coded_bytes += lens[p] ? lens[p] : n * frame_bytes;
+        }
+        *ratio = (double)bytes / coded_bytes;
+        start = now();
+        rounds = 0;
+        do {
+                for (off = 0, p = 0; off < period_size; off += n, p++) {
+                        n = period_size - off < packet ? period_size - off : packet;
+                        if (lens[p] == 0)
+                                memcpy(back + off * frame_bytes, pcm + off * frame_bytes, n * frame_bytes);
+                        else if (codec_decode(&l, channels, coded + off * frame_bytes, lens[p], n,
+                                              back + off * frame_bytes) < 0)
+                                ok = 0;
+                }
+                rounds++;
+        } while (now() - start < seconds / 2);
+        *dec_ns = (now() - start) * 1e9 / rounds / period_size;
+        for (i = 0; i < bytes; i++)
+                ok &= pcm[i] == back[i];
+        free(pcm);
+        free(coded);
+        free(back);
+        free(lens);
+        return ok ? 0 : -EIO;
+}
+
+/*
+ *   Byte compare every kernel against the scalar one for a few layouts,
+ *   broadcast and from an oscillator bank of every wave shape
+ */
+static int check_kernels(void)
+{
+        static const unsigned int layouts[] = { 1, 2, 3, 4, 6, 8, 13, 64 };
+        unsigned char *ref, *buf;
+        struct voices v;
+        unsigned int k, l, saved = channels;
+        int kernel, wave, failed = 0;
+        size_t bytes;
+        for (kernel = KERNEL_SSE2; kernel < KERNEL_LAST; kernel++) {
+                if (pack_select(kernel) < 0)
+                        continue;
+                for (k = 0; k < NELEMS(formats); k++) {
+                        for (l = 0; l < NELEMS(layouts); l++) {
+                                channels = layouts[l];
+                                ref = render(KERNEL_SCALAR, formats[k], 1000, &bytes, NULL);
+                                buf = render(kernel, formats[k], 1000, &bytes, NULL);
+                                if (memcmp(ref, buf, bytes)) {
+                                        printf("%s kernel differs for %s, %u channels\n",
+                                               pack_kernel_name(kernel),
+                                               snd_pcm_format_name(formats[k]), channels);
+                                        failed = 1;
+                                }
+                                free(ref);
+                                free(buf);
+                        }
+                }
+                for (wave = 0; wave < WAVE_LAST; wave++) {
+                        for (l = 0; l < NELEMS(layouts); l++) {
+                                channels = layouts[l];
+                                v = bank_voices(wave, 3, wave == WAVE_SINE);
+                                ref = render(KERNEL_SCALAR, SND_PCM_FORMAT_S32_LE, 1000, &bytes, &v);
+                                buf = render(kernel, SND_PCM_FORMAT_S32_LE, 1000, &bytes, &v);
+                                if (memcmp(ref, buf, bytes)) {
+                                        printf("%s oscillator bank differs for %s, %u channels\n",
+                                               pack_kernel_name(kernel), waveform_name(wave), channels);
+                                        failed = 1;
+                                }
+                                free(ref);
+                                free(buf);
+                                free_voices(&v);
+                        }
+                }
+        }
+        channels = saved;
+        return failed;
+}
+
+static void *tx_drain(void *arg)
+{
+        struct tx_state *t = arg;
+        static unsigned char bufs[TX_BATCH][PACKETSIZE];
+        struct mmsghdr msgs[TX_BATCH];
+        struct iovec iovecs[TX_BATCH];
+        int i, n;
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < TX_BATCH; i++) {
+                iovecs[i].iov_base = bufs[i];
+                iovecs[i].iov_len = PACKETSIZE;
+                msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        while (!t->done)
+                if ((n = recvmmsg(t->fd, msgs, TX_BATCH, MSG_WAITFORONE, NULL)) > 0)
+                        t->received += n;
+        return NULL;
+}
+
+static void tx_done(void *arg, uint32_t lo, uint32_t hi, int copied)
+{
+        struct tx_state *t = arg;
+        t->completed += hi - lo + 1;
+        t->copied += copied ? hi - lo + 1 : 0;
+}
+
+static double thread_cpu(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *   Full datagrams to a receiver thread on loopback, sent from a ring of
+ *   TX_BUFS batches; with zero-copy a batch is rewritten only once the
+ *   kernel released it
+ */
+static void bench_tx(enum tx_mode mode)
+{
+        struct tx_state rx = { 0 }, tx = { 0 };
+        struct sockaddr_in addr = { 0 };
+        socklen_t len = sizeof(addr);
+        struct mmsghdr msgs[TX_BATCH];
+        struct iovec iovecs[TX_BATCH];
+        struct timeval tv = { 0, 100000 };
+        size_t payload = PACKETSIZE - SINE_HDR_SIZE;
+        unsigned char *bufs;
+        uint64_t sent = 0, batch;
+        double start, cpu, elapsed;
+        pthread_t drain;
+        int i, n, err, rcvbuf = 8 << 20;
+        rx.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        tx.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (rx.fd < 0 || tx.fd < 0 || bind(rx.fd, (SA *)&addr, sizeof(addr)) < 0 ||
+            getsockname(rx.fd, (SA *)&addr, &len) < 0) {
+                perror("Loopback setup failed");
+                exit(EXIT_FAILURE);
+        }
+        setsockopt(rx.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(rx.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (mode == TX_ZEROCOPY && (err = zc_enable(tx.fd)) < 0) {
+                printf("%-10s unavailable: %s\n", tx_names[mode], strerror(-err));
+                close(rx.fd);
+                close(tx.fd);
+                return;
+        }
+        bufs = malloc(TX_BUFS * TX_BATCH * payload);
+        if (bufs == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        memset(bufs, 0x5a, TX_BUFS * TX_BATCH * payload);
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < TX_BATCH; i++) {
+                msgs[i].msg_hdr.msg_name = &addr;
+                msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+                msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                iovecs[i].iov_len = payload;
+        }
+        pthread_create(&drain, NULL, tx_drain, &rx);
+
+        start = now();
+        cpu = thread_cpu();
+        for (batch = 0; now() - start < seconds; batch++) {
+                unsigned char *base = bufs + (batch % TX_BUFS) * TX_BATCH * payload;
+                if (mode == TX_ZEROCOPY) {
+                        /* the batch that used this buffer last must be back */
+                        while (tx.completed + (TX_BUFS - 1) * TX_BATCH < sent)
+                                if (zc_reap(tx.fd, tx_done, &tx) == 0)
+                                        zc_wait(tx.fd, 1);
+                }
+                for (i = 0; i < TX_BATCH; i++)
+                        iovecs[i].iov_base = base + i * payload;
+                if (mode == TX_SENDTO) {
+                        for (i = 0; i < TX_BATCH; i++)
+                                if (sendto(tx.fd, iovecs[i].iov_base, payload, 0, (SA *)&addr, sizeof(addr)) > 0)
+                                        sent++;
+                        continue;
+                }
+                for (i = 0; i < TX_BATCH; i += n) {
+                        n = sendmmsg(tx.fd, msgs + i, TX_BATCH - i, mode == TX_ZEROCOPY ? MSG_ZEROCOPY : 0);
+                        if (n < 0) {
+                                if (errno == ENOBUFS && mode == TX_ZEROCOPY) {
+                                        zc_wait(tx.fd, 1);
+                                        zc_reap(tx.fd, tx_done, &tx);
+                                }
+                                n = 0;
+                                continue;
+                        }
+                        sent += n;
+                }
+        }
+        while (mode == TX_ZEROCOPY && tx.completed < sent)
+                if (zc_reap(tx.fd, tx_done, &tx) == 0 && zc_wait(tx.fd, 100) == 0)
+                        break;
+        cpu = thread_cpu() - cpu;
+        elapsed = now() - start;
+        rx.done = 1;
+        pthread_join(drain, NULL);
+
+        printf("%-10s %10.3f %10.3f %10.0f %9.1f%%", tx_names[mode], sent / elapsed / 1e6,
+               sent * payload / elapsed / 1e9, cpu * 1e9 / (sent ? sent : 1),
+               100.0 * rx.received / (sent ? sent : 1));
+        if (mode == TX_ZEROCOPY)
+                printf("  (%.1f%% copied by the kernel)", 100.0 * tx.copied / (tx.completed ? tx.completed : 1));
+        printf("\n");
+        free(bufs);
+        close(rx.fd);
+        close(tx.fd);
+}
+
+/*
+ *   Sweep axes, narrowed to a single value by the matching option
+ */
+static const unsigned int sweep_rates[] = { 4000, 8000, 16000, 44100, 48000, 96000, 192000, 196000 };
+static const unsigned int sweep_channels[] = { 1, 2, 8, 32, 128, 1024 };
+static const unsigned int sweep_periods[] = { 64, 256, 1024, 4096 };
+
+/*
+ *   One stream set up and run as the server does, by period.c: periods
+ *   produced by produce_period(), numbered, compressed and protected with
+ *   parity as configured, and sent whole with send_packets() to a
+ *   loopback socket nobody reads, which the kernel drops into.  Only the
+ *   pacing and the local output are left out.  Prints a CSV line.
+ */
+static void sweep_case(int fd, struct sockaddr_in *addr, snd_pcm_format_t f)
+{
+        struct arena arena;
+        struct stream *s;
+        uint64_t frames, gen_ns;
+        double start, elapsed;
+        int coded, err;
+        format = f;
+        coded = sweep_compress && codec_layout(format, &layout) == 0;
+        compress = coded;
+        s = aligned_alloc(CACHELINE, sizeof(*s));
+        if (s == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        memset(s, 0, sizeof(*s));
+        s->nperiods = 1;
+        s->sock = fd;
+        memcpy(&s->addr.in, addr, sizeof(*addr));
+        period_room(s, period_size, format);
+        if ((err = arena_init(&arena, periods_footprint(s), 0)) < 0) {
+                printf("No arena: %s\n", strerror(-err));
+                exit(EXIT_FAILURE);
+        }
+        s->arena = &arena;
+        if ((err = alloc_periods(s, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+            (err = alloc_datagrams(s)) < 0) {
+                printf("%s, %u channels, %lu frames: %s\n", snd_pcm_format_name(format),
+                       channels, (unsigned long)period_size, strerror(-err));
+                arena_destroy(&arena);
+                free(s);
+                return;
+        }
+        generator_init(&s->gen, ENGINE_TABLE, format, channels, rate, freq);
+
+        start = now();
+        while ((elapsed = now() - start) < seconds) {
+                produce_period(s, &s->periods[0]);
+                if ((err = send_packets(s, &s->periods[0], s->periods[0].msgs, s->nmsgs)) < 0) {
+                        printf("Send error: %s\n", strerror(-err));
+                        exit(EXIT_FAILURE);
+                }
+        }
+        frames = atomic_load(&s->metrics.gen.frames);
+        gen_ns = atomic_load(&s->metrics.gen.generate.sum_ns);
+        printf("%s,%u,%u,%lu,%lu,%u:%u,%d,%.3f,%.3f,%.2f,%.0f\n", snd_pcm_format_name(format),
+               rate, channels, (unsigned long)period_size, (unsigned long)s->packet_frames,
+               fec_k, fec_k ? fec_m : 0, coded, (double)gen_ns / frames, elapsed * 1e9 / frames,
+               atomic_load(&s->metrics.send.bytes) / elapsed / 1e6,
+               atomic_load(&s->metrics.send.packets) / elapsed);
+        fflush(stdout);
+        generator_free(&s->gen);
+        arena_destroy(&arena);
+        free(s);
+}
+
+/*
+ *   Every rate, channel count, linear or float format the server accepts
+ *   and period size, unless pinned on the command line
+ */
+static void bench_sweep(void)
+{
+        struct sockaddr_in addr = { 0 };
+        socklen_t len = sizeof(addr);
+        unsigned int r, c, p, nr, nc, np;
+        int rx, tx, f, rcvbuf = 0;
+        rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (rx < 0 || tx < 0 || bind(rx, (SA *)&addr, sizeof(addr)) < 0 ||
+            getsockname(rx, (SA *)&addr, &len) < 0) {
+                perror("Loopback setup failed");
+                exit(EXIT_FAILURE);
+        }
+        /* keep the unread queue minimal, everything past it is dropped */
+        setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (!time_set)
+                seconds = 0.05;
+        nr = rate_set ? 1 : NELEMS(sweep_rates);
+        nc = channels_set ? 1 : NELEMS(sweep_channels);
+        np = period_set ? 1 : NELEMS(sweep_periods);
+        if (fec_k)
+                fec_init();
+        printf("format,rate,channels,period,packet_frames,fec,coded,"
+               "gen_ns_per_frame,ns_per_frame,MB_per_s,packets_per_s\n");
+        for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+                if (snd_pcm_format_name(f) == NULL || (format_set >= 0 && f != format_set))
+                        continue;
+                if (!snd_pcm_format_linear(f) &&
+                    !(f == SND_PCM_FORMAT_FLOAT_LE || f == SND_PCM_FORMAT_FLOAT_BE))
+                        continue;
+                for (r = 0; r < nr; r++)
+                        for (c = 0; c < nc; c++)
+                                for (p = 0; p < np; p++) {
+                                        if (!rate_set)
+                                                rate = sweep_rates[r];
+                                        if (!channels_set)
+                                                channels = sweep_channels[c];
+                                        if (!period_set)
+                                                period_size = sweep_periods[p];
+                                        sweep_case(tx, &addr, f);
+                                }
+        }
+        close(rx);
+        close(tx);
+}
+
+static void help(void)
+{
+        printf(
+          "Usage: bench [OPTION]...\n"
+          "\n"
+          "-h,--help            help\n"
+          "-r,--rate            stream rate in Hz\n"
+          "-c,--channels        count of channels in stream\n"
+          "-f,--frequency       sine wave frequency in Hz\n"
+          "-n,--frames          frames per generate_sine() call\n"
+          "-t,--time            seconds per case\n"
+          "-o,--format          sample format (sweep)\n"
+          "-x,--transmit        compare the loopback transmit paths instead\n"
+          "-s,--sweep           CSV of generate and send cost over rates, channels,\n"
+          "                     formats and periods; -r, -c, -o and -n pin an axis\n"
+          "-X,--fec=K:M         sweep with M parity datagrams per K\n"
+          "-z,--compress        sweep with payloads compressed, integer formats\n"
+          "\n");
+}
+
+int main(int argc, char *argv[])
+{
+        struct option long_option[] =
+        {
+                {"help", 0, NULL, 'h'},
+                {"rate", 1, NULL, 'r'},
+                {"channels", 1, NULL, 'c'},
+                {"frequency", 1, NULL, 'f'},
+                {"frames", 1, NULL, 'n'},
+                {"time", 1, NULL, 't'},
+                {"transmit", 0, NULL, 'x'},
+                {"sweep", 0, NULL, 's'},
+                {"format", 1, NULL, 'o'},
+                {"fec", 1, NULL, 'X'},
+                {"compress", 0, NULL, 'z'},
+                {NULL, 0, NULL, 0},
+        };
+        unsigned int k;
+        int engine, kernel;
+        period_size = 4096;
+        while (1) {
+                int c;
+                if ((c = getopt_long(argc, argv, "hr:c:f:n:t:xso:X:z", long_option, NULL)) < 0)
+                        break;
+                switch (c) {
+                case 'h':
+                        help();
+                        return 0;
+                case 'r':
+                        rate = atoi(optarg);
+                        rate_set = 1;
+                        break;
+                case 'c':
+                        channels = atoi(optarg);
+                        channels = channels < 1 ? 1 : channels;
+                        channels = channels > 1024 ? 1024 : channels;
+                        channels_set = 1;
+                        break;
+                case 'f':
+                        freq = atof(optarg);
+                        break;
+                case 'n':
+                        period_size = atoi(optarg);
+                        period_size = period_size < 1 ? 1 : period_size;
+                        period_set = 1;
+                        break;
+                case 't':
+                        seconds = atof(optarg);
+                        time_set = 1;
+                        break;
+                case 'x':
+                        transmit = 1;
+                        break;
+                case 's':
+                        sweep = 1;
+                        break;
+                case 'o':
+                        for (format_set = 0; format_set <= SND_PCM_FORMAT_LAST; format_set++) {
+                                const char *format_name = snd_pcm_format_name(format_set);
+                                if (format_name && !strcasecmp(format_name, optarg))
+                                        break;
+                        }
+                        if (format_set > SND_PCM_FORMAT_LAST) {
+                                printf("Unknown format %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'X':
+                        fec_m = 1;
+                        if (sscanf(optarg, "%u:%u", &fec_k, &fec_m) < 1 ||
+                            fec_k < 1 || fec_k > SINE_FEC_MAX_K || fec_m < 1 || fec_m > SINE_FEC_MAX_M) {
+                                printf("Invalid FEC ratio %s, K 1 to %d, M 1 to %d\n",
+                                       optarg, SINE_FEC_MAX_K, SINE_FEC_MAX_M);
+                                return 1;
+                        }
+                        break;
+                case 'z':
+                        sweep_compress = 1;
+                        break;
+                }
+        }
+
+        if (sweep) {
+                bench_sweep();
+                return 0;
+        }
+        if (transmit) {
+                printf("%zu byte datagrams over loopback, %d per batch\n\n",
+                       PACKETSIZE - SINE_HDR_SIZE, TX_BATCH);
+                printf("%-10s %10s %10s %10s %10s\n", "", "Mpkt/s", "GB/s", "ns/pkt CPU", "delivered");
+                for (k = 0; k < TX_LAST; k++)
+                        bench_tx(k);
+                return 0;
+        }
+
+        printf("%uHz, %u channels, %.3fHz sine, %lu frames per call\n\n",
+               rate, channels, freq, (unsigned long)period_size);
+        printf("Accuracy against libm over 10s of frames:\n");
+        for (engine = ENGINE_TABLE; engine < ENGINE_LAST; engine++)
+                validate(engine, rate * 10);
+
+        printf("\nPacking kernels against scalar: %s\n",
+               check_kernels() ? "MISMATCH" : "identical");
+
+        fec_init();
+        printf("Parity kernels against scalar: %s\n",
+               check_fec() ? "MISMATCH" : "identical");
+
+        for (kernel = KERNEL_SCALAR; kernel < KERNEL_LAST; kernel++) {
+                if (pack_select(kernel) < 0)
+                        continue;
+                printf("\n%-10s", "Mframes/s");
+                for (engine = 0; engine < ENGINE_LAST; engine++)
+                        printf(" %10s", engine_name(engine));
+                printf("   (%s packing)\n", pack_kernel_name(kernel));
+                for (k = 0; k < NELEMS(formats); k++) {
+                        printf("%-10s", snd_pcm_format_name(formats[k]));
+                        for (engine = 0; engine < ENGINE_LAST; engine++)
+                                printf(" %10.2f", bench_case(engine, formats[k]) / 1e6);
+                        printf("\n");
+                }
+        }
+
+        printf("\n%-10s", "Mframes/s");
+        for (kernel = KERNEL_SCALAR; kernel < KERNEL_LAST; kernel++)
+                if (pack_select(kernel) >= 0)
+                        printf(" %10s", pack_kernel_name(kernel));
+        printf("   (oscillator bank, S32_LE)\n");
+        for (k = 0; k < WAVE_LAST + 2; k++) {
+                /* every wave with one tone, then four tones and a sweep of sines */
+                int wave = k < WAVE_LAST ? k : WAVE_SINE;
+                printf("%-6s %-3s", waveform_name(wave), k == WAVE_LAST ? "x4" : k > WAVE_LAST ? "~" : "");
+                for (kernel = KERNEL_SCALAR; kernel < KERNEL_LAST; kernel++)
+                        if (pack_select(kernel) >= 0)
+                                printf(" %10.2f", bench_bank(wave, k == WAVE_LAST ? 4 : 1, k > WAVE_LAST) / 1e6);
+                printf("\n");
+        }
+
+        printf("\n%-10s %10s %10s   (parity, data GB/s)\n", "", "scalar", "avx2");
+        for (k = 0; k < 4; k++) {
+                /* k:1 is XOR, the rest Reed-Solomon */
+                static const unsigned int groups[][2] = { {8, 1}, {8, 2}, {8, 4}, {32, 8} };
+                printf("%3u:%-6u", groups[k][0], groups[k][1]);
+                for (kernel = 0; kernel < 2; kernel++)
+                        if (fec_select(kernel) == 0)
+                                printf(" %10.2f", bench_fec(groups[k][0], groups[k][1]) / 1e9);
+                printf("\n");
+        }
+
+        printf("\n%-10s %10s %10s %10s   (payload codec)\n", "", "ratio", "enc ns/fr", "dec ns/fr");
+        for (k = 0; k < NELEMS(formats); k++) {
+                double ratio, enc_ns, dec_ns;
+                int err = bench_codec(formats[k], &ratio, &enc_ns, &dec_ns);
+                if (err == -EINVAL)
+                        continue;
+                printf("%-10s %10.2f %10.1f %10.1f%s\n", snd_pcm_format_name(formats[k]),
+                       ratio, enc_ns, dec_ns, err ? "   MISMATCH" : "");
+        }
+        return 0;
+}
@@ -0,0 +1,779 @@
+/*
+ *  Receiver for the sine stream: joins the group or subscribes to a
+ *  unicast server, puts datagrams back in sequence order, rebuilds the
+ *  ones parity datagrams make up for, decompresses payloads and reports
+ *  throughput, loss, reordering and jitter.
+ *  compile: make client
+ */
+
+#define _GNU_SOURCE             /* recvmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "protocol.h"
+#include "fec.h"
+#include "codec.h"
+
+#define   PACKETSIZE 16384
+#define   BATCH      64                                 /* datagrams per recvmmsg() */
+#define   MAX_WINDOW 1024
+#define   MAX_JUMP   65536                              /* larger jumps restart the stream */
+#define   FEC_GROUPS 16                                 /* parity groups kept for recovery */
+
+static const char *mc_addr_str = NULL;                  /* group to join */
+static int mc_port = 2305;
+static int port_set = 0;
+static const char *server_str = NULL;                   /* unicast server to subscribe to */
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static unsigned int window = 32;                        /* reorder window in packets */
+static double interval = 1.0;                           /* report interval in s */
+static double duration = 0;                             /* stop after this many s */
+static const char *out_file = NULL;                     /* in-order payload dump */
+static int verbose = 0;
+static int filter = 0;                                  /* only take one stream ID */
+static uint32_t filter_id;
+static double drop = 0;                                 /* fraction of datagrams to discard */
+static volatile sig_atomic_t stop = 0;
+
+/* reorder window: packets seq..seq+window-1 that arrived early, and
+ * once parity is seen, the packets behind them that a group may need */
+struct slot {
+        bool used;                                      /* waiting to be delivered */
+        bool kept;                                      /* holds packet 'seq' */
+        uint32_t seq;
+        struct sine_hdr hdr;
+        size_t len;
+        unsigned char payload[PACKETSIZE];
+};
+
+struct stats {
+        uint64_t packets;                               /* unique packets received */
+        uint64_t bytes;
+        uint64_t lost;                                  /* holes pushed out of the window */
+        uint64_t late;                                  /* arrived after being declared lost */
+        uint64_t duplicates;
+        uint64_t reordered;                             /* arrived behind a later packet */
+        uint64_t parity;                                /* parity packets received */
+        uint64_t recovered;                             /* rebuilt from parity */
+        uint64_t coded;                                 /* compressed packets delivered */
+        uint64_t coded_bytes;                           /* their payload as received */
+        uint64_t decoded_bytes;                         /* and decompressed */
+        uint64_t corrupt;                               /* failed to decompress */
+};
+
+/* parity received for one group of data packets */
+struct group {
+        bool used;
+        uint32_t first;                                 /* seq of its first data packet */
+        unsigned int k, m;
+        size_t length;
+        uint32_t have;                                  /* parity indices received */
+        struct sine_hdr hdr;                            /* stream fields for rebuilt headers */
+        unsigned char code[SINE_FEC_MAX_M][PACKETSIZE];
+};
+
+static struct slot *slots;
+static struct stats total, last;
+static bool synced = false;
+static uint32_t stream_id;
+static uint32_t next_seq;                               /* next packet to deliver */
+static uint32_t high_seq;                               /* highest sequence number seen */
+static uint32_t next_ts;                                /* sample clock expected next */
+static uint32_t rate;
+static uint16_t format, channels;                       /* of the stream, network order */
+static size_t frame_bytes;
+static double jitter;                                   /* RFC 3550 interarrival jitter, in samples */
+static double last_transit;
+static FILE *out = NULL;
+static struct group *groups;                            /* allocated with the first parity */
+static unsigned int next_group;
+
+static void on_signal(int sig)
+{
+        stop = 1;
+}
+
+static double timespec_sec(const struct timespec *ts)
+{
+        return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+/*
+ *   Hand one in-order packet to the output, filling gaps with silence
+ */
+static void deliver(const struct sine_hdr *hdr, const unsigned char *payload, size_t len)
+{
+        static const unsigned char zero[PACKETSIZE];
+        static unsigned char pcm[PACKETSIZE];
+        struct codec_layout l;
+        uint32_t ts = ntohl(hdr->timestamp);
+        int32_t gap = ts - next_ts;
+        size_t raw = ntohs(hdr->frames) * frame_bytes;
+        if (hdr->flags & SINE_FLAG_CODED) {
+                /* undecodable, leave the hole for the next packet to fill with silence */
+                if (codec_layout(ntohs(hdr->format), &l) < 0 || raw > sizeof(pcm) ||
+                    codec_decode(&l, ntohs(hdr->channels), payload, len, ntohs(hdr->frames), pcm) < 0) {
+                        total.corrupt++;
+                        return;
+                }
+                total.coded++;
+                total.coded_bytes += len;
+                total.decoded_bytes += raw;
+                payload = pcm;
+                len = raw;
+        }
+        if (out != NULL) {
+                while (gap > 0) {
+                        size_t n = gap * frame_bytes;
+                        if (n > sizeof(zero))
+                                n = sizeof(zero) / frame_bytes * frame_bytes;
+                        fwrite(zero, 1, n, out);
+                        gap -= n / frame_bytes;
+                }
+                fwrite(payload, 1, len, out);
+        }
+        next_ts = ts + ntohs(hdr->frames);
+}
+
+/*
+ *   Deliver buffered packets that became in-order
+ */
+static void recover(uint32_t seq);
+
+static void drain(void)
+{
+        struct slot *s;
+        while ((s = &slots[next_seq % window])->used) {
+                deliver(&s->hdr, s->payload, s->len);
+                s->used = false;
+                next_seq++;
+        }
+}
+
+/*
+ *   Give up on the holes still in the window, e.g. at exit
+ */
+static void flush(void)
+{
+        struct slot *s;
+        while (synced && (int32_t)(high_seq - next_seq) >= 0) {
+                s = &slots[next_seq % window];
+                if (!s->used && groups != NULL)
+                        recover(next_seq);
+                if (s->used) {
+                        deliver(&s->hdr, s->payload, s->len);
+                        s->used = false;
+                } else
+                        total.lost++;
+                next_seq++;
+        }
+}
+
+/*
+ *   Restart the receive state on the first packet of a (new) stream
+ */
+static void sync_stream(const struct sine_hdr *hdr)
+{
+        unsigned int i;
+        flush();
+        stream_id = ntohl(hdr->stream_id);
+        rate = ntohl(hdr->rate);
+        format = hdr->format;
+        channels = hdr->channels;
+        next_seq = high_seq = ntohl(hdr->seq);
+        next_ts = ntohl(hdr->timestamp);
+        jitter = 0;
+        for (i = 0; i < window; i++)
+                slots[i].used = slots[i].kept = false;
+        for (i = 0; groups != NULL && i < FEC_GROUPS; i++)
+                groups[i].used = false;
+        synced = true;
+        printf("Stream 0x%08x: %uHz, format %u, %u channels\n",
+               stream_id, rate, ntohs(hdr->format), ntohs(hdr->channels));
+}
+
+/*
+ *   Put a packet in the window, a hole it pushes out is first looked for
+ *   in the parity received and otherwise lost
+ */
+static void place(const struct sine_hdr *hdr, const unsigned char *payload, size_t len)
+{
+        uint32_t seq = ntohl(hdr->seq);
+        int32_t ahead = seq - next_seq;
+        struct slot *s;
+        if (ahead < 0) {
+                /* its hole was already given up */
+                total.late++;
+                return;
+        }
+        /* slide the window, every hole it pushes out is lost */
+        while (ahead >= (int32_t)window) {
+                s = &slots[next_seq % window];
+                if (!s->used && groups != NULL)
+                        recover(next_seq);
+                if (s->used) {
+                        deliver(&s->hdr, s->payload, s->len);
+                        s->used = false;
+                } else
+                        total.lost++;
+                next_seq++;
+                drain();
+                ahead = seq - next_seq;
+        }
+        s = &slots[seq % window];
+        if (s->used || (s->kept && s->seq == seq)) {
+                total.duplicates++;
+                return;
+        }
+        total.packets++;
+        total.bytes += len + SINE_HDR_SIZE;
+        if (ahead == 0 && groups == NULL) {
+                deliver(hdr, payload, len);
+                next_seq++;
+                drain();
+                return;
+        }
+        s->used = true;
+        s->kept = true;
+        s->seq = seq;
+        s->hdr = *hdr;
+        s->len = len;
+        memcpy(s->payload, payload, len);
+        drain();
+}
+
+static struct group *find_group(uint32_t seq)
+{
+        unsigned int i;
+        for (i = 0; i < FEC_GROUPS; i++)
+                if (groups[i].used && seq - groups[i].first < groups[i].k)
+                        return &groups[i];
+        return NULL;
+}
+
+/*
+ *   Rebuild the missing packets of group g if enough of its parity is in.
+ *   Parity j minus what the packets present contribute leaves
+ *   sum over the missing i of fec_coef(k, m, j, i) * block i, one equation
+ *   per parity packet; inverting the coefficients gives the blocks back.
+ */
+static void rebuild(struct group *g)
+{
+        static unsigned char block[SINE_FEC_MAX_M][PACKETSIZE];
+        unsigned int lost[SINE_FEC_MAX_M], rows[SINE_FEC_MAX_M];
+        uint8_t a[SINE_FEC_MAX_M * SINE_FEC_MAX_M];
+        struct sine_fec_meta meta;
+        struct sine_hdr hdr;
+        struct slot *s;
+        unsigned int i, j, r, c, e = 0, nrows = 0;
+        uint32_t seq;
+        for (i = 0; i < g->k; i++) {
+                seq = g->first + i;
+                s = &slots[seq % window];
+                if (s->kept && s->seq == seq)
+                        continue;
+                /* fell out of the window, or behind what was given up */
+                if ((int32_t)(seq - next_seq) < 0 || seq - next_seq >= window || e == g->m)
+                        return;
+                lost[e++] = i;
+        }
+        for (j = 0; j < g->m && nrows < e; j++)
+                if (g->have & 1u << j)
+                        rows[nrows++] = j;
+        if (e == 0 || nrows < e || frame_bytes == 0)
+                return;
+        for (r = 0; r < e; r++) {
+                memcpy(block[r], g->code[rows[r]], g->length);
+                for (c = 0; c < e; c++)
+                        a[r * e + c] = fec_coef(g->k, g->m, rows[r], lost[c]);
+        }
+        for (i = 0; i < g->k; i++) {
+                s = &slots[(g->first + i) % window];
+                if (!s->kept || s->seq != g->first + i)
+                        continue;
+                meta.flags = s->hdr.flags;
+                meta.reserved = 0;
+                meta.frames = s->hdr.frames;
+                meta.timestamp = s->hdr.timestamp;
+                for (r = 0; r < e; r++) {
+                        uint8_t w = fec_coef(g->k, g->m, rows[r], i);
+                        fec_mul_add(block[r], (uint8_t *)&meta, w, sizeof(meta));
+                        fec_mul_add(block[r] + sizeof(meta), s->payload, w, s->len);
+                }
+        }
+        if (fec_invert(a, e) < 0)
+                return;
+        for (c = 0; c < e; c++) {
+                seq = g->first + lost[c];
+                s = &slots[seq % window];
+                memset(s->payload, 0, g->length - sizeof(meta));
+                memset(&meta, 0, sizeof(meta));
+                for (r = 0; r < e; r++) {
+                        fec_mul_add((uint8_t *)&meta, block[r], a[c * e + r], sizeof(meta));
+                        fec_mul_add(s->payload, block[r] + sizeof(meta), a[c * e + r],
+                                    g->length - sizeof(meta));
+                }
+                hdr = g->hdr;
+                hdr.flags = meta.flags;
+                hdr.seq = htonl(seq);
+                hdr.timestamp = meta.timestamp;
+                hdr.frames = meta.frames;
+                s->used = s->kept = true;
+                s->seq = seq;
+                s->hdr = hdr;
+                /* a compressed payload ends where its bit stream does, the padding is harmless */
+                s->len = meta.flags & SINE_FLAG_CODED ? g->length - sizeof(meta) :
+                         ntohs(meta.frames) * frame_bytes;
+                if (s->len > g->length - sizeof(meta))
+                        s->len = g->length - sizeof(meta);
+                total.recovered++;
+        }
+}
+
+static void recover(uint32_t seq)
+{
+        struct group *g = find_group(seq);
+        if (g != NULL)
+                rebuild(g);
+}
+
+/*
+ *   Keep a parity packet and try its group
+ */
+static void parity(const struct sine_hdr *hdr, const unsigned char *body, size_t len)
+{
+        const struct sine_fec *fec = (const struct sine_fec *)body;
+        uint32_t first = ntohl(hdr->seq);
+        struct group *g;
+        size_t length;
+        if (!synced || ntohl(hdr->stream_id) != stream_id || len < sizeof(*fec))
+                return;
+        length = ntohs(fec->length);
+        if (fec->k == 0 || fec->k > SINE_FEC_MAX_K || fec->m == 0 || fec->m > SINE_FEC_MAX_M ||
+            fec->index >= fec->m || length < sizeof(struct sine_fec_meta) ||
+            length > len - sizeof(*fec))
+                return;
+        if (groups == NULL) {
+                if ((groups = calloc(FEC_GROUPS, sizeof(*groups))) == NULL)
+                        return;
+                fec_init();
+                if (window <= fec->k)
+                        printf("Window of %u packets is too small to recover groups of %u\n",
+                               window, fec->k);
+        }
+        total.parity++;
+        if ((g = find_group(first)) == NULL || g->first != first) {
+                g = &groups[next_group++ % FEC_GROUPS];
+                g->used = true;
+                g->first = first;
+                g->k = fec->k;
+                g->m = fec->m;
+                g->length = length;
+                g->have = 0;
+                g->hdr = *hdr;
+        }
+        if (g->k != fec->k || g->m != fec->m || g->length != length)
+                return;
+        memcpy(g->code[fec->index], body + sizeof(*fec), length);
+        g->have |= 1u << fec->index;
+        rebuild(g);
+        drain();
+}
+
+static void receive(const struct sine_hdr *hdr, const unsigned char *payload,
+                    size_t len, const struct timespec *arrival)
+{
+        uint32_t seq = ntohl(hdr->seq);
+        double transit, d;
+        if (hdr->version != SINE_VERSION)
+                return;
+        if (filter && ntohl(hdr->stream_id) != filter_id)
+                return;
+        if (drop > 0 && random() < drop * RAND_MAX)
+                return;
+        if (hdr->flags & SINE_FLAG_PARITY) {
+                parity(hdr, payload, len);
+                return;
+        }
+        /* a server reconfigured on its control socket starts its clock over */
+        if (!synced || ntohl(hdr->stream_id) != stream_id || ntohl(hdr->rate) != rate ||
+            hdr->format != format || hdr->channels != channels ||
+            (int32_t)(seq - next_seq) > MAX_JUMP || (int32_t)(seq - next_seq) < -MAX_JUMP) {
+                sync_stream(hdr);
+                last_transit = timespec_sec(arrival) * rate - ntohl(hdr->timestamp);
+        }
+        if (hdr->flags & SINE_FLAG_CODED) {
+                struct codec_layout l;
+                if (codec_layout(ntohs(hdr->format), &l) == 0)
+                        frame_bytes = l.bytes * ntohs(hdr->channels);
+        } else if (ntohs(hdr->frames) > 0)
+                frame_bytes = len / ntohs(hdr->frames);
+
+        /* interarrival jitter, J += (|D| - J) / 16 */
+        transit = timespec_sec(arrival) * rate - ntohl(hdr->timestamp);
+        if (total.packets > 0) {
+                d = fabs(transit - last_transit);
+                jitter += (d - jitter) / 16;
+        }
+        last_transit = transit;
+
+        if ((int32_t)(seq - high_seq) > 0)
+                high_seq = seq;
+        else if (seq != high_seq)
+                total.reordered++;
+        place(hdr, payload, len);
+}
+
+static void report(double elapsed, const char *what)
+{
+        uint64_t packets = total.packets - last.packets;
+        uint64_t lost = total.lost - last.lost;
+        double loss = packets + lost ? 100.0 * lost / (packets + lost) : 0;
+        printf("%s %.1fs: %.0f pkt/s %.3f Mbit/s lost %llu (%.3f%%) recovered %llu late %llu dup %llu reordered %llu jitter %.1fus\n",
+               what, elapsed, packets / interval,
+               (total.bytes - last.bytes) * 8 / interval / 1e6,
+               (unsigned long long)lost, loss,
+               (unsigned long long)(total.recovered - last.recovered),
+               (unsigned long long)(total.late - last.late),
+               (unsigned long long)(total.duplicates - last.duplicates),
+               (unsigned long long)(total.reordered - last.reordered),
+               rate ? jitter * 1e6 / rate : 0);
+        last = total;
+}
+
+static void summary(double elapsed)
+{
+        uint64_t all = total.packets + total.lost;
+        printf("\nReceived %llu packets (%.3f MB) in %.1fs\n",
+               (unsigned long long)total.packets, total.bytes / 1e6, elapsed);
+        printf("Throughput %.0f pkt/s, %.3f Mbit/s\n",
+               total.packets / elapsed, total.bytes * 8 / elapsed / 1e6);
+        printf("Lost %llu (%.4f%%), late %llu, duplicates %llu, reordered %llu\n",
+               (unsigned long long)total.lost, all ? 100.0 * total.lost / all : 0,
+               (unsigned long long)total.late, (unsigned long long)total.duplicates,
+               (unsigned long long)total.reordered);
+        if (total.coded > 0)
+                printf("Compressed payloads %.2f:1 in %llu packets, %llu undecodable\n",
+                       (double)total.decoded_bytes / total.coded_bytes,
+                       (unsigned long long)total.coded, (unsigned long long)total.corrupt);
+        if (total.parity > 0)
+                printf("Recovered %llu from %llu parity packets\n",
+                       (unsigned long long)total.recovered, (unsigned long long)total.parity);
+        printf("Jitter %.1fus\n", rate ? jitter * 1e6 / rate : 0);
+}
+
+/*
+ *   Subscribe to the unicast server, or say goodbye
+ */
+static void send_ctrl(int sock, int type)
+{
+        struct sine_ctrl msg;
+        msg.version = SINE_VERSION;
+        msg.type = type;
+        msg.reserved = 0;
+        msg.stream_id = htonl(filter ? filter_id : 0);
+        if (sendto(sock, &msg, sizeof(msg), 0, (struct sockaddr *)&server, server_len) < 0 && verbose)
+                perror("Subscription failed");
+}
+
+/*
+ *   Numeric IPv4 or IPv6 address, ff02::1%eth0 for one on a given link
+ */
+static int parse_addr(const char *host, int port, struct sockaddr_storage *a, socklen_t *len)
+{
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0)
+                return -1;
+        memset(a, 0, sizeof(*a));
+        memcpy(a, res->ai_addr, res->ai_addrlen);
+        *len = res->ai_addrlen;
+        freeaddrinfo(res);
+        if (a->ss_family == AF_INET6)
+                ((struct sockaddr_in6 *)a)->sin6_port = htons(port);
+        else
+                ((struct sockaddr_in *)a)->sin_port = htons(port);
+        return 0;
+}
+
+/*
+ *   HOST[:PORT], an IPv6 HOST with a port in brackets: [2001:db8::1]:2305
+ */
+static int parse_server(const char *str)
+{
+        char host[64];
+        const char *end, *colon = strrchr(str, ':');
+        if (str[0] == '[') {
+                if ((end = strchr(++str, ']')) == NULL)
+                        return -1;
+                colon = end[1] == ':' ? end + 1 : NULL;
+        } else {
+                if (colon != NULL && strchr(str, ':') != colon)
+                        colon = NULL;   /* a bare IPv6 address */
+                end = colon ? colon : str + strlen(str);
+        }
+        if ((size_t)(end - str) >= sizeof(host))
+                return -1;
+        memcpy(host, str, end - str);
+        host[end - str] = '\0';
+        return parse_addr(host, colon ? atoi(colon + 1) : 2305, &server, &server_len);
+}
+
+static void help(void)
+{
+        printf(
+          "Usage: client [OPTION]...\n"
+          "\n"
+          "-h,--help            help\n"
+          "-A,--address         multicast group to join, IPv4 or IPv6 (ff02::1%%eth0)\n"
+          "-P,--port            port number\n"
+          "-I,--id              only receive this stream ID\n"
+          "-S,--subscribe       subscribe to a unicast server, HOST[:PORT] or [HOST6]:PORT\n"
+          "-w,--window          reorder window in packets\n"
+          "-i,--interval        report interval in s\n"
+          "-d,--duration        stop after this many s\n"
+          "-o,--output          write the reordered PCM payload to a file\n"
+          "-D,--drop            discard this percentage of datagrams, to try FEC\n"
+          "-v,--verbose         report every interval\n"
+          "\n");
+}
+
+int main(int argc, char *argv[])
+{
+        struct option long_option[] =
+        {
+                {"help", 0, NULL, 'h'},
+                {"address", 1, NULL, 'A'},
+                {"port", 1, NULL, 'P'},
+                {"id", 1, NULL, 'I'},
+                {"subscribe", 1, NULL, 'S'},
+                {"window", 1, NULL, 'w'},
+                {"interval", 1, NULL, 'i'},
+                {"duration", 1, NULL, 'd'},
+                {"output", 1, NULL, 'o'},
+                {"drop", 1, NULL, 'D'},
+                {"verbose", 0, NULL, 'v'},
+                {NULL, 0, NULL, 0},
+        };
+        static unsigned char bufs[BATCH][PACKETSIZE];
+        static char cbufs[BATCH][CMSG_SPACE(sizeof(struct timespec))];
+        struct mmsghdr msgs[BATCH];
+        struct iovec iovecs[BATCH];
+        union {
+                struct sockaddr sa;
+                struct sockaddr_in in;
+                struct sockaddr_in6 in6;
+        } addr;
+        struct sockaddr_storage group;
+        socklen_t len;
+        struct timeval tv;
+        struct timespec start, now, arrival;
+        double elapsed, next_report, next_keepalive;
+        int sock, err, n, i, family, on = 1, off = 0, rcvbuf = 8 << 20;
+        while (1) {
+                int c;
+                if ((c = getopt_long(argc, argv, "hA:P:I:S:w:i:d:o:D:v", long_option, NULL)) < 0)
+                        break;
+                switch (c) {
+                case 'h':
+                        help();
+                        return 0;
+                case 'A':
+                        mc_addr_str = optarg;
+                        break;
+                case 'P':
+                        mc_port = atoi(optarg);
+                        port_set = 1;
+                        break;
+                case 'S':
+                        if (parse_server(optarg) < 0) {
+                                printf("Invalid server %s\n", optarg);
+                                return 1;
+                        }
+                        server_str = optarg;
+                        break;
+                case 'I':
+                        filter_id = strtoul(optarg, NULL, 0);
+                        filter = 1;
+                        break;
+                case 'w':
+                        window = atoi(optarg);
+                        window = window < 1 ? 1 : window;
+                        window = window > MAX_WINDOW ? MAX_WINDOW : window;
+                        break;
+                case 'i':
+                        interval = atof(optarg);
+                        interval = interval < 0.1 ? 0.1 : interval;
+                        break;
+                case 'd':
+                        duration = atof(optarg);
+                        break;
+                case 'o':
+                        out_file = optarg;
+                        break;
+                case 'D':
+                        drop = atof(optarg) / 100;
+                        break;
+                case 'v':
+                        verbose = 1;
+                        break;
+                }
+        }
+
+        slots = calloc(window, sizeof(*slots));
+        if (slots == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        if (out_file != NULL && (out = fopen(out_file, "wb")) == NULL) {
+                perror("Error opening output");
+                exit(EXIT_FAILURE);
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        memset(&group, 0, sizeof(group));
+        if (mc_addr_str != NULL && parse_addr(mc_addr_str, mc_port, &group, &len) < 0) {
+                printf("Invalid address %s\n", mc_addr_str);
+                exit(EXIT_FAILURE);
+        }
+        /* an IPv6 socket takes IPv4 datagrams too, mapped */
+        family = group.ss_family == AF_INET6 || server.ss_family == AF_INET6 ? AF_INET6 : AF_INET;
+        if ((sock = socket(family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+                perror("Error opening socket");
+                exit(EXIT_FAILURE);
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+                perror("Kernel timestamps unavailable");
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        /* a subscriber takes any free port unless told otherwise */
+        if (server_str != NULL && !port_set)
+                mc_port = 0;
+        if (family == AF_INET6) {
+                setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+                addr.in6.sin6_family = AF_INET6;
+                addr.in6.sin6_port = htons(mc_port);
+                addr.in6.sin6_addr = in6addr_any;
+                len = sizeof(addr.in6);
+        } else {
+                addr.in.sin_family = AF_INET;
+                addr.in.sin_port = htons(mc_port);
+                addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+                len = sizeof(addr.in);
+        }
+        if (bind(sock, &addr.sa, len) < 0) {
+                perror("Error binding socket");
+                exit(EXIT_FAILURE);
+        }
+        if (group.ss_family == AF_INET6) {
+                struct sockaddr_in6 *g = (struct sockaddr_in6 *)&group;
+                struct ipv6_mreq mreq6;
+                mreq6.ipv6mr_multiaddr = g->sin6_addr;
+                mreq6.ipv6mr_interface = g->sin6_scope_id;
+                if (IN6_IS_ADDR_MULTICAST(&g->sin6_addr) &&
+                    setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6)) < 0) {
+                        perror("Joining multicast group failed");
+                        exit(EXIT_FAILURE);
+                }
+        } else if (group.ss_family == AF_INET) {
+                struct ip_mreq mreq;
+                mreq.imr_multiaddr = ((struct sockaddr_in *)&group)->sin_addr;
+                mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+                if (IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr)) &&
+                    setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+                        perror("Joining multicast group failed");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        if (server_str != NULL) {
+                len = sizeof(addr);
+                getsockname(sock, &addr.sa, &len);
+                mc_port = ntohs(family == AF_INET6 ? addr.in6.sin6_port : addr.in.sin_port);
+                printf("Subscribing to %s\n", server_str);
+        }
+        printf("Listening on %s:%d\n", mc_addr_str ? mc_addr_str : "*", mc_port);
+
+        for (i = 0; i < BATCH; i++) {
+                iovecs[i].iov_base = bufs[i];
+                iovecs[i].iov_len = PACKETSIZE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        next_report = interval;
+        next_keepalive = 0;
+        elapsed = 0;
+        while (!stop && (duration <= 0 || elapsed < duration)) {
+                if (server_str != NULL && elapsed >= next_keepalive) {
+                        send_ctrl(sock, SINE_CTRL_SUBSCRIBE);
+                        next_keepalive = elapsed + SINE_KEEPALIVE_MS / 1000.0;
+                }
+                memset(msgs, 0, sizeof(msgs));
+                for (i = 0; i < BATCH; i++) {
+                        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                        msgs[i].msg_hdr.msg_control = cbufs[i];
+                        msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+                }
+                n = recvmmsg(sock, msgs, BATCH, MSG_WAITFORONE, NULL);
+                err = errno;
+                clock_gettime(CLOCK_REALTIME, &now);
+                for (i = 0; i < n; i++) {
+                        struct cmsghdr *cmsg;
+                        arrival = now;
+                        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+                             cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+                                if (cmsg->cmsg_level == SOL_SOCKET &&
+                                    cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                                        memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+                        if (msgs[i].msg_len < SINE_HDR_SIZE)
+                                continue;
+                        receive((struct sine_hdr *)bufs[i], bufs[i] + SINE_HDR_SIZE,
+                                msgs[i].msg_len - SINE_HDR_SIZE, &arrival);
+                }
+                if (n < 0 && err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+                        printf("Receive error: %s\n", strerror(err));
+                        break;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                elapsed = timespec_sec(&now) - timespec_sec(&start);
+                if (elapsed >= next_report) {
+                        if (verbose)
+                                report(elapsed, "t");
+                        else
+                                last = total;
+                        next_report += interval;
+                }
+        }
+        if (server_str != NULL)
+                send_ctrl(sock, SINE_CTRL_UNSUBSCRIBE);
+        flush();
+        summary(elapsed > 0 ? elapsed : 1);
+        if (out != NULL)
+                fclose(out);
+        close(sock);
+        free(slots);
+        free(groups);
+        return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ *  Lossless per-datagram codec.  A coded payload is, for every channel in
+ *  turn, one byte order << 5 | k followed by that channel's residuals,
+ *  all as one MSB first bit stream padded to a byte at the end.
+ *
+ *  Samples are read as two's complement integers of their container
+ *  (unsigned formats with the sign bit flipped) and predicted by the
+ *  fixed polynomial of the order chosen for the channel:
+ *      order 0: 0, 1: x[-1], 2: 2x[-1] - x[-2], 3: 3x[-1] - 3x[-2] + x[-3]
+ *  The first samples of a datagram use the highest order they have
+ *  history for, so no datagram depends on another.  Residuals wrap
+ *  modulo 2^32, fold to unsigned as 2|r| - (r < 0) and are Rice coded
+ *  with parameter k: u >> k in unary (ones ended by a zero), then the k
+ *  low bits.  A quotient of ESCAPE or more is sent as ESCAPE ones and the
+ *  32 bit value instead.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "codec.h"
+
+#define   MAX_ORDER     3
+#define   ESCAPE        24
+#define   MAX_FRAMES    16384
+
+/* numbering of snd_pcm_format_t, the client does without ALSA */
+enum {
+        FMT_S8 = 0, FMT_U8, FMT_S16_LE, FMT_S16_BE, FMT_U16_LE, FMT_U16_BE,
+        FMT_S24_LE, FMT_S24_BE, FMT_U24_LE, FMT_U24_BE,
+        FMT_S32_LE, FMT_S32_BE, FMT_U32_LE, FMT_U32_BE,
+        FMT_S20_LE = 25, FMT_S20_BE, FMT_U20_LE, FMT_U20_BE,
+        FMT_S24_3LE = 32, FMT_S24_3BE, FMT_U24_3LE, FMT_U24_3BE,
+        FMT_S20_3LE, FMT_S20_3BE, FMT_U20_3LE, FMT_U20_3BE,
+        FMT_S18_3LE, FMT_S18_3BE, FMT_U18_3LE, FMT_U18_3BE,
+};
+
+struct bit_writer {
+        uint8_t *dst;
+        size_t pos, max;
+        uint64_t acc;
+        unsigned int cnt;               /* bits in acc */
+};
+
+struct bit_reader {
+        const uint8_t *src;
+        size_t pos, len;
+        uint64_t acc;                   /* left aligned */
+        int cnt;                        /* valid bits in acc, negative after overrun */
+};
+
+/*
+ *   Container of an integer format, -EINVAL for float and compressed ones
+ */
+int codec_layout(unsigned int format, struct codec_layout *l)
+{
+        l->flip = 0;
+        switch (format) {
+        case FMT_S8: case FMT_U8:
+                l->bytes = 1;
+                break;
+        case FMT_S16_LE: case FMT_S16_BE: case FMT_U16_LE: case FMT_U16_BE:
+                l->bytes = 2;
+                break;
+        case FMT_S24_3LE: case FMT_S24_3BE: case FMT_U24_3LE: case FMT_U24_3BE:
+        case FMT_S20_3LE: case FMT_S20_3BE: case FMT_U20_3LE: case FMT_U20_3BE:
+        case FMT_S18_3LE: case FMT_S18_3BE: case FMT_U18_3LE: case FMT_U18_3BE:
+                l->bytes = 3;
+                break;
+        case FMT_S24_LE: case FMT_S24_BE: case FMT_U24_LE: case FMT_U24_BE:
+        case FMT_S20_LE: case FMT_S20_BE: case FMT_U20_LE: case FMT_U20_BE:
+        case FMT_S32_LE: case FMT_S32_BE: case FMT_U32_LE: case FMT_U32_BE:
+                l->bytes = 4;
+                break;
+        default:
+                return -EINVAL;
+        }
+        switch (format) {
+        case FMT_S16_BE: case FMT_U16_BE: case FMT_S24_BE: case FMT_U24_BE:
+        case FMT_S32_BE: case FMT_U32_BE: case FMT_S20_BE: case FMT_U20_BE:
+        case FMT_S24_3BE: case FMT_U24_3BE: case FMT_S20_3BE: case FMT_U20_3BE:
+        case FMT_S18_3BE: case FMT_U18_3BE:
+                l->big_endian = 1;
+                break;
+        default:
+                l->big_endian = 0;
+        }
+        /* narrower unsigned samples sit below the sign bit of the container */
+        switch (format) {
+        case FMT_U8: case FMT_U16_LE: case FMT_U16_BE: case FMT_U24_3LE: case FMT_U24_3BE:
+        case FMT_U32_LE: case FMT_U32_BE:
+                l->flip = 1U << (l->bytes * 8 - 1);
+        }
+        return 0;
+}
+
+static int32_t load(const struct codec_layout *l, const uint8_t *p)
+{
+        unsigned int shift = 32 - l->bytes * 8;
+        uint32_t v = 0;
+        unsigned int i;
+        if (l->big_endian)
+                for (i = 0; i < l->bytes; i++)
+                        v = v << 8 | p[i];
+        else
+                for (i = l->bytes; i-- > 0;)
+                        v = v << 8 | p[i];
+        v ^= l->flip;
+        return (int32_t)(v << shift) >> shift;
+}
+
+static void store(const struct codec_layout *l, uint8_t *p, uint32_t v)
+{
+        unsigned int i;
+        v ^= l->flip;
+        if (l->big_endian)
+                for (i = l->bytes; i-- > 0; v >>= 8)
+                        p[i] = v;
+        else
+                for (i = 0; i < l->bytes; i++, v >>= 8)
+                        p[i] = v;
+}
+
+static inline uint32_t fold(uint32_t r)
+{
+        return r << 1 ^ (uint32_t)((int32_t)r >> 31);
+}
+
+static inline uint32_t unfold(uint32_t u)
+{
+        return u >> 1 ^ -(u & 1);
+}
+
+/*
+ *   Prediction of x[i] from the samples before it, order limited by i
+ */
+static inline uint32_t predict(const uint32_t *x, unsigned int i, unsigned int order)
+{
+        switch (order < i ? order : i) {
+        case 0:
+                return 0;
+        case 1:
+                return x[i - 1];
+        case 2:
+                return 2 * x[i - 1] - x[i - 2];
+        default:
+                return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+        }
+}
+
+static inline int put(struct bit_writer *w, uint32_t v, unsigned int n)
+{
+        w->acc = w->acc << n | v;
+        w->cnt += n;
+        while (w->cnt >= 8) {
+                if (w->pos == w->max)
+                        return -ENOSPC;
+                w->cnt -= 8;
+                w->dst[w->pos++] = w->acc >> w->cnt;
+        }
+        return 0;
+}
+
+static inline unsigned int rice_bits(uint32_t u, unsigned int k)
+{
+        uint32_t q = u >> k;
+        return q < ESCAPE ? q + 1 + k : ESCAPE + 32;
+}
+
+/*
+ *   Predictor order with the smallest residuals, their fold and the Rice
+ *   parameter that codes them in the fewest bits
+ */
+static void analyse(const uint32_t *x, unsigned int n, uint32_t *res,
+                    unsigned int *order, unsigned int *k)
+{
+        uint64_t sum[MAX_ORDER + 1] = {0}, bits, best_bits = UINT64_MAX;
+        uint32_t d0, d1, d2, d3, p0 = 0, p1 = 0, p2 = 0;
+        unsigned int i, o, c, guess;
+        for (i = 0; i < n; i++) {
+                /* differences of rising order are the residuals of the fixed predictors */
+                d0 = x[i];
+                d1 = d0 - p0;
+                d2 = d1 - p1;
+                d3 = d2 - p2;
+                p0 = d0;
+                p1 = d1;
+                p2 = d2;
+                if (i >= MAX_ORDER) {
+                        sum[0] += fold(d0);
+                        sum[1] += fold(d1);
+                        sum[2] += fold(d2);
+                        sum[3] += fold(d3);
+                }
+        }
+        *order = 0;
+        for (o = 1; o <= MAX_ORDER; o++)
+                if (sum[o] < sum[*order])
+                        *order = o;
+        for (i = 0; i < n; i++)
+                res[i] = fold(x[i] - predict(x, i, *order));
+        /* a mean residual near 2^k wants about k, try its neighbours too */
+        guess = n ? 64 - __builtin_clzll(sum[*order] / n | 1) - 1 : 0;
+        *k = guess;
+        for (c = guess ? guess - 1 : 0; c <= guess + 1 && c < 31; c++) {
+                for (i = 0, bits = 0; i < n; i++)
+                        bits += rice_bits(res[i], c);
+                if (bits < best_bits) {
+                        best_bits = bits;
+                        *k = c;
+                }
+        }
+}
+
+/*
+ *   Code 'frames' interleaved frames into at most 'max' bytes of dst;
+ *   the coded length, or 0 if it would not fit
+ */
+size_t codec_encode(const struct codec_layout *l, unsigned int channels,
+                    const uint8_t *src, unsigned int frames, uint8_t *dst, size_t max)
+{
+        struct bit_writer w = { dst, 0, max, 0, 0 };
+        size_t step = (size_t)l->bytes * channels;
+        uint32_t x[MAX_FRAMES], res[MAX_FRAMES], q;
+        unsigned int chn, i, order, k;
+        if (frames > MAX_FRAMES)
+                return 0;
+        for (chn = 0; chn < channels; chn++) {
+                for (i = 0; i < frames; i++)
+                        x[i] = load(l, src + i * step + chn * l->bytes);
+                analyse(x, frames, res, &order, &k);
+                if (put(&w, order << 5 | k, 8) < 0)
+                        return 0;
+                for (i = 0; i < frames; i++) {
+                        q = res[i] >> k;
+                        if (q >= ESCAPE) {
+                                if (put(&w, (1U << ESCAPE) - 1, ESCAPE) < 0 ||
+                                    put(&w, res[i] >> 16, 16) < 0 || put(&w, res[i] & 0xffff, 16) < 0)
+                                        return 0;
+                                continue;
+                        }
+                        if (put(&w, ((1U << q) - 1) << 1, q + 1) < 0 ||
+                            (k && put(&w, res[i] & ((1U << k) - 1), k) < 0))
+                                return 0;
+                }
+        }
+        if (w.cnt && put(&w, 0, 8 - w.cnt) < 0)
+                return 0;
+        return w.pos;
+}
+
+static inline void refill(struct bit_reader *r)
+{
+        while (r->cnt <= 56) {
+                if (r->pos < r->len)
+                        r->acc |= (uint64_t)r->src[r->pos] << (56 - r->cnt);
+                else if (r->pos >= r->len + 8)
+                        return;
+                r->pos++;
+                r->cnt += 8;
+        }
+}
+
+static inline uint32_t get(struct bit_reader *r, unsigned int n)
+{
+        uint32_t v;
+        if (n == 0)
+                return 0;
+        refill(r);
+        v = r->acc >> (64 - n);
+        r->acc <<= n;
+        r->cnt -= n;
+        return v;
+}
+
+/*
+ *   Decode a payload of 'len' bytes holding 'frames' frames into dst;
+ *   -EINVAL if it is cut short or malformed
+ */
+int codec_decode(const struct codec_layout *l, unsigned int channels,
+                 const uint8_t *src, size_t len, unsigned int frames, uint8_t *dst)
+{
+        struct bit_reader r = { src, 0, len, 0, 0 };
+        size_t step = (size_t)l->bytes * channels;
+        uint32_t x[MAX_FRAMES], u;
+        unsigned int chn, i, order, k, q, head;
+        if (frames > MAX_FRAMES)
+                return -EINVAL;
+        for (chn = 0; chn < channels; chn++) {
+                head = get(&r, 8);
+                order = head >> 5;
+                k = head & 31;
+                if (order > MAX_ORDER)
+                        return -EINVAL;
+                for (i = 0; i < frames; i++) {
+                        refill(&r);
+                        q = ~r.acc ? __builtin_clzll(~r.acc) : 64;
+                        if (q >= ESCAPE) {
+                                get(&r, ESCAPE);
+                                u = get(&r, 16) << 16;
+                                u |= get(&r, 16);
+                        } else {
+                                get(&r, q + 1);
+                                u = q << k | get(&r, k);
+                        }
+                        x[i] = unfold(u) + predict(x, i, order);
+                        store(l, dst + i * step + chn * l->bytes, x[i]);
+                }
+                /* past the end the reader makes up zeros */
+                if ((int64_t)r.pos * 8 - r.cnt > (int64_t)r.len * 8)
+                        return -EINVAL;
+        }
+        return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef CODEC_H_   /* Include guard */
+#define CODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *  Lossless payload codec for integer PCM, shared by the server and the
+ *  client.  Every datagram is coded on its own: per channel a FLAC style
+ *  fixed polynomial predictor of order 0 to 3 and a Rice parameter, then
+ *  the Rice coded prediction residuals of that channel.  See codec.c for
+ *  the bit layout.
+ */
+
+struct codec_layout {
+        unsigned int bytes;             /* bytes per sample, 1 to 4 */
+        int big_endian;
+        uint32_t flip;                  /* sign bit of an unsigned format */
+};
+
+int codec_layout(unsigned int format, struct codec_layout *l);
+size_t codec_encode(const struct codec_layout *l, unsigned int channels,
+                    const uint8_t *src, unsigned int frames, uint8_t *dst, size_t max);
+int codec_decode(const struct codec_layout *l, unsigned int channels,
+                 const uint8_t *src, size_t len, unsigned int frames, uint8_t *dst);
+
+#endif //CODEC_H_
@@ -0,0 +1,110 @@
+/*
+ *  Control socket on a loopback TCP port or a Unix socket, e.g.
+ *      echo 'tune 0 440' | nc -q1 localhost 9465
+ *  Commands are read a line at a time and answered before the next one
+ *  is read, so a client may pipeline them.
+ */
+
+#include "sineserver.h"
+#include "control.h"
+
+#define   LINE_MAX_LEN  1024
+
+static control_fn handle;
+static int listen_fd = -1;
+static pthread_t thread;
+static volatile int running;
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+        ssize_t n;
+        size_t off;
+        for (off = 0; off < len; off += n)
+                if ((n = send(fd, buf + off, len - off, MSG_NOSIGNAL)) <= 0)
+                        return -1;
+        return 0;
+}
+
+static int answer(int fd, char *line)
+{
+        char *body = NULL;
+        size_t len = 0;
+        FILE *f;
+        int err;
+        if ((f = open_memstream(&body, &len)) == NULL)
+                return -1;
+        handle(line, f);
+        fclose(f);
+        err = send_all(fd, body, len);
+        free(body);
+        return err;
+}
+
+static void serve(int fd)
+{
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        char buf[LINE_MAX_LEN], *nl, *line;
+        size_t have = 0;
+        ssize_t n;
+        while (running) {
+                if (poll(&pfd, 1, 200) <= 0)
+                        continue;
+                if ((n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0)) <= 0)
+                        return;
+                have += n;
+                buf[have] = '\0';
+                line = buf;
+                while ((nl = strchr(line, '\n')) != NULL) {
+                        *nl = '\0';
+                        if (nl > line && nl[-1] == '\r')
+                                nl[-1] = '\0';
+                        if (*line != '\0' && answer(fd, line) < 0)
+                                return;
+                        line = nl + 1;
+                }
+                have -= line - buf;
+                memmove(buf, line, have);
+                if (have == sizeof(buf) - 1) {
+                        send_all(fd, "error: line too long\n", 21);
+                        return;
+                }
+        }
+}
+
+static void *control_main(void *arg)
+{
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        int fd;
+        while (running) {
+                if (poll(&pfd, 1, 200) <= 0)
+                        continue;
+                if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+                        continue;
+                serve(fd);
+                close(fd);
+        }
+        return NULL;
+}
+
+int control_start(const char *where, control_fn handler)
+{
+        int err;
+        handle = handler;
+        if ((listen_fd = listen_local(where)) < 0)
+                return listen_fd;
+        running = 1;
+        if ((err = pthread_create(&thread, NULL, control_main, NULL)) != 0) {
+                running = 0;
+                return -err;
+        }
+        return 0;
+}
+
+void control_stop(void)
+{
+        if (!running)
+                return;
+        running = 0;
+        pthread_join(thread, NULL);
+        close(listen_fd);
+}
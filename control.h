@@ -0,0 +1,16 @@
+#ifndef CONTROL_H_   /* Include guard */
+#define CONTROL_H_
+
+#include <stdio.h>
+
+/*
+ *  Line based control socket: every line a client sends is handed to the
+ *  handler, whatever it prints to 'reply' goes back.  One client at a
+ *  time, served from its own thread.
+ */
+typedef void (*control_fn)(char *line, FILE *reply);
+
+int control_start(const char *where, control_fn handler);
+void control_stop(void);
+
+#endif //CONTROL_H_
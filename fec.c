@@ -0,0 +1,212 @@
+/*
+ *  GF(2^8) multiply-accumulate over byte blocks, the kernel behind the
+ *  parity packets.  The field uses the polynomial x^8 + x^4 + x^3 + x^2 + 1
+ *  (0x11d).  The portable kernel looks c * x up in the row of the
+ *  multiplication table for c; the AVX2 one splits x in nibbles,
+ *  lo[x & 15] ^ hi[x >> 4] from two 16 entry tables for c, and looks up
+ *  32 bytes at a time with one byte shuffle per nibble.  c = 1 is a
+ *  plain XOR.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "fec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define   HAVE_X86 1
+#endif
+
+typedef void (*mul_add_fn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static int ready = 0;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+        return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+        return gf_exp[255 - gf_log[a]];
+}
+
+static void nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16])
+{
+        int i;
+        for (i = 0; i < 16; i++) {
+                lo[i] = gf_mul(c, i);
+                hi[i] = gf_mul(c, i << 4);
+        }
+}
+
+static void xor_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+        uint64_t a, b;
+        size_t i;
+        for (i = 0; i + 8 <= len; i += 8) {
+                memcpy(&a, dst + i, 8);
+                memcpy(&b, src + i, 8);
+                a ^= b;
+                memcpy(dst + i, &a, 8);
+        }
+        for (; i < len; i++)
+                dst[i] ^= src[i];
+}
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+        uint8_t row[256];
+        size_t i;
+        if (c == 1) {
+                xor_scalar(dst, src, len);
+                return;
+        }
+        /* the whole row of the multiplication table pays off past a few hundred bytes */
+        for (i = 0; i < 256; i++)
+                row[i] = gf_mul(c, i);
+        for (i = 0; i < len; i++)
+                dst[i] ^= row[src[i]];
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+        const __m256i nibble = _mm256_set1_epi8(15);
+        uint8_t lo[16], hi[16];
+        __m256i tlo, thi, s, p;
+        size_t i = 0;
+        if (c == 1) {
+                for (; i + 32 <= len; i += 32) {
+                        s = _mm256_loadu_si256((const __m256i *)(src + i));
+                        p = _mm256_loadu_si256((const __m256i *)(dst + i));
+                        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(p, s));
+                }
+                xor_scalar(dst + i, src + i, len - i);
+                return;
+        }
+        nibble_tables(c, lo, hi);
+        tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+        thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+        for (; i + 32 <= len; i += 32) {
+                s = _mm256_loadu_si256((const __m256i *)(src + i));
+                p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, nibble)),
+                                     _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi16(s, 4), nibble)));
+                p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+                _mm256_storeu_si256((__m256i *)(dst + i), p);
+        }
+        for (; i < len; i++)
+                dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#endif
+
+static mul_add_fn mul_add = mul_add_scalar;
+static const char *kernel_name = "scalar";
+
+/*
+ *   Use the AVX2 kernel or the portable one, -ENOTSUP if the CPU lacks AVX2
+ */
+int fec_select(int avx2)
+{
+#ifdef HAVE_X86
+        __builtin_cpu_init();
+        if (avx2 && __builtin_cpu_supports("avx2")) {
+                mul_add = mul_add_avx2;
+                kernel_name = "avx2";
+                return 0;
+        }
+#endif
+        mul_add = mul_add_scalar;
+        kernel_name = "scalar";
+        return avx2 ? -ENOTSUP : 0;
+}
+
+const char *fec_kernel_name(void)
+{
+        return kernel_name;
+}
+
+/*
+ *   Field tables, and the best kernel the CPU supports
+ */
+void fec_init(void)
+{
+        unsigned int i, x = 1;
+        if (ready)
+                return;
+        for (i = 0; i < 255; i++) {
+                gf_exp[i] = gf_exp[i + 255] = x;
+                gf_log[x] = i;
+                x <<= 1;
+                if (x & 0x100)
+                        x ^= 0x11d;
+        }
+        fec_select(1);
+        ready = 1;
+}
+
+/*
+ *   Weight of data block i in parity block j of a k + m group.  The
+ *   Cauchy matrix 1 / (x_j + y_i) with x_j = k + j and y_i = i keeps every
+ *   square submatrix invertible as long as k + m <= 256.
+ */
+uint8_t fec_coef(unsigned int k, unsigned int m, unsigned int j, unsigned int i)
+{
+        if (m == 1)
+                return 1;
+        return gf_inv((k + j) ^ i);
+}
+
+/*
+ *   dst += c * src over GF(2^8)
+ */
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+        if (c != 0)
+                mul_add(dst, src, c, len);
+}
+
+/*
+ *   Invert the n x n matrix a, row major, in place by Gauss-Jordan
+ *   elimination; -EINVAL if it is singular
+ */
+int fec_invert(uint8_t *a, unsigned int n)
+{
+        uint8_t inv[n * n], t, f;
+        unsigned int row, col, k, pivot;
+        memset(inv, 0, sizeof(inv));
+        for (k = 0; k < n; k++)
+                inv[k * n + k] = 1;
+        for (col = 0; col < n; col++) {
+                for (pivot = col; pivot < n && a[pivot * n + col] == 0; pivot++)
+                        ;
+                if (pivot == n)
+                        return -EINVAL;
+                for (k = 0; k < n; k++) {
+                        t = a[col * n + k];
+                        a[col * n + k] = a[pivot * n + k];
+                        a[pivot * n + k] = t;
+                        t = inv[col * n + k];
+                        inv[col * n + k] = inv[pivot * n + k];
+                        inv[pivot * n + k] = t;
+                }
+                f = gf_inv(a[col * n + col]);
+                for (k = 0; k < n; k++) {
+                        a[col * n + k] = gf_mul(a[col * n + k], f);
+                        inv[col * n + k] = gf_mul(inv[col * n + k], f);
+                }
+                for (row = 0; row < n; row++) {
+                        if (row == col || (f = a[row * n + col]) == 0)
+                                continue;
+                        for (k = 0; k < n; k++) {
+                                a[row * n + k] ^= gf_mul(f, a[col * n + k]);
+                                inv[row * n + k] ^= gf_mul(f, inv[col * n + k]);
+                        }
+                }
+        }
+        memcpy(a, inv, n * n);
+        return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef FEC_H_   /* Include guard */
+#define FEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *  GF(2^8) arithmetic for the parity packets of protocol.h, shared by the
+ *  server and the client.  Parity j of a group of k data blocks is
+ *  sum over i of fec_coef(k, m, j, i) * block i: a plain XOR when m is 1,
+ *  a Cauchy Reed-Solomon code otherwise, so any k of the k + m blocks
+ *  give back the data.
+ */
+
+void fec_init(void);
+int fec_select(int avx2);
+const char *fec_kernel_name(void);
+uint8_t fec_coef(unsigned int k, unsigned int m, unsigned int j, unsigned int i);
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+int fec_invert(uint8_t *a, unsigned int n);
+
+#endif //FEC_H_
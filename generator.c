@@ -0,0 +1,380 @@
+/*
+ *  Sine synthesis engines and the sample packing into channel areas.
+ */
+
+#include "sineserver.h"
+
+struct sine_point sine_table[TABLE_SIZE];
+static int table_ready = 0;
+
+static const char *engine_names[ENGINE_LAST] = {
+        [ENGINE_LIBM] = "libm",
+        [ENGINE_TABLE] = "table",
+        [ENGINE_RECURSIVE] = "recursive",
+};
+
+const char *engine_name(enum sine_engine engine)
+{
+        return engine < ENGINE_LAST ? engine_names[engine] : NULL;
+}
+
+int engine_parse(const char *name)
+{
+        int engine;
+        for (engine = 0; engine < ENGINE_LAST; engine++)
+                if (!strcasecmp(engine_names[engine], name))
+                        return engine;
+        return -EINVAL;
+}
+
+void sine_table_init(void)
+{
+        int i;
+        if (table_ready)
+                return;
+        for (i = 0; i < TABLE_SIZE; i++) {
+                sine_table[i].s = sin(2. * M_PI * i / TABLE_SIZE);
+                sine_table[i].c = cos(2. * M_PI * i / TABLE_SIZE);
+        }
+        table_ready = 1;
+}
+
+void generator_init(struct generator *gen, enum sine_engine engine,
+                    snd_pcm_format_t format, unsigned int channels,
+                    unsigned int rate, double freq)
+{
+        double w = 2. * M_PI * freq / (double)rate;
+        memset(gen, 0, sizeof(*gen));
+        gen->format = format;
+        gen->channels = channels;
+        gen->rate = rate;
+        gen->freq = freq;
+        gen->engine = engine;
+        gen->step = w;
+        /* cycles per frame as a 0.64 fixed point fraction */
+        gen->inc = (uint64_t)ldexp(fmod(freq / (double)rate, 1.), 64);
+        gen->cos_w = cos(w);
+        gen->sin_w = sin(w);
+        gen->phys_bytes = snd_pcm_format_physical_width(format) / 8;
+        gen->is_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
+                         format == SND_PCM_FORMAT_FLOAT_BE);
+        gen->big_endian = snd_pcm_format_big_endian(format) == 1;
+        gen->swap = gen->big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+        gen->mask = ~0U;
+        if (!gen->is_float) {
+                int bits = snd_pcm_format_width(format);
+                gen->maxval = (double)((1U << (bits - 1)) - 1);
+                if (snd_pcm_format_unsigned(format) == 1) {
+                        gen->flip = 1U << (bits - 1);
+                        gen->mask = bits < 32 ? (1U << bits) - 1 : ~0U;
+                }
+        }
+        gen->cycle = cycle_frames(freq, rate);
+        if (engine == ENGINE_TABLE)
+                sine_table_init();
+}
+
+void generator_free(struct generator *gen)
+{
+        bank_free(gen->bank);
+        gen->bank = NULL;
+        if (gen->file == NULL)
+                free(gen->cache);
+        free(gen->coded);
+        gen->cache = NULL;
+        gen->coded = NULL;
+        gen->file = NULL;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+        uint64_t t;
+        while (b != 0) {
+                t = a % b;
+                a = b;
+                b = t;
+        }
+        return a;
+}
+
+/*
+ *   Least common multiple, 0 if either is 0 or it exceeds MAX_CYCLE
+ */
+uint64_t frames_lcm(uint64_t a, uint64_t b)
+{
+        if (a == 0 || b == 0)
+                return 0;
+        a /= gcd(a, b);
+        return a > MAX_CYCLE / b ? 0 : a * b;
+}
+
+/*
+ *   Frames in which 'freq' completes a whole number of cycles: with
+ *   freq = num / den in lowest terms that is rate * den / gcd(num, rate * den).
+ *   Frequencies with more than six decimals are taken as irrational, 0.
+ */
+uint64_t cycle_frames(double freq, unsigned int rate)
+{
+        uint64_t den, num, q;
+        for (den = 1; den <= 1000000; den *= 10) {
+                if (fabs(freq * den - llround(freq * den)) > 1e-6)
+                        continue;
+                num = llround(freq * den);
+                q = rate * den / gcd(num, rate * den);
+                return q > MAX_CYCLE ? 0 : q;
+        }
+        return 0;
+}
+
+/*
+ *   Render one repeat of the output, stretched to a multiple of 'multiple'
+ *   frames, so that every later call replays it instead of synthesising.
+ *   Fails with -ERANGE if the output never repeats, -E2BIG if the repeat
+ *   needs more than 'max_bytes' or INT_MAX frames.
+ */
+int generator_cache(struct generator *gen, snd_pcm_uframes_t multiple, size_t max_bytes)
+{
+        snd_pcm_channel_area_t *areas;
+        size_t frame_bytes = gen->channels * gen->phys_bytes;
+        uint64_t frames = frames_lcm(gen->cycle, multiple);
+        unsigned char *buf;
+        unsigned int chn;
+        if (frames == 0)
+                return -ERANGE;
+        /* generate_sine() takes an int count */
+        if (frames > max_bytes / frame_bytes || frames > INT_MAX)
+                return -E2BIG;
+        buf = malloc(frames * frame_bytes);
+        areas = calloc(gen->channels, sizeof(*areas));
+        if (buf == NULL || areas == NULL) {
+                free(buf);
+                free(areas);
+                return -ENOMEM;
+        }
+        for (chn = 0; chn < gen->channels; chn++) {
+                areas[chn].addr = buf;
+                areas[chn].first = chn * gen->phys_bytes * 8;
+                areas[chn].step = frame_bytes * 8;
+        }
+        free(gen->cache);
+        gen->cache = NULL;
+        generate_sine(gen, areas, 0, frames);
+        free(areas);
+        gen->cache = buf;
+        gen->cache_frames = frames;
+        gen->cache_pos = 0;
+        return 0;
+}
+
+/*
+ *   Play 'f' in a loop from its first frame on.  Returns 1 if its samples
+ *   are what the generator would produce, so that the cache is the file
+ *   and periods can be sliced out of it; 0 if they are decoded.
+ */
+int generator_file(struct generator *gen, struct pcm_file *f)
+{
+        gen->file = f;
+        gen->cache_frames = f->frames;
+        gen->cache_pos = 0;
+        if (f->format != gen->format || f->channels != gen->channels)
+                return 0;
+        gen->cache = (unsigned char *)f->data;
+        return 1;
+}
+
+/*
+ *   The next 'frames' frames straight out of the cache, NULL if there is
+ *   none or they wrap around its end
+ */
+const unsigned char *generator_slice(struct generator *gen, snd_pcm_uframes_t frames)
+{
+        const unsigned char *p;
+        if (gen->cache == NULL || gen->cache_pos + frames > gen->cache_frames)
+                return NULL;
+        if (gen->file != NULL)
+                pcm_file_prefetch(gen->file, gen->cache_pos);
+        p = gen->cache + gen->cache_pos * gen->channels * gen->phys_bytes;
+        gen->cache_pos = (gen->cache_pos + frames) % gen->cache_frames;
+        return p;
+}
+
+/*
+ *   Replay from the cache, wrapping around its end
+ */
+static void generate_cached(struct generator *gen,
+                            const snd_pcm_channel_area_t *areas,
+                            snd_pcm_uframes_t offset, int count)
+{
+        size_t frame_bytes = gen->channels * gen->phys_bytes;
+        int n;
+        if (gen->file != NULL)
+                pcm_file_prefetch(gen->file, gen->cache_pos);
+        while (count > 0) {
+                n = gen->cache_frames - gen->cache_pos;
+                n = count < n ? count : n;
+                pack_copy(gen, gen->cache + gen->cache_pos * frame_bytes, areas, offset, n);
+                gen->cache_pos = (gen->cache_pos + n) % gen->cache_frames;
+                offset += n;
+                count -= n;
+        }
+}
+
+/*
+ *   Reference engine, one sin() per frame
+ */
+static void fill_libm(struct generator *gen, double *out, int count)
+{
+        static double max_phase = 2. * M_PI;
+        double phase = gen->phase;
+        int i;
+        for (i = 0; i < count; i++) {
+                out[i] = sin(phase);
+                phase += gen->step;
+                if (phase >= max_phase)
+                        phase -= max_phase;
+        }
+        gen->phase = phase;
+}
+
+/*
+ *   The top TABLE_BITS of the accumulator pick a table point x0, the rest is
+ *   the offset d < 2 pi / TABLE_SIZE.  sin(x0 + d) = sin x0 cos d + cos x0 sin d
+ *   with short Taylor series for cos d and sin d is good to ~1e-10, i.e.
+ *   below one LSB of a 32 bit sample.
+ */
+static void fill_table(struct generator *gen, double *out, int count)
+{
+        const double scale = 2. * M_PI / 18446744073709551616.0;   /* 2 pi / 2^64 */
+        uint64_t acc = gen->acc;
+        int i;
+        for (i = 0; i < count; i++) {
+                unsigned int idx = acc >> FRAC_BITS;
+                double d = (double)(acc & ((1ULL << FRAC_BITS) - 1)) * scale;
+                double d2 = d * d;
+                out[i] = sine_table[idx].s * (1. - d2 * 0.5) +
+                         sine_table[idx].c * d * (1. - d2 * (1. / 6.));
+                acc += gen->inc;
+        }
+        gen->acc = acc;
+}
+
+/*
+ *   z <- z * e^(iw) per frame.  The rotation slowly loses magnitude and
+ *   phase to rounding, so every block starts again from the exact phase in
+ *   the accumulator, which re-normalises z as well.
+ */
+static void fill_recursive(struct generator *gen, double *out, int count)
+{
+        const double scale = 2. * M_PI / 18446744073709551616.0;
+        double re, im, t;
+        int i;
+        sincos((double)gen->acc * scale, &im, &re);
+        for (i = 0; i < count; i++) {
+                out[i] = im;
+                t = re * gen->cos_w - im * gen->sin_w;
+                im = re * gen->sin_w + im * gen->cos_w;
+                re = t;
+        }
+        gen->acc += gen->inc * count;
+}
+
+/*
+ *   Synthesise 'count' frames of the mono waveform in [-1, 1]
+ */
+void generator_fill(struct generator *gen, double *out, int count)
+{
+        int n;
+        while (count > 0) {
+                n = count < GEN_BLOCK ? count : GEN_BLOCK;
+                switch (gen->engine) {
+                case ENGINE_TABLE:
+                        fill_table(gen, out, n);
+                        break;
+                case ENGINE_RECURSIVE:
+                        fill_recursive(gen, out, n);
+                        break;
+                default:
+                        fill_libm(gen, out, n);
+                        break;
+                }
+                out += n;
+                count -= n;
+        }
+}
+
+/*
+ *   Frames of an oscillator bank, as many per block as fit BANK_BLOCK samples
+ */
+static void generate_bank(struct generator *gen,
+                          const snd_pcm_channel_area_t *areas,
+                          snd_pcm_uframes_t offset, int count)
+{
+        double block[BANK_BLOCK];
+        uint32_t words[BANK_BLOCK];
+        int n, per_block = BANK_BLOCK / gen->channels;
+        while (count > 0) {
+                n = count < per_block ? count : per_block;
+                bank_fill(gen->bank, block, n);
+                pack_encode(gen, block, words, n * gen->channels);
+                pack_frames(gen, words, areas, offset, n);
+                offset += n;
+                count -= n;
+        }
+}
+
+/*
+ *   Frames of a file in another format or channel count, decoded and
+ *   packed a block at a time
+ */
+static void generate_file(struct generator *gen,
+                          const snd_pcm_channel_area_t *areas,
+                          snd_pcm_uframes_t offset, int count)
+{
+        double block[BANK_BLOCK];
+        uint32_t words[BANK_BLOCK];
+        int n, per_block = BANK_BLOCK / gen->channels;
+        pcm_file_prefetch(gen->file, gen->cache_pos);
+        while (count > 0) {
+                n = count < per_block ? count : per_block;
+                if ((uint64_t)n > gen->cache_frames - gen->cache_pos)
+                        n = gen->cache_frames - gen->cache_pos;
+                pcm_file_decode(gen->file, gen->cache_pos, block, n, gen->channels);
+                pack_encode(gen, block, words, n * gen->channels);
+                pack_frames(gen, words, areas, offset, n);
+                gen->cache_pos = (gen->cache_pos + n) % gen->cache_frames;
+                offset += n;
+                count -= n;
+        }
+}
+
+/*
+ *   Fill 'count' frames of the channel areas, starting at 'offset'
+ */
+void generate_sine(struct generator *gen,
+                   const snd_pcm_channel_area_t *areas,
+                   snd_pcm_uframes_t offset, int count)
+{
+        double block[GEN_BLOCK];
+        uint32_t words[GEN_BLOCK];
+        int n;
+        if (gen->cache != NULL) {
+                generate_cached(gen, areas, offset, count);
+                return;
+        }
+        if (gen->file != NULL) {
+                generate_file(gen, areas, offset, count);
+                return;
+        }
+        if (gen->bank != NULL) {
+                generate_bank(gen, areas, offset, count);
+                return;
+        }
+        while (count > 0) {
+                n = count < GEN_BLOCK ? count : GEN_BLOCK;
+                generator_fill(gen, block, n);
+                pack_encode(gen, block, words, n);
+                pack_areas(gen, words, areas, offset, n);
+                offset += n;
+                count -= n;
+        }
+}
@@ -0,0 +1,129 @@
+#ifndef GENERATOR_H_   /* Include guard */
+#define GENERATOR_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define   GEN_BLOCK 256         /* frames synthesised per engine call */
+#define   BANK_BLOCK 4096       /* samples synthesised per oscillator bank call */
+#define   MAX_TONES 16          /* tones summed into one channel */
+#define   TABLE_BITS 10         /* sine table of 1024 points, 16 KiB */
+#define   TABLE_SIZE (1 << TABLE_BITS)
+#define   FRAC_BITS  (64 - TABLE_BITS)
+#define   MAX_CYCLE  (1ULL << 40)       /* longest repeat tracked, in frames */
+
+enum sine_engine {
+        ENGINE_LIBM,            /* sin() per frame, the reference */
+        ENGINE_TABLE,           /* phase accumulator indexing an interpolated table */
+        ENGINE_RECURSIVE,       /* complex rotation, re-anchored every block */
+        ENGINE_LAST
+};
+
+enum waveform {
+        WAVE_SINE,
+        WAVE_SQUARE,
+        WAVE_SAW,
+        WAVE_NOISE,             /* white, uniform in [-1, 1) */
+        WAVE_LAST
+};
+
+/*
+ *  What every channel plays, as given on the command line.  Lists hold
+ *  one ',' separated entry per channel and repeat when shorter.
+ */
+struct voices {
+        enum waveform wave;
+        const char *freqs;      /* Hz, '+' between tones summed, F0~F1 sweeps */
+        const char *amps;       /* amplitude, 0 to 1, NULL for full scale */
+        const char *phases;     /* start phase in degrees, NULL for 0 */
+        double sweep;           /* seconds per F0~F1 sweep */
+};
+
+/* sin and cos of every table point, side by side for one cache line fetch */
+struct sine_point {
+        double s, c;
+};
+
+extern struct sine_point sine_table[TABLE_SIZE];
+
+struct bank;
+struct pcm_file;
+
+struct generator {
+        snd_pcm_format_t format;
+        unsigned int channels;
+        unsigned int rate;
+        double freq;
+        enum sine_engine engine;
+        double phase;           /* ENGINE_LIBM: phase in radians */
+        double step;            /* ENGINE_LIBM: phase step per frame */
+        uint64_t acc;           /* phase accumulator, 2^64 is a full cycle */
+        uint64_t inc;           /* accumulator step per frame */
+        double cos_w, sin_w;    /* ENGINE_RECURSIVE: rotation per frame */
+        struct bank *bank;      /* channels differ: per channel oscillators */
+        uint64_t cycle;         /* frames after which the output repeats, 0 if never */
+        unsigned char *cache;   /* rendered repeat, interleaved */
+        uint64_t cache_frames;
+        uint64_t cache_pos;     /* next frame to replay */
+        struct pcm_file *file;  /* played instead, cache then points into it if it matches */
+        unsigned char *coded;   /* the cache's datagram payloads as -z codes them, see alloc_coded() */
+        /* sample encoding, derived from format */
+        int phys_bytes;         /* bytes per sample in memory */
+        int is_float;
+        int big_endian;
+        int swap;               /* format endianness differs from the host */
+        double maxval;          /* full scale */
+        uint32_t flip;          /* sign bit flipped for unsigned formats */
+        uint32_t mask;          /* valid bits for unsigned formats */
+};
+
+enum pack_kernel {
+        KERNEL_AUTO,            /* best one the CPU supports */
+        KERNEL_SCALAR,          /* portable C */
+        KERNEL_SSE2,
+        KERNEL_AVX2,
+        KERNEL_LAST
+};
+
+const char *engine_name(enum sine_engine engine);
+int engine_parse(const char *name);
+void generator_init(struct generator *gen, enum sine_engine engine,
+                    snd_pcm_format_t format, unsigned int channels,
+                    unsigned int rate, double freq);
+void generator_fill(struct generator *gen, double *out, int count);
+void generator_free(struct generator *gen);
+uint64_t cycle_frames(double freq, unsigned int rate);
+uint64_t frames_lcm(uint64_t a, uint64_t b);
+int generator_cache(struct generator *gen, snd_pcm_uframes_t multiple, size_t max_bytes);
+const unsigned char *generator_slice(struct generator *gen, snd_pcm_uframes_t frames);
+int generator_file(struct generator *gen, struct pcm_file *f);
+void sine_table_init(void);
+
+/* osc.c */
+const char *waveform_name(enum waveform wave);
+int waveform_parse(const char *name);
+int generator_voices(struct generator *gen, const struct voices *v);
+void generator_retune(struct generator *gen, struct generator *next);
+void osc_select(enum pack_kernel kernel);
+void bank_fill(struct bank *bank, double *out, int frames);
+void bank_free(struct bank *bank);
+
+/* pack.c */
+const char *pack_kernel_name(enum pack_kernel kernel);
+int pack_kernel_parse(const char *name);
+int pack_select(enum pack_kernel kernel);
+void pack_encode(const struct generator *gen, const double *in, uint32_t *out, int count);
+void pack_areas(const struct generator *gen, const uint32_t *words,
+                const snd_pcm_channel_area_t *areas,
+                snd_pcm_uframes_t offset, int count);
+void pack_frames(const struct generator *gen, const uint32_t *words,
+                 const snd_pcm_channel_area_t *areas,
+                 snd_pcm_uframes_t offset, int count);
+void pack_copy(const struct generator *gen, const unsigned char *src,
+               const snd_pcm_channel_area_t *areas,
+               snd_pcm_uframes_t offset, int count);
+void generate_sine(struct generator *gen,
+                   const snd_pcm_channel_area_t *areas,
+                   snd_pcm_uframes_t offset, int count);
+
+#endif //GENERATOR_H_
@@ -0,0 +1,229 @@
+/*
+ *  Prometheus text exposition of the stream metrics over HTTP, on a
+ *  loopback TCP port or a Unix socket.  Runs in its own thread and only
+ *  loads the counters the stream threads keep.
+ */
+
+#include "sineserver.h"
+#include <sys/un.h>
+
+#define   LE_FIRST      10                              /* buckets from 2^10ns, ~1us */
+#define   LE_LAST       30                              /* to 2^30ns, ~1s */
+
+#define   M(field)      offsetof(struct stream_metrics, field)
+
+static struct stream *mstreams;
+static unsigned int mnstreams;
+static struct stream *mmirrors;                         /* the streams again on the other interfaces */
+static unsigned int mnmirrors;
+static int listen_fd = -1;
+static pthread_t thread;
+static volatile int running;
+
+static uint64_t load(_Atomic uint64_t *c)
+{
+        return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void labels(FILE *f, const struct stream *s)
+{
+        fprintf(f, "{stream=\"%u\",id=\"0x%08x\"", s->index, s->id);
+        if (s->iface != NULL)
+                fprintf(f, ",iface=\"%s\"", s->iface);
+}
+
+/*
+ *   The i-th series of a family: every stream, then for the send metrics
+ *   every stream on each further interface.  NULL past the last.
+ */
+static struct stream *series(unsigned int i, size_t offset)
+{
+        if (i < mnstreams)
+                return &mstreams[i];
+        if (offset < M(send) || offset >= M(write) || i - mnstreams >= mnmirrors)
+                return NULL;
+        return &mmirrors[i - mnstreams];
+}
+
+/*
+ *   One counter or gauge family, picked out of every stream by offset
+ */
+static void family(FILE *f, const char *name, const char *type, const char *help, size_t offset)
+{
+        struct stream *s;
+        unsigned int i;
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        for (i = 0; (s = series(i, offset)) != NULL; i++) {
+                if (i >= mnstreams && s->source == NULL)
+                        continue;       /* a mirror of a stream that sends nothing */
+                fprintf(f, "%s", name);
+                labels(f, s);
+                fprintf(f, "} %llu\n", (unsigned long long)
+                        load((_Atomic uint64_t *)((char *)&s->metrics + offset)));
+        }
+}
+
+static void histogram(FILE *f, const char *name, const char *help, size_t offset)
+{
+        struct stream *s;
+        struct hist *h;
+        uint64_t seen, sum;
+        unsigned int i, k, b, next;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        for (i = 0; (s = series(i, offset)) != NULL; i++) {
+                if (i >= mnstreams && s->source == NULL)
+                        continue;
+                h = (struct hist *)((char *)&s->metrics + offset);
+                sum = load(&h->sum_ns);
+                seen = 0;
+                b = 0;
+                for (k = LE_FIRST; k <= LE_LAST; k++) {
+                        /* powers of two are bucket boundaries */
+                        for (next = hist_bucket(1ULL << k); b < next; b++)
+                                seen += load(&h->buckets[b]);
+                        fprintf(f, "%s_bucket", name);
+                        labels(f, s);
+                        fprintf(f, ",le=\"%g\"} %llu\n", (double)(1ULL << k) / 1e9, (unsigned long long)seen);
+                }
+                for (; b < HIST_BUCKETS; b++)
+                        seen += load(&h->buckets[b]);
+                fprintf(f, "%s_bucket", name);
+                labels(f, s);
+                fprintf(f, ",le=\"+Inf\"} %llu\n", (unsigned long long)seen);
+                fprintf(f, "%s_sum", name);
+                labels(f, s);
+                fprintf(f, "} %.9f\n", sum / 1e9);
+                fprintf(f, "%s_count", name);
+                labels(f, s);
+                fprintf(f, "} %llu\n", (unsigned long long)seen);
+        }
+}
+
+static void render(FILE *f)
+{
+        family(f, "sine_frames_generated_total", "counter", "Frames generated.", M(gen.frames));
+        family(f, "sine_payload_bytes_total", "counter", "Payload bytes given to the codec.", M(gen.raw_bytes));
+        family(f, "sine_coded_bytes_total", "counter", "Payload bytes the codec made of them.", M(gen.coded_bytes));
+        family(f, "sine_packets_sent_total", "counter", "Datagrams sent.", M(send.packets));
+        family(f, "sine_bytes_sent_total", "counter", "Bytes sent, headers included.", M(send.bytes));
+        family(f, "sine_send_eagain_total", "counter", "Sends that found the socket full.", M(send.eagain));
+        family(f, "sine_send_dropped_total", "counter", "Datagrams the kernel refused.", M(send.dropped));
+        family(f, "sine_subscribers", "gauge", "Unicast receivers.", M(send.subscribers));
+        family(f, "sine_frames_written_total", "counter", "Frames written to the local output.", M(write.frames));
+        family(f, "sine_write_eagain_total", "counter", "Writes that found the device full.", M(write.eagain));
+        family(f, "sine_xruns_total", "counter", "Device underruns.", M(write.xruns));
+        family(f, "sine_suspends_total", "counter", "Device suspends.", M(write.suspends));
+        histogram(f, "sine_generate_seconds", "Time to generate one period.", M(gen.generate));
+        histogram(f, "sine_encode_seconds", "Time to compress one period.", M(gen.encode));
+        histogram(f, "sine_send_seconds", "Time per send of a burst or period.", M(send.send));
+        histogram(f, "sine_write_seconds", "Time to write one period to the local output.", M(write.write));
+        histogram(f, "sine_lateness_seconds", "Release time behind the pacer deadline.", M(send.lateness));
+}
+
+static void serve(int fd)
+{
+        static const char head[] = "HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Connection: close\r\n\r\n";
+        struct timeval tv = { 1, 0 };
+        char req[1024], *body = NULL;
+        size_t len = 0, off;
+        ssize_t n;
+        FILE *f;
+        /* the request does not matter, every path gets the metrics */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (recv(fd, req, sizeof(req), 0) < 0)
+                return;
+        if ((f = open_memstream(&body, &len)) == NULL)
+                return;
+        fputs(head, f);
+        render(f);
+        fclose(f);
+        for (off = 0; off < len; off += n)
+                if ((n = send(fd, body + off, len - off, MSG_NOSIGNAL)) <= 0)
+                        break;
+        free(body);
+}
+
+static void *metrics_main(void *arg)
+{
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        int fd;
+        while (running) {
+                if (poll(&pfd, 1, 200) <= 0)
+                        continue;
+                if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+                        continue;
+                serve(fd);
+                close(fd);
+        }
+        return NULL;
+}
+
+/*
+ *   Listen on 'where': a path for a Unix socket, otherwise a TCP port on
+ *   the loopback interface.  The control socket listens the same way.
+ */
+int listen_local(const char *where)
+{
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+        int fd, on = 1;
+        if (strchr(where, '/') != NULL) {
+                memset(&un, 0, sizeof(un));
+                un.sun_family = AF_UNIX;
+                if (strlen(where) >= sizeof(un.sun_path))
+                        return -ENAMETOOLONG;
+                strcpy(un.sun_path, where);
+                unlink(where);
+                if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+                        return -errno;
+                if (bind(fd, (SA *)&un, sizeof(un)) < 0)
+                        goto fail;
+        } else {
+                memset(&in, 0, sizeof(in));
+                in.sin_family = AF_INET;
+                in.sin_port = htons(atoi(where));
+                in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+                        return -errno;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                if (bind(fd, (SA *)&in, sizeof(in)) < 0)
+                        goto fail;
+        }
+        if (listen(fd, 16) < 0)
+                goto fail;
+        return fd;
+fail:
+        on = -errno;
+        close(fd);
+        return on;
+}
+
+int metrics_start(const char *where, struct stream *streams, unsigned int nstreams,
+                  struct stream *mirrors, unsigned int nmirrors)
+{
+        int err;
+        mstreams = streams;
+        mnstreams = nstreams;
+        mmirrors = mirrors;
+        mnmirrors = nmirrors;
+        if ((listen_fd = listen_local(where)) < 0)
+                return listen_fd;
+        running = 1;
+        if ((err = pthread_create(&thread, NULL, metrics_main, NULL)) != 0) {
+                running = 0;
+                return -err;
+        }
+        return 0;
+}
+
+void metrics_stop(void)
+{
+        if (!running)
+                return;
+        running = 0;
+        pthread_join(thread, NULL);
+        close(listen_fd);
+}
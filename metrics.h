@@ -0,0 +1,102 @@
+#ifndef METRICS_H_   /* Include guard */
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ *  Per-stream counters and latency histograms.  Every group below is
+ *  written by exactly one thread (the generator, whoever sends and paces,
+ *  whoever writes the local output) and sits on its own cache lines, so
+ *  updates are plain relaxed load/store pairs without a locked
+ *  instruction; the metrics endpoint only loads them.
+ */
+#define   HIST_SUB_BITS 2                               /* 4 buckets per power of two */
+#define   HIST_SUB      (1 << HIST_SUB_BITS)
+#define   HIST_BUCKETS  ((36 - HIST_SUB_BITS + 1) * HIST_SUB)     /* up to 2^36ns, 68s */
+#define   METRICS_ALIGN 64
+
+struct hist {
+        _Atomic uint64_t count;
+        _Atomic uint64_t sum_ns;
+        _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+struct gen_metrics {
+        _Atomic uint64_t frames;                        /* frames generated */
+        _Atomic uint64_t raw_bytes;                     /* payload before compression */
+        _Atomic uint64_t coded_bytes;                   /* and after */
+        struct hist generate;                           /* time per period */
+        struct hist encode;                             /* compression time per period */
+} __attribute__((aligned(METRICS_ALIGN)));
+
+struct send_metrics {
+        _Atomic uint64_t packets;
+        _Atomic uint64_t bytes;
+        _Atomic uint64_t eagain;                        /* socket was full */
+        _Atomic uint64_t dropped;                       /* datagrams the kernel refused */
+        _Atomic uint64_t subscribers;
+        struct hist send;                               /* time per sendmmsg() round */
+        struct hist lateness;                           /* pacer release vs deadline */
+} __attribute__((aligned(METRICS_ALIGN)));
+
+struct write_metrics {
+        _Atomic uint64_t frames;                        /* frames written to the output */
+        _Atomic uint64_t eagain;
+        _Atomic uint64_t xruns;
+        _Atomic uint64_t suspends;
+        struct hist write;                              /* time per period */
+} __attribute__((aligned(METRICS_ALIGN)));
+
+struct stream_metrics {
+        struct gen_metrics gen;
+        struct send_metrics send;
+        struct write_metrics write;
+};
+
+/*
+ *   Single writer, so no read-modify-write is needed
+ */
+static inline void metric_add(_Atomic uint64_t *c, uint64_t n)
+{
+        atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+}
+
+static inline void metric_set(_Atomic uint64_t *c, uint64_t v)
+{
+        atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+/*
+ *   Log-linear bucket of a value: exact below HIST_SUB, then HIST_SUB
+ *   buckets per power of two
+ */
+static inline unsigned int hist_bucket(uint64_t ns)
+{
+        unsigned int e;
+        if (ns < HIST_SUB)
+                return ns;
+        e = 63 - __builtin_clzll(ns);
+        if (e > 35)
+                return HIST_BUCKETS - 1;
+        return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_record(struct hist *h, long long ns)
+{
+        if (ns < 0)
+                ns = 0;
+        metric_add(&h->buckets[hist_bucket(ns)], 1);
+        metric_add(&h->sum_ns, ns);
+        metric_add(&h->count, 1);
+}
+
+struct stream;
+
+int listen_local(const char *where);
+int metrics_start(const char *where, struct stream *streams, unsigned int nstreams,
+                  struct stream *mirrors, unsigned int nmirrors);
+void metrics_stop(void);
+
+#endif //METRICS_H_
@@ -0,0 +1,472 @@
+/*
+ *  Oscillator bank: per channel frequency, phase and amplitude, tones
+ *  summed per channel, square, saw and noise waveforms and linear sweeps.
+ *
+ *  The state is a structure of arrays with one entry per oscillator,
+ *  tone t of channel c being oscillator t * channels + c.  A frame is
+ *  built one tone row at a time, so neighbouring channels sit in
+ *  neighbouring SIMD lanes: the AVX2 kernel advances four phase
+ *  accumulators, gathers four table points and evaluates four samples
+ *  per instruction.  The scalar kernel does the same arithmetic a lane at
+ *  a time and produces the same bits.
+ */
+
+#include "sineserver.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define   HAVE_X86 1
+#endif
+
+#define   ONE_BITS   0x3ff0000000000000ULL      /* 1.0, or'ed with 52 fraction bits gives [1, 2) */
+#define   SIGN_BIT   0x8000000000000000ULL
+
+struct bank {
+        enum waveform wave;
+        unsigned int channels;
+        unsigned int tones;             /* rows of oscillators */
+        uint64_t *acc;                  /* phase accumulators, 2^64 a cycle; noise state */
+        uint64_t *inc;                  /* accumulator step per frame */
+        uint64_t *inc0;                 /* step at the start of a sweep */
+        uint64_t *dinc;                 /* step change per frame, two's complement */
+        double *amp;
+        uint64_t sweep_frames;          /* sweep length, 0 for none */
+        uint64_t sweep_pos;
+};
+
+typedef void (*row_fn)(enum waveform wave, uint64_t *acc, const uint64_t *inc,
+                       const double *amp, double *out, unsigned int n, int add);
+
+static const char *wave_names[WAVE_LAST] = {
+        [WAVE_SINE] = "sine",
+        [WAVE_SQUARE] = "square",
+        [WAVE_SAW] = "saw",
+        [WAVE_NOISE] = "noise",
+};
+
+const char *waveform_name(enum waveform wave)
+{
+        return wave < WAVE_LAST ? wave_names[wave] : NULL;
+}
+
+int waveform_parse(const char *name)
+{
+        int wave;
+        for (wave = 0; wave < WAVE_LAST; wave++)
+                if (!strcasecmp(wave_names[wave], name))
+                        return wave;
+        return -EINVAL;
+}
+
+static inline double unit(uint64_t bits)
+{
+        double x;
+        bits = ONE_BITS | bits >> 12;
+        memcpy(&x, &bits, sizeof(x));
+        return x;               /* [1, 2) */
+}
+
+/*
+ *   One oscillator, one frame.  The sine is the table engine of
+ *   generator.c with the offset taken from the top 52 fraction bits.
+ */
+static inline double lane(enum waveform wave, uint64_t *acc, uint64_t inc)
+{
+        const double step = 2. * M_PI / TABLE_SIZE;
+        uint64_t a = *acc;
+        unsigned int idx;
+        double x, d, d2;
+        switch (wave) {
+        case WAVE_SQUARE:
+                x = (a & SIGN_BIT) ? -1. : 1.;
+                break;
+        case WAVE_SAW:
+                x = unit(a ^ SIGN_BIT) * 2. - 3.;
+                break;
+        case WAVE_NOISE:
+                a ^= a << 13;
+                a ^= a >> 7;
+                a ^= a << 17;
+                *acc = a;
+                return unit(a) * 2. - 3.;
+        default:
+                idx = a >> FRAC_BITS;
+                d = (unit(a << TABLE_BITS) - 1.) * step;
+                d2 = d * d;
+                x = sine_table[idx].s * (1. - d2 * 0.5) +
+                    sine_table[idx].c * d * (1. - d2 * (1. / 6.));
+                break;
+        }
+        *acc = a + inc;
+        return x;
+}
+
+static void row_scalar(enum waveform wave, uint64_t *acc, const uint64_t *inc,
+                       const double *amp, double *out, unsigned int n, int add)
+{
+        unsigned int i;
+        double x;
+        for (i = 0; i < n; i++) {
+                x = lane(wave, &acc[i], inc[i]) * amp[i];
+                out[i] = add ? out[i] + x : x;
+        }
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2"), always_inline))
+static inline void row_avx2_wave(enum waveform wave, uint64_t *acc, const uint64_t *inc,
+                                 const double *amp, double *out, unsigned int n, int add)
+{
+        const __m256i one_bits = _mm256_set1_epi64x(ONE_BITS);
+        const __m256i sign = _mm256_set1_epi64x(SIGN_BIT);
+        const __m256d one = _mm256_set1_pd(1.), two = _mm256_set1_pd(2.), three = _mm256_set1_pd(3.);
+        const __m256d half = _mm256_set1_pd(0.5), sixth = _mm256_set1_pd(1. / 6.);
+        const __m256d step = _mm256_set1_pd(2. * M_PI / TABLE_SIZE);
+        unsigned int i;
+        for (i = 0; i + 4 <= n; i += 4) {
+                __m256i a = _mm256_loadu_si256((const __m256i *)&acc[i]);
+                __m256i idx;
+                __m256d x, s, c, d, d2;
+                switch (wave) {
+                case WAVE_SQUARE:
+                        x = _mm256_castsi256_pd(_mm256_or_si256(_mm256_castpd_si256(one),
+                                                                _mm256_and_si256(a, sign)));
+                        break;
+                case WAVE_SAW:
+                        x = _mm256_castsi256_pd(_mm256_or_si256(one_bits,
+                                        _mm256_srli_epi64(_mm256_xor_si256(a, sign), 12)));
+                        x = _mm256_sub_pd(_mm256_mul_pd(x, two), three);
+                        break;
+                case WAVE_NOISE:
+                        a = _mm256_xor_si256(a, _mm256_slli_epi64(a, 13));
+                        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 7));
+                        a = _mm256_xor_si256(a, _mm256_slli_epi64(a, 17));
+                        x = _mm256_castsi256_pd(_mm256_or_si256(one_bits, _mm256_srli_epi64(a, 12)));
+                        x = _mm256_sub_pd(_mm256_mul_pd(x, two), three);
+                        break;
+                default:
+                        /* sin and cos of a point are doubles 2 idx and 2 idx + 1 */
+                        idx = _mm256_slli_epi64(_mm256_srli_epi64(a, FRAC_BITS), 1);
+                        s = _mm256_i64gather_pd((const double *)sine_table, idx, 8);
+                        c = _mm256_i64gather_pd((const double *)sine_table + 1, idx, 8);
+                        d = _mm256_castsi256_pd(_mm256_or_si256(one_bits,
+                                        _mm256_srli_epi64(_mm256_slli_epi64(a, TABLE_BITS), 12)));
+                        d = _mm256_mul_pd(_mm256_sub_pd(d, one), step);
+                        d2 = _mm256_mul_pd(d, d);
+                        x = _mm256_add_pd(_mm256_mul_pd(s, _mm256_sub_pd(one, _mm256_mul_pd(d2, half))),
+                                          _mm256_mul_pd(_mm256_mul_pd(c, d),
+                                                        _mm256_sub_pd(one, _mm256_mul_pd(d2, sixth))));
+                        break;
+                }
+                if (wave != WAVE_NOISE)
+                        a = _mm256_add_epi64(a, _mm256_loadu_si256((const __m256i *)&inc[i]));
+                _mm256_storeu_si256((__m256i *)&acc[i], a);
+                x = _mm256_mul_pd(x, _mm256_loadu_pd(&amp[i]));
+                if (add)
+                        x = _mm256_add_pd(_mm256_loadu_pd(&out[i]), x);
+                _mm256_storeu_pd(&out[i], x);
+        }
+        row_scalar(wave, acc + i, inc + i, amp + i, out + i, n - i, add);
+}
+
+/*
+ *   One copy of the loop per wave shape, so the shape is not tested per lane
+ */
+__attribute__((target("avx2")))
+static void row_avx2(enum waveform wave, uint64_t *acc, const uint64_t *inc,
+                     const double *amp, double *out, unsigned int n, int add)
+{
+        switch (wave) {
+        case WAVE_SQUARE:
+                row_avx2_wave(WAVE_SQUARE, acc, inc, amp, out, n, add);
+                break;
+        case WAVE_SAW:
+                row_avx2_wave(WAVE_SAW, acc, inc, amp, out, n, add);
+                break;
+        case WAVE_NOISE:
+                row_avx2_wave(WAVE_NOISE, acc, inc, amp, out, n, add);
+                break;
+        default:
+                row_avx2_wave(WAVE_SINE, acc, inc, amp, out, n, add);
+                break;
+        }
+}
+#endif
+
+static row_fn row = row_scalar;
+
+/*
+ *   Follow the packing kernel choice of pack_select()
+ */
+void osc_select(enum pack_kernel kernel)
+{
+#ifdef HAVE_X86
+        if (kernel == KERNEL_AVX2) {
+                row = row_avx2;
+                return;
+        }
+#endif
+        row = row_scalar;
+}
+
+/*
+ *   'frames' interleaved frames of every channel in [-1, 1]
+ */
+void bank_fill(struct bank *b, double *out, int frames)
+{
+        unsigned int ch = b->channels, t, i;
+        int f;
+        for (f = 0; f < frames; f++, out += ch) {
+                for (t = 0; t < b->tones; t++)
+                        row(b->wave, b->acc + t * ch, b->inc + t * ch, b->amp + t * ch, out, ch, t > 0);
+                if (b->sweep_frames == 0)
+                        continue;
+                if (++b->sweep_pos == b->sweep_frames) {
+                        b->sweep_pos = 0;
+                        memcpy(b->inc, b->inc0, b->tones * ch * sizeof(*b->inc));
+                } else {
+                        for (i = 0; i < b->tones * ch; i++)
+                                b->inc[i] += b->dinc[i];
+                }
+        }
+}
+
+void bank_free(struct bank *b)
+{
+        if (b == NULL)
+                return;
+        free(b->acc);
+        free(b->inc);
+        free(b->inc0);
+        free(b->dinc);
+        free(b->amp);
+        free(b);
+}
+
+/*
+ *   Entry n of a ',' separated list, repeating the list when it is shorter
+ */
+static const char *entry(const char *list, unsigned int n)
+{
+        unsigned int count = 1;
+        const char *p;
+        for (p = list; *p; p++)
+                count += *p == ',';
+        for (n %= count, p = list; n > 0; p++)
+                n -= *p == ',';
+        return p;
+}
+
+static int number(const char **p, const char *what, double min, double max, double *v)
+{
+        char *end;
+        *v = strtod(*p, &end);
+        if (end == *p || *v < min || *v > max) {
+                printf("Invalid %s '%.*s', expected %g to %g\n", what,
+                       (int)strcspn(*p, ","), *p, min, max);
+                return -EINVAL;
+        }
+        *p = end;
+        return 0;
+}
+
+static int list_end(const char *p, const char *what)
+{
+        if (*p == ',' || *p == '\0')
+                return 0;
+        printf("Invalid %s at '%s'\n", what, p);
+        return -EINVAL;
+}
+
+/*
+ *   Tones of one channel: F[~F1][+F[~F1]]...
+ */
+static int parse_tones(const char *p, double nyquist, double *f0, double *f1, int *sweeps)
+{
+        int n = 0, err;
+        while (1) {
+                if (n == MAX_TONES) {
+                        printf("More than %d tones in one channel\n", MAX_TONES);
+                        return -EINVAL;
+                }
+                if ((err = number(&p, "frequency", 0, nyquist, &f0[n])) < 0)
+                        return err;
+                f1[n] = f0[n];
+                if (*p == '~') {
+                        p++;
+                        if ((err = number(&p, "frequency", 0, nyquist, &f1[n])) < 0)
+                                return err;
+                        *sweeps = 1;
+                }
+                n++;
+                if (*p != '+')
+                        break;
+                p++;
+        }
+        return (err = list_end(p, "frequency list")) < 0 ? err : n;
+}
+
+/*
+ *   'fraction' of a turn as a 64 bit accumulator value, modulo one turn,
+ *   so a negative fraction comes out as its two's complement
+ */
+static uint64_t cycles(double fraction)
+{
+        fraction -= floor(fraction);
+        /* a tiny negative fraction rounds up to a whole turn */
+        return fraction < 1. ? (uint64_t)ldexp(fraction, 64) : 0;
+}
+
+/*
+ *   Set up what every channel plays.  One sine at full scale on all
+ *   channels stays on the engine of generator_init(), anything else gets
+ *   an oscillator bank.
+ */
+int generator_voices(struct generator *gen, const struct voices *v)
+{
+        unsigned int ch = gen->channels, c, t, o, tones = 1, n;
+        double f0[MAX_TONES], f1[MAX_TONES], a, deg, nyquist = gen->rate / 2.;
+        const char *p;
+        int sweeps = 0, uniform = v->wave == WAVE_SINE, err;
+        struct bank *b;
+        uint64_t cycle = 1;
+        size_t bytes;
+
+        /* first pass: validate and size the bank */
+        for (c = 0; c < ch; c++) {
+                if ((err = parse_tones(entry(v->freqs, c), nyquist, f0, f1, &sweeps)) < 0)
+                        return err;
+                tones = (unsigned int)err > tones ? (unsigned int)err : tones;
+                uniform &= err == 1 && f0[0] == strtod(v->freqs, NULL);
+                if (v->amps != NULL) {
+                        p = entry(v->amps, c);
+                        if ((err = number(&p, "amplitude", 0, 1, &a)) < 0 ||
+                            (err = list_end(p, "amplitude list")) < 0)
+                                return err;
+                        uniform &= a == 1.;
+                }
+                if (v->phases != NULL) {
+                        p = entry(v->phases, c);
+                        if ((err = number(&p, "phase", -360, 360, &deg)) < 0 ||
+                            (err = list_end(p, "phase list")) < 0)
+                                return err;
+                        uniform &= deg == 0.;
+                }
+        }
+        if (sweeps && v->sweep <= 0) {
+                printf("Frequency sweeps need a sweep time\n");
+                return -EINVAL;
+        }
+        if (uniform && !sweeps) {
+                generator_init(gen, gen->engine, gen->format, ch, gen->rate, strtod(v->freqs, NULL));
+                return 0;
+        }
+        if (v->wave == WAVE_NOISE)
+                tones = 1;
+
+        b = calloc(1, sizeof(*b));
+        if (b == NULL)
+                return -ENOMEM;
+        n = tones * ch;
+        bytes = (n * sizeof(uint64_t) + 31) & ~31;
+        b->acc = aligned_alloc(32, bytes);
+        b->inc = aligned_alloc(32, bytes);
+        b->inc0 = aligned_alloc(32, bytes);
+        b->dinc = aligned_alloc(32, bytes);
+        b->amp = aligned_alloc(32, bytes);
+        if (b->acc == NULL || b->inc == NULL || b->inc0 == NULL || b->dinc == NULL || b->amp == NULL) {
+                bank_free(b);
+                return -ENOMEM;
+        }
+        memset(b->acc, 0, bytes);
+        memset(b->inc, 0, bytes);
+        memset(b->dinc, 0, bytes);
+        memset(b->amp, 0, bytes);
+        b->wave = v->wave;
+        b->channels = ch;
+        b->tones = tones;
+        b->sweep_frames = sweeps ? (uint64_t)llround(v->sweep * gen->rate) : 0;
+        if (sweeps && b->sweep_frames == 0)
+                b->sweep_frames = 1;
+        if (sweeps)
+                cycle = 0;      /* the phase at the end of a sweep does not come round */
+
+        /* second pass: the lists are known to parse */
+        for (c = 0; c < ch; c++) {
+                n = parse_tones(entry(v->freqs, c), nyquist, f0, f1, &sweeps);
+                a = 1.;
+                deg = 0.;
+                if (v->amps != NULL)
+                        a = strtod(entry(v->amps, c), NULL);
+                if (v->phases != NULL)
+                        deg = strtod(entry(v->phases, c), NULL);
+                if (v->wave == WAVE_NOISE) {
+                        /* any non-zero seed, distinct per channel */
+                        b->acc[c] = (c + 1) * 0x9e3779b97f4a7c15ULL;
+                        b->amp[c] = a;
+                        cycle = 0;
+                        continue;
+                }
+                for (t = 0; t < n; t++) {
+                        o = t * ch + c;
+                        cycle = frames_lcm(cycle, cycle_frames(f0[t], gen->rate));
+                        b->acc[o] = cycles(deg / 360.);
+                        b->inc[o] = cycles(f0[t] / gen->rate);
+                        if (b->sweep_frames)
+                                b->dinc[o] = cycles((f1[t] - f0[t]) / gen->rate / b->sweep_frames);
+                        b->amp[o] = a / n;
+                }
+        }
+        memcpy(b->inc0, b->inc, tones * ch * sizeof(*b->inc));
+        sine_table_init();
+        gen->cycle = cycle;
+        bank_free(gen->bank);
+        gen->bank = b;
+        return 0;
+}
+
+/*
+ *   Switch gen over to 'next', built by generator_init() and
+ *   generator_voices() away from the generating thread, keeping the
+ *   phase of every oscillator both have so the wave does not click.  A
+ *   replay cache holds the wave from where its oscillators stand, so the
+ *   old phase is as far on as the replay got, and a single sine with a
+ *   cache of its own resumes from the frame at that phase.  The old state
+ *   ends up in 'next' for the caller to free.
+ */
+void generator_retune(struct generator *gen, struct generator *next)
+{
+        const double turn = 2. * M_PI;
+        struct generator old = *gen;
+        uint64_t acc;
+        unsigned int o, n;
+        acc = old.engine == ENGINE_LIBM && old.bank == NULL ? cycles(old.phase / turn) : old.acc;
+        if (old.cache_frames != 0 && old.file == NULL) {
+                acc += old.cache_pos * old.inc;
+                for (o = 0; old.bank != NULL && o < old.bank->tones * old.bank->channels; o++)
+                        old.bank->acc[o] += old.cache_pos * old.bank->inc[o];
+        }
+        if (next->cache != NULL) {
+                if (old.bank != NULL && old.bank->wave == WAVE_SINE)
+                        acc = old.bank->acc[0];
+                if (next->bank == NULL && (old.bank == NULL || old.bank->wave == WAVE_SINE))
+                        next->cache_pos = (uint64_t)llround(ldexp((double)(acc - next->acc), -64) *
+                                                            next->rate / next->freq) % next->cache_frames;
+        } else if (old.bank != NULL && next->bank != NULL && old.bank->wave == next->bank->wave) {
+                n = old.bank->tones * old.bank->channels;
+                n = n < next->bank->tones * next->bank->channels ? n : next->bank->tones * next->bank->channels;
+                memcpy(next->bank->acc, old.bank->acc, n * sizeof(*old.bank->acc));
+        } else if (old.bank == NULL && next->bank != NULL && next->bank->wave == WAVE_SINE) {
+                for (o = 0; o < next->bank->tones * next->bank->channels; o++)
+                        next->bank->acc[o] = acc;
+        } else if (next->bank == NULL) {
+                if (old.bank != NULL && old.bank->wave == WAVE_SINE)
+                        acc = old.bank->acc[0];
+                if (old.bank == NULL || old.bank->wave == WAVE_SINE) {
+                        next->acc = acc;
+                        next->phase = ldexp((double)acc, -64) * turn;
+                }
+        }
+        *gen = *next;
+        *next = old;
+}
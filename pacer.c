@@ -0,0 +1,155 @@
+/*
+ *  Clock-paced release of periods and packets when no device provides
+ *  backpressure.
+ */
+
+#include "sineserver.h"
+
+#define   NSEC 1000000000LL
+
+static long long ts_ns(const struct timespec *ts)
+{
+        return ts->tv_sec * NSEC + ts->tv_nsec;
+}
+
+static struct timespec ns_ts(long long ns)
+{
+        struct timespec ts = { ns / NSEC, ns % NSEC };
+        return ts;
+}
+
+void pacer_init(struct pacer *p, unsigned int rate, long spin_ns, long max_late_ns)
+{
+        memset(p, 0, sizeof(*p));
+        p->rate = rate;
+        p->spin_ns = spin_ns;
+        p->max_late_ns = max_late_ns;
+        clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+/*
+ *   Offset of 'frame' from the start, exact for any stream length
+ */
+static long long frame_ns(const struct pacer *p, uint64_t frame)
+{
+        return (long long)(frame / p->rate) * NSEC +
+               (long long)(frame % p->rate) * NSEC / p->rate;
+}
+
+/*
+ *   Count one release 'late' ns after its deadline, or any other delay
+ *   that wants the same histogram
+ */
+void pacer_record(struct pacer *p, long long late)
+{
+        unsigned int us = late / 1000, bucket;
+        if (us < PACER_LINEAR)
+                bucket = us;
+        else {
+                bucket = PACER_LINEAR + (31 - __builtin_clz(us / PACER_LINEAR));
+                if (bucket >= PACER_BUCKETS)
+                        bucket = PACER_BUCKETS - 1;
+        }
+        p->hist[bucket]++;
+        p->count++;
+        if ((uint64_t)late > p->late_max_ns)
+                p->late_max_ns = late;
+}
+
+/*
+ *   Absolute CLOCK_MONOTONIC time 'frame' is due, in ns
+ */
+long long pacer_deadline(const struct pacer *p, uint64_t frame)
+{
+        return ts_ns(&p->start) + frame_ns(p, frame);
+}
+
+/*
+ *   Block until 'frame' is due, returns how late we are in ns.  Behind
+ *   schedule it returns at once so the sender catches up; more than
+ *   max_late_ns behind, the clock starts over from now.
+ */
+long pacer_wait(struct pacer *p, uint64_t frame)
+{
+        long long deadline = pacer_deadline(p, frame);
+        struct timespec ts, now;
+        long long late;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (deadline - ts_ns(&now) > p->spin_ns) {
+                ts = ns_ts(deadline - p->spin_ns);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                        ;
+        }
+        do
+                clock_gettime(CLOCK_MONOTONIC, &now);
+        while (ts_ns(&now) < deadline);
+        late = ts_ns(&now) - deadline;
+        if (p->max_late_ns > 0 && late > p->max_late_ns) {
+                p->start = ns_ts(ts_ns(&now) - frame_ns(p, frame));
+                p->resyncs++;
+        }
+        pacer_record(p, late);
+        return late;
+}
+
+/*
+ *   Add the statistics of 'src' to 'dst', e.g. to report all streams at once
+ */
+void pacer_merge(struct pacer *dst, const struct pacer *src)
+{
+        unsigned int i;
+        for (i = 0; i < PACER_BUCKETS; i++)
+                dst->hist[i] += src->hist[i];
+        dst->count += src->count;
+        dst->resyncs += src->resyncs;
+        if (src->late_max_ns > dst->late_max_ns)
+                dst->late_max_ns = src->late_max_ns;
+}
+
+static uint64_t bucket_floor_us(unsigned int bucket)
+{
+        if (bucket < PACER_LINEAR)
+                return bucket;
+        return (uint64_t)PACER_LINEAR << (bucket - PACER_LINEAR);
+}
+
+/*
+ *   Smallest bucket holding the q-quantile of the releases
+ */
+uint64_t pacer_quantile_us(const struct pacer *p, double q)
+{
+        uint64_t seen = 0, want = q * p->count;
+        unsigned int i;
+        for (i = 0; i < PACER_BUCKETS; i++) {
+                seen += p->hist[i];
+                if (seen > want)
+                        return bucket_floor_us(i);
+        }
+        return bucket_floor_us(PACER_BUCKETS - 1);
+}
+
+void pacer_report(const struct pacer *p, const char *what, FILE *f)
+{
+        unsigned int i;
+        if (p->count == 0)
+                return;
+        fprintf(f, "%s over %llu releases: p50 %lluus p99 %lluus p99.9 %lluus max %.1fus, %llu restarts\n",
+                what, (unsigned long long)p->count,
+                (unsigned long long)pacer_quantile_us(p, 0.5),
+                (unsigned long long)pacer_quantile_us(p, 0.99),
+                (unsigned long long)pacer_quantile_us(p, 0.999),
+                p->late_max_ns / 1e3, (unsigned long long)p->resyncs);
+        for (i = 0; i < PACER_BUCKETS; i++) {
+                if (p->hist[i] == 0)
+                        continue;
+                if (i + 1 < PACER_BUCKETS)
+                        fprintf(f, "  %7lluus - %7lluus: %llu\n",
+                                (unsigned long long)bucket_floor_us(i),
+                                (unsigned long long)bucket_floor_us(i + 1),
+                                (unsigned long long)p->hist[i]);
+                else
+                        fprintf(f, "  %7lluus -          : %llu\n",
+                                (unsigned long long)bucket_floor_us(i),
+                                (unsigned long long)p->hist[i]);
+        }
+}
@@ -0,0 +1,35 @@
+#ifndef PACER_H_   /* Include guard */
+#define PACER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define   PACER_LINEAR  100     /* 1us buckets below 100us */
+#define   PACER_LOG     24      /* then one bucket per power of two */
+#define   PACER_BUCKETS (PACER_LINEAR + PACER_LOG)
+
+/*
+ *  Releases frames at absolute CLOCK_MONOTONIC deadlines derived from the
+ *  frame count, so a late wakeup never shifts the ones after it.
+ */
+struct pacer {
+        struct timespec start;          /* deadline of frame 0 */
+        unsigned int rate;
+        long spin_ns;                   /* busy-poll this long before a deadline */
+        long max_late_ns;               /* later than this restarts the clock */
+        uint64_t resyncs;
+        uint64_t count;
+        uint64_t late_max_ns;
+        uint64_t hist[PACER_BUCKETS];   /* lateness of every release */
+};
+
+void pacer_init(struct pacer *p, unsigned int rate, long spin_ns, long max_late_ns);
+long long pacer_deadline(const struct pacer *p, uint64_t frame);
+long pacer_wait(struct pacer *p, uint64_t frame);
+void pacer_record(struct pacer *p, long long late);
+void pacer_merge(struct pacer *dst, const struct pacer *src);
+uint64_t pacer_quantile_us(const struct pacer *p, double q);
+void pacer_report(const struct pacer *p, const char *what, FILE *f);
+
+#endif //PACER_H_
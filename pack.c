@@ -0,0 +1,419 @@
+/*
+ *  Sample packing: convert a block of synthesised frames to the stream
+ *  format and broadcast every sample across the channels of a frame.
+ *
+ *  pack_encode() turns doubles into 'words', each holding one sample the
+ *  way it is stored in memory (byte swapped when the format endianness
+ *  differs from the host).  pack_areas() then writes the words into the
+ *  channel areas.  Interleaved buffers with 8, 16 or 32 bit samples go
+ *  through the broadcast kernels, which store a repeated 32 bit pattern
+ *  with the widest stores the CPU offers; everything else takes the
+ *  per-channel scatter path.  Channels fed by an oscillator bank have a
+ *  word per sample rather than per frame and go through pack_frames().
+ */
+
+#include "sineserver.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define   HAVE_X86 1
+#endif
+
+typedef void (*encode_fn)(const struct generator *gen, const double *in,
+                          uint32_t *out, int count);
+typedef void (*bcast_fn)(const uint32_t *words, int count,
+                         unsigned int reps, unsigned char *dst);
+
+static const char *kernel_names[KERNEL_LAST] = {
+        [KERNEL_AUTO] = "auto",
+        [KERNEL_SCALAR] = "scalar",
+        [KERNEL_SSE2] = "sse2",
+        [KERNEL_AVX2] = "avx2",
+};
+
+static inline uint32_t swap_word(const struct generator *gen, uint32_t v)
+{
+        switch (gen->phys_bytes) {
+        case 2:
+                return __builtin_bswap16(v);
+        case 4:
+                return __builtin_bswap32(v);
+        default:
+                return v;       /* 1 byte needs none, 3 bytes are ordered on store */
+        }
+}
+
+static void encode_scalar(const struct generator *gen, const double *in,
+                          uint32_t *out, int count)
+{
+        int i;
+        if (gen->is_float) {
+                for (i = 0; i < count; i++) {
+                        float f = in[i];
+                        memcpy(&out[i], &f, sizeof(f));
+                }
+        } else {
+                for (i = 0; i < count; i++)
+                        out[i] = ((uint32_t)(int32_t)(in[i] * gen->maxval) ^ gen->flip) & gen->mask;
+        }
+        if (gen->swap && gen->phys_bytes != 3)
+                for (i = 0; i < count; i++)
+                        out[i] = swap_word(gen, out[i]);
+}
+
+/*
+ *   One word per frame, repeated 'reps' times
+ */
+static void bcast_scalar(const uint32_t *words, int count,
+                         unsigned int reps, unsigned char *dst)
+{
+        unsigned int r;
+        int k;
+        if (reps == 1) {
+                memcpy(dst, words, count * sizeof(*words));
+                return;
+        }
+        for (k = 0; k < count; k++) {
+                uint64_t pair = words[k] | (uint64_t)words[k] << 32;
+                for (r = 0; r + 2 <= reps; r += 2, dst += 8)
+                        memcpy(dst, &pair, 8);
+                if (r < reps) {
+                        memcpy(dst, &words[k], 4);
+                        dst += 4;
+                }
+        }
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void bcast_sse2(const uint32_t *words, int count,
+                       unsigned int reps, unsigned char *dst)
+{
+        unsigned int r;
+        int k = 0;
+        if (reps < 4) {
+                bcast_scalar(words, count, reps, dst);
+                return;
+        }
+        for (; k < count; k++) {
+                __m128i v = _mm_set1_epi32(words[k]);
+                for (r = 0; r + 4 <= reps; r += 4, dst += 16)
+                        _mm_storeu_si128((__m128i *)dst, v);
+                for (; r < reps; r++, dst += 4)
+                        memcpy(dst, &words[k], 4);
+        }
+}
+
+__attribute__((target("avx2")))
+static void bcast_avx2(const uint32_t *words, int count,
+                       unsigned int reps, unsigned char *dst)
+{
+        unsigned int r;
+        int k = 0;
+        switch (reps) {
+        case 1:
+                memcpy(dst, words, count * sizeof(*words));
+                return;
+        case 2:
+        case 4: {
+                /* several frames per store: w0 w0 w1 w1 ... or w0 w0 w0 w0 w1 ... */
+                const __m256i idx = reps == 2 ?
+                        _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3) :
+                        _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+                int per_store = 8 / reps;
+                for (; k + 4 <= count; k += per_store, dst += 32) {
+                        __m128i w = _mm_loadu_si128((const __m128i *)&words[k]);
+                        _mm256_storeu_si256((__m256i *)dst,
+                                _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(w), idx));
+                }
+                bcast_scalar(words + k, count - k, reps, dst);
+                return;
+        }
+        }
+        if (reps < 8) {
+                bcast_scalar(words, count, reps, dst);
+                return;
+        }
+        for (; k < count; k++) {
+                __m256i v = _mm256_set1_epi32(words[k]);
+                for (r = 0; r + 8 <= reps; r += 8, dst += 32)
+                        _mm256_storeu_si256((__m256i *)dst, v);
+                if (r + 4 <= reps) {
+                        _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+                        r += 4;
+                        dst += 16;
+                }
+                for (; r < reps; r++, dst += 4)
+                        memcpy(dst, &words[k], 4);
+        }
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(const struct generator *gen, const double *in,
+                        uint32_t *out, int count)
+{
+        const __m128i swap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                             11, 10, 9, 8, 15, 14, 13, 12);
+        const __m128i swap16 = _mm_setr_epi8(1, 0, -1, -1, 5, 4, -1, -1,
+                                             9, 8, -1, -1, 13, 12, -1, -1);
+        const __m256d scale = _mm256_set1_pd(gen->maxval);
+        const __m128i flip = _mm_set1_epi32(gen->flip);
+        const __m128i mask = _mm_set1_epi32(gen->mask);
+        int swap = gen->swap ? gen->phys_bytes : 0;
+        int i;
+        if (swap == 3) {
+                encode_scalar(gen, in, out, count);
+                return;
+        }
+        for (i = 0; i + 4 <= count; i += 4) {
+                __m256d x = _mm256_loadu_pd(&in[i]);
+                __m128i v;
+                if (gen->is_float)
+                        v = _mm_castps_si128(_mm256_cvtpd_ps(x));
+                else
+                        v = _mm_and_si128(_mm_xor_si128(_mm256_cvttpd_epi32(_mm256_mul_pd(x, scale)),
+                                                        flip), mask);
+                if (swap == 4)
+                        v = _mm_shuffle_epi8(v, swap32);
+                else if (swap == 2)
+                        v = _mm_shuffle_epi8(v, swap16);
+                _mm_storeu_si128((__m128i *)&out[i], v);
+        }
+        encode_scalar(gen, in + i, out + i, count - i);
+}
+#endif
+
+static encode_fn encode = encode_scalar;
+static bcast_fn bcast = bcast_scalar;
+
+const char *pack_kernel_name(enum pack_kernel kernel)
+{
+        return kernel < KERNEL_LAST ? kernel_names[kernel] : NULL;
+}
+
+int pack_kernel_parse(const char *name)
+{
+        int kernel;
+        for (kernel = 0; kernel < KERNEL_LAST; kernel++)
+                if (!strcasecmp(kernel_names[kernel], name))
+                        return kernel;
+        return -EINVAL;
+}
+
+/*
+ *   Pick the packing kernels, returns the one chosen or -ENOTSUP
+ */
+int pack_select(enum pack_kernel kernel)
+{
+#ifdef HAVE_X86
+        __builtin_cpu_init();
+        if (kernel == KERNEL_AUTO)
+                kernel = __builtin_cpu_supports("avx2") ? KERNEL_AVX2 :
+                         __builtin_cpu_supports("sse2") ? KERNEL_SSE2 : KERNEL_SCALAR;
+        switch (kernel) {
+        case KERNEL_AVX2:
+                if (!__builtin_cpu_supports("avx2"))
+                        return -ENOTSUP;
+                encode = encode_avx2;
+                bcast = bcast_avx2;
+                osc_select(kernel);
+                return kernel;
+        case KERNEL_SSE2:
+                if (!__builtin_cpu_supports("sse2"))
+                        return -ENOTSUP;
+                encode = encode_scalar;
+                bcast = bcast_sse2;
+                osc_select(kernel);
+                return kernel;
+        default:
+                break;
+        }
+#else
+        if (kernel != KERNEL_AUTO && kernel != KERNEL_SCALAR)
+                return -ENOTSUP;
+#endif
+        encode = encode_scalar;
+        bcast = bcast_scalar;
+        osc_select(KERNEL_SCALAR);
+        return KERNEL_SCALAR;
+}
+
+void pack_encode(const struct generator *gen, const double *in, uint32_t *out, int count)
+{
+        encode(gen, in, out, count);
+}
+
+/*
+ *   Store one word as a sample of 1 to 4 bytes
+ */
+static void scatter(const struct generator *gen, const uint32_t *words,
+                    unsigned char *dst, int step, int count)
+{
+        int k;
+        switch (gen->phys_bytes) {
+        case 1:
+                for (k = 0; k < count; k++, dst += step)
+                        *dst = words[k];
+                break;
+        case 2:
+                for (k = 0; k < count; k++, dst += step) {
+                        uint16_t v = words[k];
+                        memcpy(dst, &v, 2);
+                }
+                break;
+        case 3:
+                for (k = 0; k < count; k++, dst += step) {
+                        uint32_t v = words[k];
+                        if (gen->big_endian) {
+                                dst[0] = v >> 16;
+                                dst[1] = v >> 8;
+                                dst[2] = v;
+                        } else {
+                                dst[0] = v;
+                                dst[1] = v >> 8;
+                                dst[2] = v >> 16;
+                        }
+                }
+                break;
+        case 4:
+                for (k = 0; k < count; k++, dst += step)
+                        memcpy(dst, &words[k], 4);
+                break;
+        }
+}
+
+/*
+ *   Interleaved 3 byte samples, four channels per 12 byte copy
+ */
+static void bcast24(const struct generator *gen, const uint32_t *words,
+                    int count, unsigned int channels, unsigned char *dst)
+{
+        unsigned char pattern[12];
+        unsigned int chn;
+        int k, i;
+        for (k = 0; k < count; k++) {
+                scatter(gen, &words[k], pattern, 3, 1);
+                for (i = 3; i < 12; i++)
+                        pattern[i] = pattern[i - 3];
+                for (chn = 0; chn + 4 <= channels; chn += 4, dst += 12)
+                        memcpy(dst, pattern, 12);
+                for (; chn < channels; chn++, dst += 3)
+                        memcpy(dst, pattern, 3);
+        }
+}
+
+static int is_interleaved(const struct generator *gen,
+                          const snd_pcm_channel_area_t *areas)
+{
+        unsigned int chn, bits = gen->phys_bytes * 8;
+        for (chn = 0; chn < gen->channels; chn++)
+                if (areas[chn].addr != areas[0].addr ||
+                    areas[chn].first != areas[0].first + chn * bits ||
+                    areas[chn].step != gen->channels * bits)
+                        return 0;
+        return areas[0].first % 8 == 0;
+}
+
+void pack_areas(const struct generator *gen, const uint32_t *words,
+                const snd_pcm_channel_area_t *areas,
+                snd_pcm_uframes_t offset, int count)
+{
+        uint32_t wide[GEN_BLOCK];
+        unsigned int chn, channels = gen->channels;
+        unsigned char *dst;
+        int k;
+        if (is_interleaved(gen, areas)) {
+                dst = (unsigned char *)areas[0].addr + areas[0].first / 8 +
+                      offset * channels * gen->phys_bytes;
+                switch (gen->phys_bytes) {
+                case 4:
+                        bcast(words, count, channels, dst);
+                        return;
+                case 2:
+                        if (channels % 2 == 0) {
+                                for (k = 0; k < count; k++)
+                                        wide[k] = (words[k] & 0xffff) * 0x00010001U;
+                                bcast(wide, count, channels / 2, dst);
+                                return;
+                        }
+                        break;
+                case 3:
+                        bcast24(gen, words, count, channels, dst);
+                        return;
+                case 1:
+                        if (channels % 4 == 0) {
+                                for (k = 0; k < count; k++)
+                                        wide[k] = (words[k] & 0xff) * 0x01010101U;
+                                bcast(wide, count, channels / 4, dst);
+                                return;
+                        }
+                        break;
+                }
+        }
+        for (chn = 0; chn < channels; chn++) {
+                if ((areas[chn].first % 8) != 0 || (areas[chn].step % 8) != 0) {
+                        printf("areas[%i] not byte aligned (first %i, step %i), aborting...\n",
+                               chn, areas[chn].first, areas[chn].step);
+                        exit(EXIT_FAILURE);
+                }
+                dst = (unsigned char *)areas[chn].addr + areas[chn].first / 8 +
+                      offset * (areas[chn].step / 8);
+                scatter(gen, words, dst, areas[chn].step / 8, count);
+        }
+}
+
+/*
+ *   'count' frames of one word per sample, channel after channel
+ */
+void pack_frames(const struct generator *gen, const uint32_t *words,
+                 const snd_pcm_channel_area_t *areas,
+                 snd_pcm_uframes_t offset, int count)
+{
+        unsigned int chn, channels = gen->channels;
+        unsigned char *dst;
+        int k, step;
+        if (is_interleaved(gen, areas)) {
+                dst = (unsigned char *)areas[0].addr + areas[0].first / 8 +
+                      offset * channels * gen->phys_bytes;
+                if (gen->phys_bytes == 4)
+                        memcpy(dst, words, count * channels * sizeof(*words));
+                else
+                        scatter(gen, words, dst, gen->phys_bytes, count * channels);
+                return;
+        }
+        for (chn = 0; chn < channels; chn++) {
+                if ((areas[chn].first % 8) != 0 || (areas[chn].step % 8) != 0) {
+                        printf("areas[%i] not byte aligned (first %i, step %i), aborting...\n",
+                               chn, areas[chn].first, areas[chn].step);
+                        exit(EXIT_FAILURE);
+                }
+                step = areas[chn].step / 8;
+                dst = (unsigned char *)areas[chn].addr + areas[chn].first / 8 + offset * step;
+                for (k = 0; k < count; k++, dst += step)
+                        scatter(gen, &words[k * channels + chn], dst, step, 1);
+        }
+}
+
+/*
+ *   'count' frames already in the stream format, interleaved at 'src'
+ */
+void pack_copy(const struct generator *gen, const unsigned char *src,
+               const snd_pcm_channel_area_t *areas,
+               snd_pcm_uframes_t offset, int count)
+{
+        unsigned int chn, channels = gen->channels, bytes = gen->phys_bytes;
+        unsigned char *dst;
+        int k, step;
+        if (is_interleaved(gen, areas)) {
+                dst = (unsigned char *)areas[0].addr + areas[0].first / 8 +
+                      offset * channels * bytes;
+                memcpy(dst, src, count * channels * bytes);
+                return;
+        }
+        for (chn = 0; chn < channels; chn++) {
+                step = areas[chn].step / 8;
+                dst = (unsigned char *)areas[chn].addr + areas[chn].first / 8 + offset * step;
+                for (k = 0; k < count; k++, dst += step)
+                        memcpy(dst, src + (k * channels + chn) * bytes, bytes);
+        }
+}
@@ -0,0 +1,221 @@
+/*
+ *  WAV and raw PCM files as stream sources.  The file is mapped and
+ *  periods are sliced straight out of the mapping when its samples are
+ *  what the stream sends; otherwise they are decoded and packed like the
+ *  synthesised ones.  Pages are read ahead of the play position, and of
+ *  the start of the file as the end comes near, so looping never waits
+ *  on the disk.
+ */
+
+#include "sineserver.h"
+
+#define   WAVE_PCM 1
+#define   WAVE_FLOAT 3
+#define   WAVE_EXTENSIBLE 0xfffe
+
+static unsigned int le16(const unsigned char *p)
+{
+        return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ *   Format, channels, rate and samples from the RIFF chunks, 0 if the
+ *   file is no WAV at all
+ */
+static int parse_wav(struct pcm_file *f)
+{
+        const unsigned char *p = f->map, *end = f->map + f->map_len, *fmt = NULL;
+        unsigned int tag, align, bits;
+        size_t size, fmt_size = 0;
+        if (f->map_len < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+                return 0;
+        for (p += 12; end - p >= 8; p += 8 + size + (size & 1)) {
+                size = le32(p + 4);
+                if (size > (size_t)(end - p - 8))
+                        size = end - p - 8;     /* cut short, or of unknown length */
+                if (!memcmp(p, "fmt ", 4)) {
+                        fmt = p + 8;
+                        fmt_size = size;
+                } else if (!memcmp(p, "data", 4)) {
+                        f->data = p + 8;
+                        f->frames = size;       /* in bytes until the format is known */
+                        break;
+                }
+        }
+        if (fmt == NULL || fmt_size < 16 || f->data == NULL)
+                return -EINVAL;
+        tag = le16(fmt);
+        f->channels = le16(fmt + 2);
+        f->rate = le32(fmt + 4);
+        align = le16(fmt + 12);
+        if (tag == WAVE_EXTENSIBLE && fmt_size >= 26)
+                tag = le16(fmt + 24);   /* first two bytes of the subformat GUID */
+        if (f->channels == 0 || align == 0 || align % f->channels)
+                return -EINVAL;
+        /* the container size counts, valid bits are MSB-justified in it */
+        bits = align / f->channels * 8;
+        if (tag == WAVE_PCM)
+                f->format = snd_pcm_build_linear_format(bits, bits, bits == 8, 0);
+        else if (tag == WAVE_FLOAT && bits == 32)
+                f->format = SND_PCM_FORMAT_FLOAT_LE;
+        else if (tag == WAVE_FLOAT && bits == 64)
+                f->format = SND_PCM_FORMAT_FLOAT64_LE;
+        else
+                f->format = SND_PCM_FORMAT_UNKNOWN;
+        if (f->format == SND_PCM_FORMAT_UNKNOWN)
+                return -EINVAL;
+        f->wav = 1;
+        return 0;
+}
+
+static void will_need(const struct pcm_file *f, uint64_t pos, uint64_t frames)
+{
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)(f->data + pos * f->frame_bytes) & ~(page - 1);
+        uintptr_t end = (uintptr_t)(f->data + (pos + frames) * f->frame_bytes);
+        madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+/*
+ *   Have the pages of 'frames' frames from 'pos' on read in the
+ *   background, going on at the start when they run past the end
+ */
+static void read_ahead(const struct pcm_file *f, uint64_t pos, uint64_t frames)
+{
+        uint64_t first = frames < f->frames - pos ? frames : f->frames - pos;
+        will_need(f, pos, first);
+        if (first < frames)
+                will_need(f, 0, frames - first < f->frames ? frames - first : f->frames);
+}
+
+/*
+ *   Map 'path'.  A WAV file says what it holds; anything else is taken as
+ *   raw samples in the given format and channels, at the given rate.
+ */
+int pcm_file_open(struct pcm_file *f, const char *path, snd_pcm_format_t format,
+                  unsigned int channels, unsigned int rate)
+{
+        struct stat st;
+        uint64_t ahead;
+        int err;
+        memset(f, 0, sizeof(*f));
+        f->path = path;
+        errno = 0;
+        if ((f->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+                return -errno;
+        if (fstat(f->fd, &st) < 0 || st.st_size == 0) {
+                err = errno ? -errno : -EINVAL;
+                close(f->fd);
+                return err;
+        }
+        f->map_len = st.st_size;
+        f->map = mmap(NULL, f->map_len, PROT_READ, MAP_SHARED, f->fd, 0);
+        if (f->map == MAP_FAILED) {
+                err = -errno;
+                close(f->fd);
+                return err;
+        }
+        if ((err = parse_wav(f)) < 0) {
+                pcm_file_close(f);
+                return err;
+        }
+        if (!f->wav) {
+                f->data = f->map;
+                f->frames = f->map_len;
+                f->format = format;
+                f->channels = channels;
+                f->rate = rate;
+        }
+        f->phys_bytes = snd_pcm_format_physical_width(f->format) / 8;
+        f->width = snd_pcm_format_width(f->format);
+        f->is_float = snd_pcm_format_float(f->format) == 1;
+        f->big_endian = snd_pcm_format_big_endian(f->format) == 1;
+        f->is_unsigned = snd_pcm_format_unsigned(f->format) == 1;
+        f->frame_bytes = f->channels * f->phys_bytes;
+        f->frames /= f->frame_bytes;
+        if (f->frames == 0) {
+                pcm_file_close(f);
+                return -EINVAL;
+        }
+        /* a file that fits the read ahead stays cached for every loop */
+        ahead = PCMFILE_AHEAD / f->frame_bytes;
+        if (f->frames > ahead) {
+                posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                madvise(f->map, f->map_len, MADV_SEQUENTIAL);
+        }
+        readahead(f->fd, f->data - f->map, ahead * f->frame_bytes);
+        read_ahead(f, 0, ahead);
+        return 0;
+}
+
+/*
+ *   Called as 'pos' is played: once it has moved half the read ahead on,
+ *   ask for the next stretch.  madvise() only starts the reads.
+ */
+void pcm_file_prefetch(struct pcm_file *f, uint64_t pos)
+{
+        uint64_t ahead = PCMFILE_AHEAD / f->frame_bytes;
+        if ((pos + f->frames - f->ahead_pos) % f->frames < ahead / 2)
+                return;
+        f->ahead_pos = pos;
+        read_ahead(f, pos, ahead);
+}
+
+static double decode(const struct pcm_file *f, const unsigned char *p)
+{
+        uint64_t v = 0;
+        int64_t s;
+        float x;
+        double d;
+        int i;
+        for (i = 0; i < f->phys_bytes; i++)
+                v |= (uint64_t)p[i] << 8 * (f->big_endian ? f->phys_bytes - 1 - i : i);
+        if (f->is_float) {
+                if (f->phys_bytes == 4) {
+                        uint32_t u = v;
+                        memcpy(&x, &u, sizeof(x));
+                        d = x;
+                } else
+                        memcpy(&d, &v, sizeof(d));
+                /* the packers take full scale as the limit */
+                return d < -1. ? -1. : d > 1. ? 1. : d;
+        }
+        /* samples narrower than their container sit in its low bits */
+        if (f->width < 64)
+                v &= (1ULL << f->width) - 1;
+        if (f->is_unsigned)
+                v ^= 1ULL << (f->width - 1);
+        s = (int64_t)(v << (64 - f->width)) >> (64 - f->width);
+        return s / (double)(1ULL << (f->width - 1));
+}
+
+/*
+ *   'frames' frames from 'pos' on as doubles in [-1, 1], interleaved in
+ *   'channels': channel c plays channel c of the file, repeated when the
+ *   file has fewer.  The caller wraps 'pos'.
+ */
+void pcm_file_decode(const struct pcm_file *f, uint64_t pos, double *out,
+                     int frames, unsigned int channels)
+{
+        const unsigned char *p = f->data + pos * f->frame_bytes;
+        unsigned int c;
+        int k;
+        for (k = 0; k < frames; k++, p += f->frame_bytes)
+                for (c = 0; c < channels; c++)
+                        *out++ = decode(f, p + c % f->channels * f->phys_bytes);
+}
+
+void pcm_file_close(struct pcm_file *f)
+{
+        if (f->map != NULL && f->map != MAP_FAILED)
+                munmap(f->map, f->map_len);
+        if (f->fd >= 0)
+                close(f->fd);
+        f->map = NULL;
+        f->fd = -1;
+}
@@ -0,0 +1,44 @@
+#ifndef PCMFILE_H_   /* Include guard */
+#define PCMFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define   PCMFILE_AHEAD (8UL << 20)     /* bytes read ahead of the play position */
+
+/*
+ *  A WAV or raw PCM file mapped read-only, played in a loop.  The
+ *  mapping is shared by every period sliced from it, so it lives as long
+ *  as the stream.  Integer samples of any width and 32 or 64-bit floats
+ *  are decoded when the stream format differs.
+ */
+struct pcm_file {
+        const char *path;
+        int fd;
+        unsigned char *map;
+        size_t map_len;
+        const unsigned char *data;      /* first frame, inside map */
+        uint64_t frames;
+        snd_pcm_format_t format;
+        unsigned int channels;
+        unsigned int rate;
+        int wav;                        /* 0: raw, as the stream was set up */
+        size_t frame_bytes;
+        uint64_t ahead_pos;             /* frame the last read ahead started at */
+        /* sample decoding, derived from format */
+        int phys_bytes;
+        int width;
+        int is_float;
+        int big_endian;
+        int is_unsigned;
+};
+
+int pcm_file_open(struct pcm_file *f, const char *path, snd_pcm_format_t format,
+                  unsigned int channels, unsigned int rate);
+void pcm_file_prefetch(struct pcm_file *f, uint64_t pos);
+void pcm_file_decode(const struct pcm_file *f, uint64_t pos, double *out,
+                     int frames, unsigned int channels);
+void pcm_file_close(struct pcm_file *f);
+
+#endif //PCMFILE_H_
@@ -0,0 +1,544 @@
+/*
+ *  One period of a stream, from generating it to sending its datagrams:
+ *  the layout of the period buffers, the cut into datagrams with their
+ *  headers and parity, compression, and sendmmsg().  The server and the
+ *  bench sweep share it, so the sweep measures what the server sends.
+ */
+
+#include "sineserver.h"
+
+snd_pcm_format_t format = SND_PCM_FORMAT_S32;           /* sample format */
+unsigned int rate = 192000;                             /* stream rate */
+unsigned int channels = 2;                              /* count of channels */
+snd_pcm_sframes_t period_size;                          /* frames per period */
+unsigned int fec_k = 0;                                 /* data datagrams per FEC group, 0 = off */
+unsigned int fec_m = 1;                                 /* parity datagrams per FEC group */
+int compress = 0;                                       /* code payloads losslessly */
+struct codec_layout layout;
+
+long long monotonic_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+socklen_t addr_len(const union inet_addr *a)
+{
+        return a->sa.sa_family == AF_INET6 ? sizeof(a->in6) : sizeof(a->in);
+}
+
+/*
+ *   Point the channel areas of p into its samples, laid out for the
+ *   access type of the method
+ */
+int layout_areas(struct stream *s, struct period *p, snd_pcm_access_t access)
+{
+        int width = snd_pcm_format_physical_width(format);
+        unsigned int chn;
+        if ((size_t)period_size * channels * width / 8 > s->period_bytes)
+                return -ENOSPC;
+        for (chn = 0; chn < channels; chn++) {
+                if (access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
+                        p->areas[chn].addr = p->samples + chn * period_size * width / 8;
+                        p->areas[chn].first = 0;
+                        p->areas[chn].step = width;
+                } else {
+                        p->areas[chn].addr = p->samples;
+                        p->areas[chn].first = chn * width;
+                        p->areas[chn].step = channels * width;
+                }
+        }
+        return 0;
+}
+
+/*
+ *   Position in the sending order of data datagram n and of parity
+ *   datagram j of group g: each group of fec_k data datagrams is
+ *   followed by its fec_m parity datagrams
+ */
+static unsigned int data_msg(const struct stream *s, unsigned int n)
+{
+        return fec_k ? n + n / fec_k * fec_m : n;
+}
+
+static unsigned int parity_msg(const struct stream *s, unsigned int g, unsigned int j)
+{
+        unsigned int end = (g + 1) * fec_k;
+        return (end < s->npackets ? end : s->npackets) + g * fec_m + j;
+}
+
+/*
+ *   Parity datagrams and their place in period p
+ */
+static void prepare_parity(struct stream *s, struct period *p)
+{
+        struct parity_hdr *ph;
+        unsigned int g, j, k, msg;
+        memset(p->parity_hdrs, 0, s->ngroups * fec_m * sizeof(*p->parity_hdrs));
+        for (g = 0; g < s->ngroups; g++) {
+                k = s->npackets - g * fec_k < fec_k ? s->npackets - g * fec_k : fec_k;
+                for (j = 0; j < fec_m; j++) {
+                        ph = &p->parity_hdrs[g * fec_m + j];
+                        ph->hdr.version = SINE_VERSION;
+                        ph->hdr.flags = SINE_FLAG_PARITY;
+                        ph->hdr.format = htons(format);
+                        ph->hdr.stream_id = htonl(s->id);
+                        ph->hdr.rate = htonl(rate);
+                        ph->hdr.channels = htons(channels);
+                        ph->fec.k = k;
+                        ph->fec.m = fec_m;
+                        ph->fec.index = j;
+                        ph->fec.length = htons(s->code_len);
+                        msg = parity_msg(s, g, j);
+                        p->iovecs[2 * msg].iov_base = ph;
+                        p->iovecs[2 * msg].iov_len = sizeof(*ph);
+                        p->iovecs[2 * msg + 1].iov_base = p->parity + (g * fec_m + j) * s->code_len;
+                        p->iovecs[2 * msg + 1].iov_len = s->code_len;
+                        /* right behind the last data datagram of the group */
+                        s->msg_frame[msg] = s->msg_frame[data_msg(s, g * fec_k + k - 1)];
+                }
+        }
+}
+
+/*
+ *   Frames of one datagram in format f, leaving room for the parity
+ *   header and meta in the same datagram size
+ */
+snd_pcm_uframes_t packet_frames(snd_pcm_format_t f)
+{
+        size_t frame_bytes = channels * snd_pcm_format_physical_width(f) / 8;
+        snd_pcm_uframes_t frames;
+        frames = (PACKETSIZE - SINE_HDR_SIZE - (fec_k ? SINE_FEC_OVERHEAD : 0)) / frame_bytes;
+        return frames > UINT16_MAX ? UINT16_MAX : frames;
+}
+
+/*
+ *   Room for 'frames' frames of format f in each period buffer of s, and
+ *   for the datagrams that carry them
+ */
+void period_room(struct stream *s, snd_pcm_uframes_t frames, snd_pcm_format_t f)
+{
+        snd_pcm_uframes_t per_packet = packet_frames(f);
+        unsigned int groups;
+        s->period_bytes = frames * channels * snd_pcm_format_physical_width(f) / 8;
+        s->max_packets = per_packet ? (frames + per_packet - 1) / per_packet : 0;
+        groups = fec_k ? (s->max_packets + fec_k - 1) / fec_k : 0;
+        s->max_msgs = s->max_packets + groups * fec_m;
+}
+
+/*
+ *   Arena bytes alloc_periods() and alloc_datagrams() carve for s, the
+ *   same sizes in the same rounding
+ */
+size_t periods_footprint(struct stream *s)
+{
+        unsigned int nparity = s->max_msgs - s->max_packets;
+        size_t period;
+        period = arena_round(s->period_bytes) +
+                 arena_round(channels * sizeof(snd_pcm_channel_area_t)) +
+                 arena_round(s->max_msgs * sizeof(struct mmsghdr)) +
+                 arena_round(s->max_msgs * 2 * sizeof(struct iovec)) +
+                 arena_round(s->max_packets * sizeof(struct sine_hdr));
+        if (nparity)
+                period += arena_round(nparity * sizeof(struct parity_hdr)) +
+                          arena_round(nparity * (sizeof(struct sine_fec_meta) + PACKETSIZE));
+        if (compress)
+                period += arena_round((size_t)s->max_packets * PACKETSIZE);
+        return arena_round(s->nperiods * sizeof(struct period)) + s->nperiods * period +
+               arena_round(s->max_msgs * sizeof(uint32_t));
+}
+
+/*
+ *   The s->nperiods period buffers of s, carved from its arena and laid
+ *   out for the access type of the method
+ */
+int alloc_periods(struct stream *s, snd_pcm_access_t access)
+{
+        struct period *p;
+        unsigned int i;
+        s->periods = arena_carve(s->arena, s->nperiods * sizeof(*s->periods));
+        if (s->periods == NULL)
+                return -ENOMEM;
+        for (i = 0; i < s->nperiods; i++) {
+                p = &s->periods[i];
+                p->samples = arena_carve(s->arena, s->period_bytes);
+                p->data = p->samples;
+                p->areas = arena_carve(s->arena, channels * sizeof(snd_pcm_channel_area_t));
+                if (p->samples == NULL || p->areas == NULL)
+                        return -ENOMEM;
+                layout_areas(s, p, access);
+        }
+        return 0;
+}
+
+/*
+ *   Datagram buffers of one period, as many as period_room() allows
+ */
+int alloc_packets(struct stream *s, struct period *p)
+{
+        unsigned int nparity = s->max_msgs - s->max_packets;
+        p->msgs = arena_carve(s->arena, s->max_msgs * sizeof(*p->msgs));
+        p->iovecs = arena_carve(s->arena, s->max_msgs * 2 * sizeof(*p->iovecs));
+        p->hdrs = arena_carve(s->arena, s->max_packets * sizeof(*p->hdrs));
+        if (p->msgs == NULL || p->iovecs == NULL || p->hdrs == NULL)
+                return -ENOMEM;
+        if (nparity) {
+                p->parity_hdrs = arena_carve(s->arena, nparity * sizeof(*p->parity_hdrs));
+                p->parity = arena_carve(s->arena, nparity * (sizeof(struct sine_fec_meta) + PACKETSIZE));
+                if (p->parity_hdrs == NULL || p->parity == NULL)
+                        return -ENOMEM;
+        }
+        if (compress && (p->coded = arena_carve(s->arena, (size_t)s->max_packets * PACKETSIZE)) == NULL)
+                return -ENOMEM;
+        return 0;
+}
+
+/*
+ *   Split one period of interleaved samples into datagrams of at most
+ *   PACKETSIZE bytes, each carrying a header and a whole number of frames,
+ *   plus the parity datagrams when FEC is on
+ */
+int prepare_packets(struct stream *s, struct period *p)
+{
+        size_t frame_bytes = channels * snd_pcm_format_physical_width(format) / 8;
+        snd_pcm_uframes_t offset, frames;
+        unsigned int n, msg;
+        s->packet_frames = packet_frames(format);
+        if (s->packet_frames == 0) {
+                printf("Frame size %zu exceeds packet size %i\n", frame_bytes, PACKETSIZE);
+                return -EINVAL;
+        }
+        s->npackets = (period_size + s->packet_frames - 1) / s->packet_frames;
+        s->ngroups = fec_k ? (s->npackets + fec_k - 1) / fec_k : 0;
+        s->nmsgs = s->npackets + s->ngroups * fec_m;
+        s->code_len = sizeof(struct sine_fec_meta) + s->packet_frames * frame_bytes;
+        if (s->npackets > s->max_packets || s->nmsgs > s->max_msgs)
+                return -ENOSPC;
+        memset(p->hdrs, 0, s->npackets * sizeof(*p->hdrs));
+        memset(p->msgs, 0, s->nmsgs * sizeof(*p->msgs));
+        for (n = 0, offset = 0; n < s->npackets; n++, offset += frames) {
+                frames = period_size - offset;
+                if (frames > s->packet_frames)
+                        frames = s->packet_frames;
+                p->hdrs[n].version = SINE_VERSION;
+                p->hdrs[n].flags = n == 0 ? SINE_FLAG_MARKER : 0;
+                p->hdrs[n].format = htons(format);
+                p->hdrs[n].stream_id = htonl(s->id);
+                p->hdrs[n].rate = htonl(rate);
+                p->hdrs[n].channels = htons(channels);
+                p->hdrs[n].frames = htons(frames);
+                msg = data_msg(s, n);
+                p->iovecs[2 * msg].iov_base = &p->hdrs[n];
+                p->iovecs[2 * msg].iov_len = SINE_HDR_SIZE;
+                p->iovecs[2 * msg + 1].iov_base = p->samples + offset * frame_bytes;
+                p->iovecs[2 * msg + 1].iov_len = frames * frame_bytes;
+                s->msg_frame[msg] = offset;
+        }
+        if (s->ngroups)
+                prepare_parity(s, p);
+        for (msg = 0; msg < s->nmsgs; msg++) {
+                p->msgs[msg].msg_hdr.msg_name = &s->addr;
+                p->msgs[msg].msg_hdr.msg_namelen = addr_len(&s->addr);
+                p->msgs[msg].msg_hdr.msg_iov = &p->iovecs[2 * msg];
+                p->msgs[msg].msg_hdr.msg_iovlen = 2;
+        }
+        return 0;
+}
+
+/*
+ *   Datagrams of every period of s, cut for its destination in s->addr
+ */
+int alloc_datagrams(struct stream *s)
+{
+        unsigned int i;
+        int err;
+        if ((s->msg_frame = arena_carve(s->arena, s->max_msgs * sizeof(*s->msg_frame))) == NULL)
+                return -ENOMEM;
+        for (i = 0; i < s->nperiods; i++)
+                if ((err = alloc_packets(s, &s->periods[i])) < 0 ||
+                    (err = prepare_packets(s, &s->periods[i])) < 0)
+                        return err;
+        return 0;
+}
+
+/*
+ *   Code the parity datagrams of period p from its numbered data datagrams
+ */
+static void fec_encode(struct stream *s, struct period *p)
+{
+        struct sine_fec_meta meta;
+        struct iovec *payload;
+        unsigned char *code;
+        unsigned int g, i, j, k, n;
+        uint8_t c;
+        for (g = 0; g < s->ngroups; g++) {
+                k = p->parity_hdrs[g * fec_m].fec.k;
+                code = p->parity + g * fec_m * s->code_len;
+                memset(code, 0, fec_m * s->code_len);
+                for (i = 0; i < k; i++) {
+                        n = g * fec_k + i;
+                        meta.flags = p->hdrs[n].flags;
+                        meta.reserved = 0;
+                        meta.frames = p->hdrs[n].frames;
+                        meta.timestamp = p->hdrs[n].timestamp;
+                        payload = &p->iovecs[2 * data_msg(s, n) + 1];
+                        for (j = 0; j < fec_m; j++) {
+                                c = fec_coef(k, fec_m, j, i);
+                                fec_mul_add(code + j * s->code_len, (uint8_t *)&meta, c, sizeof(meta));
+                                fec_mul_add(code + j * s->code_len + sizeof(meta),
+                                            payload->iov_base, c, payload->iov_len);
+                        }
+                }
+                for (j = 0; j < fec_m; j++)
+                        p->parity_hdrs[g * fec_m + j].hdr.seq = p->hdrs[g * fec_k].seq;
+        }
+}
+
+/*
+ *   Send and write period p from 'data' rather than from its own buffer
+ */
+static void point_period(struct stream *s, struct period *p, const unsigned char *data)
+{
+        size_t packet_bytes = s->packet_frames * channels * s->gen.phys_bytes;
+        unsigned int n;
+        for (n = 0; n < s->npackets; n++)
+                p->iovecs[2 * data_msg(s, n) + 1].iov_base = (unsigned char *)data + n * packet_bytes;
+        p->data = (unsigned char *)data;
+}
+
+/*
+ *   Bytes of the room beside the replay cache of gen that keeps its
+ *   periods coded: the payloads at the offsets they have in the cache,
+ *   then a length for each datagram of each period
+ */
+size_t coded_room(const struct stream *s, const struct generator *gen)
+{
+        size_t bytes = gen->cache_frames * gen->channels * gen->phys_bytes;
+        return ((bytes + 7) & ~(size_t)7) +
+               gen->cache_frames / period_size * s->max_packets * sizeof(uint16_t);
+}
+
+static uint16_t *coded_lens(const struct generator *gen)
+{
+        size_t bytes = gen->cache_frames * gen->channels * gen->phys_bytes;
+        return (uint16_t *)(gen->coded + ((bytes + 7) & ~(size_t)7));
+}
+
+/*
+ *   With -z, room for the periods replayed from the cache of gen to be
+ *   coded once, on their first lap, and sent from there after.  The
+ *   lengths start at 0, not coded yet.
+ */
+int alloc_coded(const struct stream *s, struct generator *gen)
+{
+        if (!compress || gen->cache == NULL || gen->file != NULL)
+                return 0;
+        gen->coded = calloc(1, coded_room(s, gen));
+        return gen->coded == NULL ? -ENOMEM : 0;
+}
+
+/*
+ *   Compress the payload of every data datagram of p on its own, keeping
+ *   those the codec cannot shrink as they are.  A period sliced out of
+ *   the cache is coded into the room beside it the first time and only
+ *   pointed at from then on; each length is the coded one, or the raw
+ *   one for a payload kept as it is.
+ */
+static void compress_period(struct stream *s, struct period *p)
+{
+        size_t packet_bytes = s->packet_frames * channels * s->gen.phys_bytes;
+        size_t period_bytes = period_size * channels * s->gen.phys_bytes;
+        long long start = monotonic_ns();
+        uint64_t raw = 0, coded = 0;
+        unsigned char *room = p->coded;
+        uint16_t *lens = NULL;
+        struct iovec *iov;
+        unsigned int n;
+        size_t len;
+        if (s->gen.coded != NULL && p->data != p->samples) {
+                room = s->gen.coded + (p->data - s->gen.cache);
+                lens = coded_lens(&s->gen) + (p->data - s->gen.cache) / period_bytes * s->max_packets;
+        }
+        for (n = 0; n < s->npackets; n++) {
+                iov = &p->iovecs[2 * data_msg(s, n) + 1];
+                iov->iov_base = p->data + n * packet_bytes;
+                iov->iov_len = ntohs(p->hdrs[n].frames) * channels * s->gen.phys_bytes;
+                if (lens != NULL && lens[n] != 0) {
+                        len = lens[n] < iov->iov_len ? lens[n] : 0;
+                } else {
+                        len = codec_encode(&layout, channels, iov->iov_base, ntohs(p->hdrs[n].frames),
+                                           room + n * packet_bytes, iov->iov_len - 1);
+                        if (lens != NULL)
+                                lens[n] = len > 0 ? len : iov->iov_len;
+                }
+                raw += iov->iov_len;
+                if (len > 0) {
+                        iov->iov_base = room + n * packet_bytes;
+                        iov->iov_len = len;
+                        p->hdrs[n].flags |= SINE_FLAG_CODED;
+                } else
+                        p->hdrs[n].flags &= ~SINE_FLAG_CODED;
+                coded += iov->iov_len;
+        }
+        hist_record(&s->metrics.gen.encode, monotonic_ns() - start);
+        metric_add(&s->metrics.gen.raw_bytes, raw);
+        metric_add(&s->metrics.gen.coded_bytes, coded);
+}
+
+/*
+ *   Take a retune posted by the control thread, between two periods.  The
+ *   new voices come with their own replay cache if they repeat; the cache
+ *   the periods in flight may still point into is kept until they have
+ *   all been produced again.  A second retune before then is refused.
+ */
+void take_tune(struct stream *s)
+{
+        struct control_cmd *cmd = atomic_load_explicit(&s->gen_cmd, memory_order_acquire);
+        if (cmd == NULL || !atomic_compare_exchange_strong(&s->gen_cmd, &cmd, NULL))
+                return;         /* nothing posted, or the control thread gave up on it */
+        if (s->replay && s->old_cache != NULL) {
+                cmd->result = -EBUSY;
+                atomic_store_explicit(&cmd->done, 1, memory_order_release);
+                return;
+        }
+        if (s->replay) {
+                s->old_cache = s->gen.cache;
+                s->old_coded = s->gen.coded;
+                s->old_until = s->produced;
+                s->gen.cache = NULL;
+                s->gen.coded = NULL;
+        }
+        generator_retune(&s->gen, &cmd->gen);
+        s->replay = cmd->replay;
+        cmd->result = 0;
+        atomic_store_explicit(&cmd->done, 1, memory_order_release);
+}
+
+/*
+ *   Generate the next period of a stream into p, or point p at it in the
+ *   replay cache, and number its datagrams
+ */
+void produce_period(struct stream *s, struct period *p)
+{
+        uint64_t frame = s->produced * period_size;
+        long long start;
+        const unsigned char *slice;
+        unsigned int n;
+        take_tune(s);
+        if (s->old_cache != NULL && s->produced - s->old_until > s->nperiods) {
+                free(s->old_cache);
+                free(s->old_coded);
+                s->old_cache = NULL;
+                s->old_coded = NULL;
+        }
+        s->produced++;
+        start = monotonic_ns();
+        if (s->replay && (slice = generator_slice(&s->gen, period_size)) != NULL) {
+                point_period(s, p, slice);
+        } else {
+                if (p->data != p->samples)
+                        point_period(s, p, p->samples);
+                generate_sine(&s->gen, p->areas, 0, period_size);
+        }
+        hist_record(&s->metrics.gen.generate, monotonic_ns() - start);
+        metric_add(&s->metrics.gen.frames, period_size);
+        if (p->hdrs == NULL)
+                return;
+        for (n = 0; n < s->npackets; n++) {
+                p->hdrs[n].seq = htonl(s->seq++);
+                p->hdrs[n].timestamp = htonl((uint32_t)(frame + n * s->packet_frames));
+        }
+        if (compress)
+                compress_period(s, p);
+        if (s->ngroups)
+                fec_encode(s, p);
+}
+
+/*
+ *   Zero-copy completions for IDs lo..hi: credit every period buffer
+ *   whose datagrams they cover
+ */
+void zc_done(void *arg, uint32_t lo, uint32_t hi, int copied)
+{
+        struct stream *s = arg;
+        struct period *p;
+        int32_t from, to;
+        unsigned int i;
+        s->zc_copied += copied ? hi - lo + 1 : 0;
+        for (i = 0; i < s->nperiods; i++) {
+                p = &s->periods[i];
+                from = (int32_t)(lo - p->zc_first);
+                to = (int32_t)(hi + 1 - p->zc_first);
+                from = from < 0 ? 0 : from;
+                to = to > (int32_t)(p->zc_end - p->zc_first) ? (int32_t)(p->zc_end - p->zc_first) : to;
+                if (to > from)
+                        atomic_fetch_sub_explicit(&p->zc_pending, to - from, memory_order_release);
+        }
+}
+
+/*
+ *   n more datagrams of p went out with MSG_ZEROCOPY
+ */
+void zc_sent(struct stream *s, struct period *p, unsigned int n)
+{
+        if (!s->zc)
+                return;
+        atomic_fetch_add_explicit(&p->zc_pending, n, memory_order_relaxed);
+        p->zc_end += n;
+        s->zc_next += n;
+        s->zc_sent += n;
+}
+
+/*
+ *   Account n datagrams sendmmsg() reported sent from vec
+ */
+void count_sent(struct stream *s, const struct mmsghdr *vec, unsigned int n)
+{
+        uint64_t bytes = 0;
+        unsigned int k;
+        for (k = 0; k < n; k++)
+                bytes += vec[k].msg_len;
+        metric_add(&s->metrics.send.packets, n);
+        metric_add(&s->metrics.send.bytes, bytes);
+}
+
+/*
+ *   The kernel ran out of memory for notifications: collect some
+ */
+void zc_backpressure(struct stream *s)
+{
+        zc_wait(s->sock, 1);
+        zc_reap(s->sock, zc_done, s);
+}
+
+/*
+ *   Send datagrams of period p, as few sendmmsg() calls as the kernel
+ *   allows.  Returns how many went out, fewer than vlen only if a
+ *   non-blocking socket is full.
+ */
+int send_packets(struct stream *s, struct period *p, struct mmsghdr *vec, unsigned int vlen)
+{
+        unsigned int done = 0;
+        int sent;
+        while (done < vlen) {
+                sent = sendmmsg(s->sock, vec + done, vlen - done, s->zc ? MSG_ZEROCOPY : 0);
+                if (sent < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == ENOBUFS && s->zc) {
+                                zc_backpressure(s);
+                                continue;
+                        }
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                metric_add(&s->metrics.send.eagain, 1);
+                                break;
+                        }
+                        return -errno;
+                }
+                zc_sent(s, p, sent);
+                count_sent(s, vec + done, sent);
+                done += sent;
+        }
+        return done;
+}
@@ -0,0 +1,47 @@
+#ifndef PERIOD_H_   /* Include guard */
+#define PERIOD_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <alsa/asoundlib.h>
+#include "codec.h"
+
+/*
+ *  What every stream sends, set by the server's options or the bench
+ *  sweep's axes
+ */
+extern snd_pcm_format_t format;
+extern unsigned int rate;
+extern unsigned int channels;
+extern snd_pcm_sframes_t period_size;
+extern unsigned int fec_k;
+extern unsigned int fec_m;
+extern int compress;
+extern struct codec_layout layout;
+
+struct stream;
+struct period;
+struct generator;
+union inet_addr;
+
+long long monotonic_ns(void);
+socklen_t addr_len(const union inet_addr *a);
+int layout_areas(struct stream *s, struct period *p, snd_pcm_access_t access);
+snd_pcm_uframes_t packet_frames(snd_pcm_format_t f);
+void period_room(struct stream *s, snd_pcm_uframes_t frames, snd_pcm_format_t f);
+size_t periods_footprint(struct stream *s);
+int alloc_periods(struct stream *s, snd_pcm_access_t access);
+int alloc_packets(struct stream *s, struct period *p);
+int prepare_packets(struct stream *s, struct period *p);
+int alloc_datagrams(struct stream *s);
+size_t coded_room(const struct stream *s, const struct generator *gen);
+int alloc_coded(const struct stream *s, struct generator *gen);
+void take_tune(struct stream *s);
+void produce_period(struct stream *s, struct period *p);
+void zc_done(void *arg, uint32_t lo, uint32_t hi, int copied);
+void zc_sent(struct stream *s, struct period *p, unsigned int n);
+void count_sent(struct stream *s, const struct mmsghdr *vec, unsigned int n);
+void zc_backpressure(struct stream *s);
+int send_packets(struct stream *s, struct period *p, struct mmsghdr *vec, unsigned int vlen);
+
+#endif //PERIOD_H_
@@ -0,0 +1,90 @@
+#ifndef PROTOCOL_H_   /* Include guard */
+#define PROTOCOL_H_
+
+#include <stdint.h>
+
+/*
+ *  Wire format of the sine stream, loosely modelled after RTP (RFC 3550).
+ *
+ *  Every datagram starts with a struct sine_hdr followed by 'frames'
+ *  interleaved frames of 'channels' samples in 'format'.  All header
+ *  fields are in network byte order, the payload is sent as generated
+ *  (the endianness is part of the sample format).
+ */
+#define   SINE_VERSION          1
+#define   SINE_FLAG_MARKER      0x01    /* first datagram of a period */
+#define   SINE_FLAG_PARITY      0x02    /* forward error correction, see below */
+#define   SINE_FLAG_CODED       0x04    /* payload compressed by the codec of codec.h */
+
+struct sine_hdr {
+        uint8_t  version;               /* SINE_VERSION */
+        uint8_t  flags;                 /* SINE_FLAG_* */
+        uint16_t format;                /* snd_pcm_format_t of the payload */
+        uint32_t seq;                   /* packet sequence number */
+        uint32_t timestamp;             /* sample clock of the first frame */
+        uint32_t stream_id;             /* identifies the sending stream */
+        uint32_t rate;                  /* stream rate in Hz */
+        uint16_t channels;              /* samples per frame */
+        uint16_t frames;                /* frames in this datagram */
+};
+
+#define   SINE_HDR_SIZE         sizeof(struct sine_hdr)
+
+_Static_assert(sizeof(struct sine_hdr) == 24, "sine_hdr must not be padded");
+
+/*
+ *  Unicast subscription.  A receiver sends a struct sine_ctrl to the
+ *  stream's port from the socket it listens on and repeats it every
+ *  SINE_KEEPALIVE_MS; the server sends the stream to the source address
+ *  of the message and forgets it after SINE_EXPIRY_MS of silence.
+ */
+#define   SINE_CTRL_SUBSCRIBE   1
+#define   SINE_CTRL_UNSUBSCRIBE 2
+#define   SINE_KEEPALIVE_MS     1000
+#define   SINE_EXPIRY_MS        5000
+
+struct sine_ctrl {
+        uint8_t  version;               /* SINE_VERSION */
+        uint8_t  type;                  /* SINE_CTRL_* */
+        uint16_t reserved;
+        uint32_t stream_id;             /* 0 for whichever stream owns the port */
+};
+
+_Static_assert(sizeof(struct sine_ctrl) == 8, "sine_ctrl must not be padded");
+
+/*
+ *  Forward error correction.  The data datagrams of a period are taken in
+ *  groups of k consecutive sequence numbers (the last group of a period
+ *  may be shorter) and each group is followed by m parity datagrams.  A
+ *  parity datagram carries the stream's struct sine_hdr with
+ *  SINE_FLAG_PARITY set, 'seq' the sequence number of the first data
+ *  datagram of its group and 'frames' 0, then a struct sine_fec and
+ *  'length' bytes of code.  The code covers, for every data datagram, its
+ *  struct sine_fec_meta followed by its payload, zero padded to
+ *  'length' bytes; see fec.h for the arithmetic.
+ */
+#define   SINE_FEC_MAX_K        64
+#define   SINE_FEC_MAX_M        16
+
+struct sine_fec {
+        uint8_t  k;                     /* data datagrams in the group */
+        uint8_t  m;                     /* parity datagrams in the group */
+        uint8_t  index;                 /* of this one, 0 to m - 1 */
+        uint8_t  reserved;
+        uint16_t length;                /* bytes of code that follow */
+        uint16_t reserved2;
+};
+
+struct sine_fec_meta {
+        uint8_t  flags;                 /* of the data datagram */
+        uint8_t  reserved;
+        uint16_t frames;
+        uint32_t timestamp;
+};
+
+#define   SINE_FEC_OVERHEAD     (sizeof(struct sine_fec) + sizeof(struct sine_fec_meta))
+
+_Static_assert(sizeof(struct sine_fec) == 8, "sine_fec must not be padded");
+_Static_assert(sizeof(struct sine_fec_meta) == 8, "sine_fec_meta must not be padded");
+
+#endif //PROTOCOL_H_
@@ -0,0 +1,73 @@
+/*
+ *  Period ring between the generator thread and the output threads.
+ *  The hot path is inline in ring.h, this file keeps setup and reporting.
+ */
+
+#include "sineserver.h"
+
+void ring_init(struct ring *r, unsigned int nslots, unsigned int nreaders)
+{
+        unsigned int i;
+        atomic_store(&r->head, 0);
+        r->waiting = 0;
+        r->full = 0;
+        r->nslots = nslots;
+        r->nreaders = nreaders;
+        for (i = 0; i < RING_MAX_READERS; i++) {
+                atomic_store(&r->readers[i].tail, 0);
+                r->readers[i].waiting = 0;
+                r->readers[i].starved = 0;
+                memset(r->readers[i].fill, 0, sizeof(r->readers[i].fill));
+        }
+}
+
+void ring_merge(struct ring *dst, const struct ring *src)
+{
+        unsigned int i, j;
+        dst->full += src->full;
+        if (src->nslots > dst->nslots)
+                dst->nslots = src->nslots;
+        if (src->nreaders > dst->nreaders)
+                dst->nreaders = src->nreaders;
+        for (i = 0; i < src->nreaders; i++) {
+                dst->readers[i].starved += src->readers[i].starved;
+                for (j = 0; j <= RING_MAX_SLOTS; j++)
+                        dst->readers[i].fill[j] += src->readers[i].fill[j];
+        }
+}
+
+/*
+ *   How far ahead of each consumer the generator ran.  The lowest fill a
+ *   consumer saw is the margin it had left; a buffer_time covering the
+ *   slots it never needed is wasted latency.
+ */
+void ring_report(const struct ring *r, const char *const names[],
+                 unsigned int period_us, FILE *fp)
+{
+        const struct ring_reader *rd;
+        uint64_t count;
+        unsigned int i, j, lo, hi;
+        fprintf(fp, "Ring of %u periods (%uus), generator blocked %llu times\n",
+                r->nslots, r->nslots * period_us, (unsigned long long)r->full);
+        for (i = 0; i < r->nreaders; i++) {
+                rd = &r->readers[i];
+                count = 0;
+                lo = RING_MAX_SLOTS;
+                hi = 0;
+                for (j = 0; j <= RING_MAX_SLOTS; j++) {
+                        if (rd->fill[j] == 0)
+                                continue;
+                        count += rd->fill[j];
+                        lo = j < lo ? j : lo;
+                        hi = j;
+                }
+                if (count == 0)
+                        continue;
+                fprintf(fp, "  %s: %llu periods, fill min %u max %u (%uus - %uus queued), ran dry %llu times\n",
+                        names[i], (unsigned long long)count, lo, hi,
+                        lo * period_us, hi * period_us, (unsigned long long)rd->starved);
+                for (j = lo; j <= hi; j++)
+                        if (rd->fill[j])
+                                fprintf(fp, "    %2u: %5.1f%%\n", j, 100.0 * rd->fill[j] / count);
+        }
+}
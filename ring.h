@@ -0,0 +1,96 @@
+#ifndef RING_H_   /* Include guard */
+#define RING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define   RING_MAX_SLOTS   64
+#define   RING_MAX_READERS 5            /* a sender per interface and a writer */
+#define   RING_CACHELINE   64
+
+/*
+ *  Lock-free ring of period slots between one producer and up to
+ *  RING_MAX_READERS consumers.  Every consumer has its own tail and reads
+ *  each published slot in place; the producer reuses a slot only once all
+ *  consumers have released it.  Head and tails live on separate cache
+ *  lines and each is written by exactly one thread.
+ */
+struct ring_reader {
+        _Atomic uint64_t tail __attribute__((aligned(RING_CACHELINE)));
+        int waiting;
+        uint64_t starved;                       /* times the ring ran empty */
+        uint64_t fill[RING_MAX_SLOTS + 1];      /* unread slots at each release */
+};
+
+struct ring {
+        _Atomic uint64_t head __attribute__((aligned(RING_CACHELINE)));
+        int waiting;
+        uint64_t full;                          /* times no slot was free */
+        struct ring_reader readers[RING_MAX_READERS];
+        unsigned int nslots;
+        unsigned int nreaders;
+};
+
+/*
+ *   Producer: slot to fill next, -1 while every slot is still being read
+ */
+static inline int ring_reserve(struct ring *r)
+{
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned int i;
+        for (i = 0; i < r->nreaders; i++) {
+                if (head - atomic_load_explicit(&r->readers[i].tail, memory_order_acquire) >= r->nslots) {
+                        r->full += !r->waiting;
+                        r->waiting = 1;
+                        return -1;
+                }
+        }
+        r->waiting = 0;
+        return head % r->nslots;
+}
+
+/*
+ *   Producer: hand the reserved slot to all consumers
+ */
+static inline void ring_publish(struct ring *r)
+{
+        atomic_store_explicit(&r->head,
+                              atomic_load_explicit(&r->head, memory_order_relaxed) + 1,
+                              memory_order_release);
+}
+
+/*
+ *   Consumer: oldest unread slot, -1 if there is none
+ */
+static inline int ring_peek(struct ring *r, unsigned int reader)
+{
+        struct ring_reader *rd = &r->readers[reader];
+        uint64_t tail = atomic_load_explicit(&rd->tail, memory_order_relaxed);
+        if (atomic_load_explicit(&r->head, memory_order_acquire) == tail) {
+                rd->starved += !rd->waiting;
+                rd->waiting = 1;
+                return -1;
+        }
+        rd->waiting = 0;
+        return tail % r->nslots;
+}
+
+/*
+ *   Consumer: done with the slot returned by ring_peek()
+ */
+static inline void ring_release(struct ring *r, unsigned int reader)
+{
+        struct ring_reader *rd = &r->readers[reader];
+        uint64_t tail = atomic_load_explicit(&rd->tail, memory_order_relaxed);
+        uint64_t fill = atomic_load_explicit(&r->head, memory_order_relaxed) - tail;
+        rd->fill[fill > RING_MAX_SLOTS ? RING_MAX_SLOTS : fill]++;
+        atomic_store_explicit(&rd->tail, tail + 1, memory_order_release);
+}
+
+void ring_init(struct ring *r, unsigned int nslots, unsigned int nreaders);
+void ring_merge(struct ring *dst, const struct ring *src);
+void ring_report(const struct ring *r, const char *const names[],
+                 unsigned int period_us, FILE *fp);
+
+#endif //RING_H_
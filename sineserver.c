@@ -1,96 +1,72 @@
 /*
  *  This small demo sends a simple sinusoidal wave to your speakers.
- *  compile: gcc -Wall sineserver.c -o generator -lasound -lm
+ *  compile: make (gcc -Wall sineserver.c generator.c pack.c -o server -lasound -lm)
  */
 
 #include "sineserver.h"
 
 // socket variables ***********************************************************
-int sock = -1;
-struct in_addr interface_addr;
-struct sockaddr_in mc_addr = {0};
-const char* mc_addr_str = NULL;
-static int mc_port = 2305;
+static int mc_port = 2305;                              /* default port of new streams */
+static uint32_t stream_id;                              /* ID of the first stream */
+static struct iface {
+        const char *name;
+        unsigned int index;
+        int cpu;                                        /* nearest the NIC's interrupts, -1 if unknown */
+} ifaces[MAX_INTERFACES];
+static unsigned int nifaces = 0;                        /* egress interfaces, 0 = as routed */
+static int mc_hops = -1;                                /* multicast TTL or hop limit, -1 = default */
+static int mc_loop = -1;                                /* multicast loopback, -1 = default */
+static int dscp = -1;                                   /* DiffServ code point, -1 = default */
+
+// stream variables ***********************************************************
+static struct stream *streams = NULL;
+static unsigned int nstreams = 0;
+static struct stream *mirrors = NULL;                   /* the streams again on each further interface */
+static unsigned int nmirrors = 0;
+static struct worker *workers = NULL;
+static unsigned int nworkers = 1;                       /* worker threads */
+static int pin_workers = 0;                             /* pin each worker to a CPU */
+static int method = 0;                                  /* transfer method */
 
 // audio variables ************************************************************
 static char *device = "plughw:0,0";                     /* playback device */
-static snd_pcm_format_t format = SND_PCM_FORMAT_S32;    /* sample format */
-static unsigned int rate = 192000;                      /* stream rate */
-static unsigned int channels = 2;                       /* count of channels */
 static unsigned int buffer_time = 500000;               /* ring buffer length in us */
 static unsigned int period_time = 100000;               /* period time in us */
-static double freq = 261.626;                           /* sinusoidal wave frequency in Hz */
+static const char *freq = "261.626";                    /* wave frequencies in Hz, per channel */
+static const char *amplitude = NULL;                    /* amplitudes, per channel */
+static const char *phase = NULL;                        /* start phases in degrees, per channel */
+static enum waveform wave = WAVE_SINE;                  /* wave shape */
+static double sweep_time = 1.;                          /* seconds per frequency sweep */
+static enum sine_engine engine = ENGINE_TABLE;          /* sine synthesis engine */
 static int verbose = 1;                                 /* verbose flag */
 static int resample = 1;                                /* enable alsa-lib resampling */
 static int period_event = 0;                            /* produce poll event after each period */
+static unsigned int burst = 1;                          /* datagrams released together when clocked */
+static long spin_time = 0;                              /* busy-poll before each release, in us */
+static const char *metrics_addr = NULL;                 /* metrics endpoint, port or socket path */
+static const char *control_addr = NULL;                 /* control socket, port or socket path */
+static int zerocopy = 0;                                /* send with MSG_ZEROCOPY */
+static struct pcm_file files[MAX_STREAMS];              /* FILE arguments, one per stream */
+static unsigned int nfiles = 0;
+static unsigned int cache_mb = 0;                       /* replay cache limit in MiB, 0 = always synthesise */
+static unsigned int ring_slots = 0;                     /* periods between generator and outputs, 0 = none */
+static int hugepages = 0;                               /* buffer arenas on 2 MiB pages */
+static struct arena *arenas = NULL;                     /* one per worker */
+static int rt_priority = 0;                             /* SCHED_FIFO priority of the stream threads, 0 = off */
+static unsigned int rt_test_ms = 0;                     /* wakeup latency self-test per CPU, 0 = none */
+static unsigned int selftest_streams = 0;               /* loopback self-test, 0 = off */
+static unsigned int selftest_receivers = 0;
+static unsigned int selftest_secs = 2;                  /* counted per rate step */
+static unsigned int selftest_top;                       /* rate the ramp ends at */
+static volatile sig_atomic_t stop = 0;                  /* set by SIGINT/SIGTERM, or to restart */
+static volatile sig_atomic_t quit = 0;                  /* set by SIGINT/SIGTERM */
+static int wake_fd = -1;                                /* and this eventfd is signalled */
 static snd_pcm_sframes_t buffer_size;
-static snd_pcm_sframes_t period_size;
 static snd_output_t *output = NULL;
-
-static void generate_sine(const snd_pcm_channel_area_t *areas,
-                          snd_pcm_uframes_t offset,
-                          int count, double *_phase)
-{
-        static double max_phase = 2. * M_PI;
-        double phase = *_phase;
-        double step = max_phase*freq/(double)rate;
-        unsigned char *samples[channels];
-        int steps[channels];
-        unsigned int chn;
-        int format_bits = snd_pcm_format_width(format);
-        unsigned int maxval = (1 << (format_bits - 1)) - 1;
-        int bps = format_bits / 8;  /* bytes per sample */
-        int phys_bps = snd_pcm_format_physical_width(format) / 8;
-        int big_endian = snd_pcm_format_big_endian(format) == 1;
-        int to_unsigned = snd_pcm_format_unsigned(format) == 1;
-        int is_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
-                        format == SND_PCM_FORMAT_FLOAT_BE);
-        /* verify and prepare the contents of areas */
-        for (chn = 0; chn < channels; chn++) {
-                if ((areas[chn].first % 8) != 0) {
-                        printf("areas[%i].first == %i, aborting...\n", chn, areas[chn].first);
-                        exit(EXIT_FAILURE);
-                }
-                samples[chn] = /*(signed short *)*/(((unsigned char *)areas[chn].addr) + (areas[chn].first / 8));
-                if ((areas[chn].step % 16) != 0) {
-                        printf("areas[%i].step == %i, aborting...\n", chn, areas[chn].step);
-                        exit(EXIT_FAILURE);
-                }
-                steps[chn] = areas[chn].step / 8;
-                samples[chn] += offset * steps[chn];
-        }
-        /* fill the channel areas */
-        while (count-- > 0) {
-                union {
-                        float f;
-                        int i;
-                } fval;
-                int res, i;
-                if (is_float) {
-                        fval.f = sin(phase);
-                        res = fval.i;
-                } else
-                        res = sin(phase) * maxval;
-                if (to_unsigned)
-                        res ^= 1U << (format_bits - 1);
-                for (chn = 0; chn < channels; chn++) {
-                        /* Generate data in native endian format */
-                        if (big_endian) {
-                                for (i = 0; i < bps; i++)
-                                        *(samples[chn] + phys_bps - 1 - i) = (res >> i * 8) & 0xff;
-                        } else {
-                                for (i = 0; i < bps; i++)
-                                        *(samples[chn] + i) = (res >>  i * 8) & 0xff;
-                        }
-                        samples[chn] += steps[chn];
-                }
-                phase += step;
-                if (phase >= max_phase)
-                        phase -= max_phase;
-          }
-
-        *_phase = phase;
-}
+static const char *sink_arg = NULL;
+static struct pacer lateness;                           /* of the streams, merged when their workers stop */
+static struct ring fill;
+static double audio_done;                               /* seconds of audio before the last restart */
 
 static int set_hwparams(snd_pcm_t *handle,
                         snd_pcm_hw_params_t *params,
@@ -218,14 +194,18 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
  */
 static int xrun_recovery(snd_pcm_t *handle, int err)
 {
+        /* only stream 0 plays on a device */
+        struct write_metrics *m = &streams[0].metrics.write;
         if (verbose)
                 printf("stream recovery\n");
         if (err == -EPIPE) {    /* under-run */
+                metric_add(&m->xruns, 1);
                 err = snd_pcm_prepare(handle);
                 if (err < 0)
                         printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
                 return 0;
         } else if (err == -ESTRPIPE) {
+                metric_add(&m->suspends, 1);
                 while ((err = snd_pcm_resume(handle)) == -EAGAIN)
                         sleep(1);       /* wait until the suspend flag is released */
                 if (err < 0) {
@@ -239,341 +219,3030 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
 }
 
 /*
- *   Transfer method - multicast
+ *   Output backends - where the local copy of every period goes
  */
-static int mcast_loop(snd_pcm_t *handle,
-                      signed short *samples,
-                      snd_pcm_channel_area_t *areas)
+struct sink {
+        const char *name;
+        int (*open)(struct sink *sink, const char *arg, snd_pcm_access_t access);
+        int (*write)(struct sink *sink, const void *buf, snd_pcm_uframes_t frames);
+        void (*close)(struct sink *sink);
+        int clocked;                                    /* released by the pacer, not by the device */
+        snd_pcm_t *handle;                              /* alsa */
+        snd_pcm_access_t access;
+        void **planes;                                  /* non-interleaved writes */
+        int fd;                                         /* file */
+};
+
+static int alsa_open(struct sink *sink, const char *arg, snd_pcm_access_t access)
 {
-        double phase = 0;
-        signed short *ptr;
-        int err, cptr;
-        while (1) {
-          generate_sine(areas, 0, period_size, &phase);
-          ptr = samples;        // PCM Data
-          cptr = period_size;   // number of frames
-          while (cptr > 0) {
-            err = snd_pcm_writei(handle, ptr, cptr);
-            size_t n = NELEMS(ptr);
-            for (size_t i = 0; i < n; i++) {
-              printf("%hd\n", ptr[n]);
-            }
-            // printf("%d\n", err);
-            if (err == -EAGAIN) {
-              continue;
-            }
-            if (err < 0) {
-              if (xrun_recovery(handle, err) < 0) {
-                printf("Write error: %s\n", snd_strerror(err));
-                exit(EXIT_FAILURE);
-              }
-              break;
-            }
-            ptr += err * channels;
-            cptr -= err;
-          }
+        snd_pcm_hw_params_t *hwparams;
+        snd_pcm_sw_params_t *swparams;
+        int err;
+        snd_pcm_hw_params_alloca(&hwparams);
+        snd_pcm_sw_params_alloca(&swparams);
+        printf("Playback device is %s\n", device);
+        /* the event loop polls the device instead of blocking in it */
+        if ((err = snd_pcm_open(&sink->handle, device, SND_PCM_STREAM_PLAYBACK,
+                                period_event ? SND_PCM_NONBLOCK : 0)) < 0) {
+                printf("Playback open error: %s\n", snd_strerror(err));
+                return err;
+        }
+        if ((err = set_hwparams(sink->handle, hwparams, access)) < 0) {
+                printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+                return err;
         }
+        if ((err = set_swparams(sink->handle, swparams)) < 0) {
+                printf("Setting of swparams failed: %s\n", snd_strerror(err));
+                return err;
+        }
+        if (verbose > 0)
+                snd_pcm_dump(sink->handle, output);
+        sink->access = access;
+        if (access == SND_PCM_ACCESS_RW_NONINTERLEAVED &&
+            (sink->planes = calloc(channels, sizeof(*sink->planes))) == NULL)
+                return -ENOMEM;
+        return 0;
 }
 
-static int ucast_loop(snd_pcm_t *handle,
-                      signed short *samples,
-                      snd_pcm_channel_area_t *areas)
+/*
+ *   One period laid out channel after channel, as rw_noninterleaved
+ *   generates it
+ */
+static int alsa_writen(struct sink *sink, const void *buf, snd_pcm_uframes_t frames)
 {
-        double phase = 0;
-        signed short *ptr;
-        int err, cptr;
-        while (1) {
-          generate_sine(areas, 0, period_size, &phase);
-          ptr = samples;
-          cptr = period_size;
-          while (cptr > 0) {
-            err = snd_pcm_writei(handle, ptr, cptr);
-            if (err == -EAGAIN) {
-              continue;
-            }
-            if (err < 0) {
-              if (xrun_recovery(handle, err) < 0) {
-                printf("Write error: %s\n", snd_strerror(err));
-                exit(EXIT_FAILURE);
-              }
-              break;
-            }
-            ptr += err * channels;
-            cptr -= err;
-          }
+        size_t sample_bytes = snd_pcm_format_physical_width(format) / 8;
+        snd_pcm_uframes_t done = 0;
+        unsigned int chn;
+        int err;
+        while (done < frames) {
+                for (chn = 0; chn < channels; chn++)
+                        sink->planes[chn] = (unsigned char *)buf + (chn * frames + done) * sample_bytes;
+                err = snd_pcm_writen(sink->handle, sink->planes, frames - done);
+                if (err == -EAGAIN) {
+                        metric_add(&streams[0].metrics.write.eagain, 1);
+                        snd_pcm_wait(sink->handle, 100);
+                        continue;
+                }
+                if (err < 0) {
+                        if (xrun_recovery(sink->handle, err) < 0)
+                                return err;
+                        break;  /* skip one period */
+                }
+                done += err;
         }
+        return 0;
 }
 
-/*
- *   Transfer method - write only
- */
-static int write_loop(snd_pcm_t *handle,
-                      signed short *samples,
-                      snd_pcm_channel_area_t *areas)
+static int alsa_write(struct sink *sink, const void *buf, snd_pcm_uframes_t frames)
 {
-        double phase = 0;
-        signed short *ptr;
-        int err, cptr;
-        while (1) {
-                generate_sine(areas, 0, period_size, &phase);
-                ptr = samples;
-                cptr = period_size;
-                while (cptr > 0) {
-                        err = snd_pcm_writei(handle, ptr, cptr); // write pcm data to the soundcard
-                        if (err == -EAGAIN)
-                                continue;
-                        if (err < 0) {
-                                if (xrun_recovery(handle, err) < 0) {
-                                        printf("Write error: %s\n", snd_strerror(err));
-                                        exit(EXIT_FAILURE);
-                                }
-                                break;  /* skip one period */
-                        }
-                        ptr += err * channels;
-                        cptr -= err;
+        size_t frame_bytes = channels * snd_pcm_format_physical_width(format) / 8;
+        const unsigned char *ptr = buf;
+        int err;
+        if (sink->access == SND_PCM_ACCESS_RW_NONINTERLEAVED)
+                return alsa_writen(sink, buf, frames);
+        while (frames > 0) {
+                err = snd_pcm_writei(sink->handle, ptr, frames); // write pcm data to the soundcard
+                if (err == -EAGAIN) {
+                        metric_add(&streams[0].metrics.write.eagain, 1);
+                        snd_pcm_wait(sink->handle, 100);
+                        continue;
+                }
+                if (err < 0) {
+                        if (xrun_recovery(sink->handle, err) < 0)
+                                return err;
+                        break;  /* skip one period */
                 }
+                ptr += err * frame_bytes;
+                frames -= err;
         }
+        return 0;
+}
+
+static void alsa_close(struct sink *sink)
+{
+        snd_pcm_close(sink->handle);
+        free(sink->planes);
 }
 
 /*
- *
+ *   null - discard, the loops release every packet on the pacer clock
+ *   net - discard, the network send path runs unthrottled
  */
-struct transfer_method {
-        const char *name;
-        snd_pcm_access_t access;
-        int (*transfer_loop)(snd_pcm_t *handle,
-                             signed short *samples,
-                             snd_pcm_channel_area_t *areas);
-};
+static int discard_write(struct sink *sink, const void *buf, snd_pcm_uframes_t frames)
+{
+        return 0;
+}
 
-static struct transfer_method transfer_methods[] = {
-        { "multicast", SND_PCM_ACCESS_RW_INTERLEAVED, mcast_loop },
-        { "unicast", SND_PCM_ACCESS_RW_INTERLEAVED, ucast_loop },
-        { "write", SND_PCM_ACCESS_RW_INTERLEAVED, write_loop },
-        { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL }
-};
-static void help(void)
+/*
+ *   file - raw PCM to a file or named pipe, paced by whoever reads it
+ */
+static int file_open(struct sink *sink, const char *arg, snd_pcm_access_t access)
 {
-        int k;
-        printf(
-          "Usage: pcm [OPTION]... [FILE]...\n"
-          "\n"
-          "-h,--help            help\n"
-          "-D,--device          playback device\n"
-          "-r,--rate            stream rate in Hz\n"
-          "-c,--channels        count of channels in stream\n"
-          "-f,--frequency       sine wave frequency in Hz\n"
-          "-b,--buffer          ring buffer size in us\n"
-          "-p,--period          period size in us\n"
-          "-m,--method          transfer method\n"
-          "-o,--format          sample format\n"
-          "-v,--verbose         show the PCM setup parameters\n"
-          "-n,--noresample      do not resample\n"
-          "-e,--pevent          enable poll event after each period\n"
-          "-A,--address         public ip address\n"
-          "-P,--port            public port number\n"
-          "--------------------------------------------------------\n"
-          "\n");
-        printf("Recognized sample formats are:\n");
-        for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
-                const char *s = snd_pcm_format_name(k);
-                if (s)
-                        printf(" %s,", s);
+        if (arg == NULL || *arg == '\0') {
+                printf("File output needs a path (-O file:PATH)\n");
+                return -EINVAL;
         }
-        printf("\n--------------------------------------------------------\n\n");
-
-        printf("Recognized transfer methods are:\n");
-        for (k = 0; transfer_methods[k].name; k++)
-                printf(" - %s\n", transfer_methods[k].name);
-        printf("\n");
+        printf("Output file is %s\n", arg);
+        if ((sink->fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+                return -errno;
+        return 0;
 }
-int main(int argc, char *argv[])
+
+static int file_write(struct sink *sink, const void *buf, snd_pcm_uframes_t frames)
 {
-        struct option long_option[] =
-        {
-                {"help", 0, NULL, 'h'},
-                {"device", 1, NULL, 'D'},
-                {"rate", 1, NULL, 'r'},
-                {"channels", 1, NULL, 'c'},
-                {"frequency", 1, NULL, 'f'},
-                {"buffer", 1, NULL, 'b'},
-                {"period", 1, NULL, 'p'},
-                {"method", 1, NULL, 'm'},
-                {"format", 1, NULL, 'o'},
-                {"verbose", 1, NULL, 'v'},
-                {"noresample", 1, NULL, 'n'},
-                {"pevent", 1, NULL, 'e'},
-                {"address", 1, NULL, 'A'},
-                {"port", 1, NULL, 'P'},
-                {NULL, 0, NULL, 0},
-        };
-        snd_pcm_t *handle;
-        int err, morehelp;
-        snd_pcm_hw_params_t *hwparams;
-        snd_pcm_sw_params_t *swparams;
-        int method = 0;
-        signed short *samples;
-        unsigned int chn;
-        snd_pcm_channel_area_t *areas;
-        snd_pcm_hw_params_alloca(&hwparams);
-        snd_pcm_sw_params_alloca(&swparams);
-        morehelp = 0;
-        while (1) {
-                int c;
-                if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:A:P:vne", long_option, NULL)) < 0)
-                        break;
-                switch (c) {
-                case 'h':
-                        morehelp++;
-                        break;
-                case 'D':
-                        device = strdup(optarg);
-                        break;
-                case 'r':
-                        rate = atoi(optarg);
-                        rate = rate < 4000 ? 4000 : rate;
-                        rate = rate > 196000 ? 196000 : rate;
-                        break;
-                case 'c':
-                        channels = atoi(optarg);
-                        channels = channels < 1 ? 1 : channels;
-                        channels = channels > 1024 ? 1024 : channels;
-                        break;
-                case 'f':
-                        freq = atoi(optarg);
-                        freq = freq < 50 ? 50 : freq;
-                        freq = freq > 5000 ? 5000 : freq;
-                        break;
-                case 'b':
-                        buffer_time = atoi(optarg);
-                        buffer_time = buffer_time < 1000 ? 1000 : buffer_time;
-                        buffer_time = buffer_time > 1000000 ? 1000000 : buffer_time;
-                        break;
-                case 'p':
-                        period_time = atoi(optarg);
-                        period_time = period_time < 1000 ? 1000 : period_time;
-                        period_time = period_time > 1000000 ? 1000000 : period_time;
-                        break;
-                case 'm':
-                        for (method = 0; transfer_methods[method].name; method++)
-                                        if (!strcasecmp(transfer_methods[method].name, optarg))
-                                        break;
-                        if (transfer_methods[method].name == NULL)
-                                method = 0;
-                        break;
-                case 'o':
-                        for (format = 0; format < SND_PCM_FORMAT_LAST; format++) {
-                                const char *format_name = snd_pcm_format_name(format);
-                                if (format_name)
-                                        if (!strcasecmp(format_name, optarg))
-                                        break;
-                        }
-                        if (format == SND_PCM_FORMAT_LAST)
-                                format = SND_PCM_FORMAT_S16;
-                        if (!snd_pcm_format_linear(format) &&
-                            !(format == SND_PCM_FORMAT_FLOAT_LE ||
-                              format == SND_PCM_FORMAT_FLOAT_BE)) {
-                                printf("Invalid (non-linear/float) format %s\n",
-                                       optarg);
-                                return 1;
-                        }
-                        break;
-                case 'v':
-                        verbose = 1;
-                        break;
-                case 'n':
-                        resample = 0;
-                        break;
-                case 'e':
-                        period_event = 1;
-                        break;
-                case 'A':
-                        mc_addr_str = optarg;
-                        break;
-                case 'P':
-                        mc_port = atoi(optarg);
-                        mc_port = mc_port < MIN_PORT ? MIN_PORT : mc_port;
-                        mc_port = mc_port > MAX_PORT ? MAX_PORT : mc_port;
-                        break;
+        size_t len = frames * channels * snd_pcm_format_physical_width(format) / 8;
+        const unsigned char *ptr = buf;
+        ssize_t n;
+        while (len > 0) {
+                n = write(sink->fd, ptr, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
                 }
+                ptr += n;
+                len -= n;
         }
-        if (morehelp) {
-                help();
-                return 0;
-        }
-
-        err = snd_output_stdio_attach(&output, stdout, 0);
-        if (err < 0) {
-                printf("Output failed: %s\n", snd_strerror(err));
-                return 0;
-        }
+        return 0;
+}
 
-        printf("\n");
-        printf("IP address is %s\n", mc_addr_str);
-        printf("Port number is %d\n", mc_port);
-        printf("Playback device is %s\n", device);
-        printf("Stream parameters are %iHz, %s, %i channels\n", rate, snd_pcm_format_name(format), channels);
-        printf("Sine wave rate is %.4fHz\n", freq);
-        printf("Using transfer method: %s\n", transfer_methods[method].name);
-        if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-                printf("Playback open error: %s\n", snd_strerror(err));
-                return 0;
-        }
+static void file_close(struct sink *sink)
+{
+        close(sink->fd);
+}
 
-        if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-          perror("Error opening socket");
-          close(sock);
-          exit(1);
-        }
+static struct sink sinks[] = {
+        { "alsa", alsa_open, alsa_write, alsa_close, 0 },
+        { "null", NULL, discard_write, NULL, 1 },
+        { "net", NULL, discard_write, NULL, 0 },
+        { "file", file_open, file_write, file_close, 0 },
+        { NULL }
+};
+static struct sink *sink = &sinks[0];                   /* local output of stream 0 */
 
-        memset((char *) &mc_addr, '\0', sizeof(mc_addr));
-        mc_addr.sin_family = AF_INET;
-        mc_addr.sin_port = htons(mc_port);
-        mc_addr.sin_addr.s_addr = inet_addr(mc_addr_str);
+static void on_signal(int sig)
+{
+        uint64_t one = 1;
+        stop = 1;
+        quit = 1;
+        if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+                ;       /* already signalled */
+}
 
-        // Set local interface for outbound multicast datagrams. The IP address specified must be associated with a local, multicast capable interface
-      	interface_addr.s_addr = htonl(INADDR_ANY);
+/*
+ *   A numeric IPv4 or IPv6 address and a port.  An IPv6 link-local
+ *   address names its interface as in fe80::1%eth0.  For an IPv6 socket
+ *   (family AF_INET6) an IPv4 address is mapped, any other family must
+ *   match unless it is AF_UNSPEC.
+ */
+static int parse_address(const char *host, int port, int family, union inet_addr *a)
+{
+        struct addrinfo hints, *res;
+        struct in_addr v4;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0)
+                return -EINVAL;
+        memset(a, 0, sizeof(*a));
+        memcpy(a, res->ai_addr, res->ai_addrlen < sizeof(*a) ? res->ai_addrlen : sizeof(*a));
+        freeaddrinfo(res);
+        if (a->sa.sa_family == AF_INET && family == AF_INET6) {
+                v4 = a->in.sin_addr;
+                memset(a, 0, sizeof(*a));
+                a->in6.sin6_family = AF_INET6;
+                a->in6.sin6_addr.s6_addr[10] = a->in6.sin6_addr.s6_addr[11] = 0xff;
+                memcpy(&a->in6.sin6_addr.s6_addr[12], &v4, sizeof(v4));
+        } else if (family != AF_UNSPEC && a->sa.sa_family != family)
+                return -EAFNOSUPPORT;
+        if (a->sa.sa_family == AF_INET6)
+                a->in6.sin6_port = htons(port);
+        else
+                a->in.sin_port = htons(port);
+        return 0;
+}
 
-        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (char *) &interface_addr, sizeof(interface_addr)) < 0) {
-          perror("Setting local interface error\n");
-          close(sock);
-          exit(1);
-        }
+static int same_addr(const union inet_addr *a, const union inet_addr *b)
+{
+        if (a->sa.sa_family != b->sa.sa_family)
+                return 0;
+        if (a->sa.sa_family == AF_INET6)
+                return a->in6.sin6_port == b->in6.sin6_port &&
+                       IN6_ARE_ADDR_EQUAL(&a->in6.sin6_addr, &b->in6.sin6_addr);
+        return a->in.sin_port == b->in.sin_port && a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+}
 
-        if ((err = set_hwparams(handle, hwparams, transfer_methods[method].access)) < 0) {
-                printf("Setting of hwparams failed: %s\n", snd_strerror(err));
-                exit(EXIT_FAILURE);
-        }
+static int addr_is_any(const union inet_addr *a)
+{
+        if (a->sa.sa_family == AF_INET6)
+                return IN6_IS_ADDR_UNSPECIFIED(&a->in6.sin6_addr);
+        return a->in.sin_addr.s_addr == htonl(INADDR_ANY);
+}
 
-        if ((err = set_swparams(handle, swparams)) < 0) {
-                printf("Setting of swparams failed: %s\n", snd_strerror(err));
-                exit(EXIT_FAILURE);
+/*
+ *   Room the period buffers of a stream are allocated with.  With a
+ *   control socket or the self-test ramp that is enough for any format
+ *   and rate it may switch to, so a switch only lays the buffers out
+ *   again.
+ */
+static void period_capacity(struct stream *s)
+{
+        snd_pcm_format_t widest = format;
+        snd_pcm_uframes_t frames = period_size, max_frames;
+        if (control_addr != NULL || selftest_streams) {
+                /* a device may round the period up */
+                max_frames = (snd_pcm_uframes_t)MAX_RATE * period_time / 1000000 * 5 / 4;
+                frames = frames > max_frames ? frames : max_frames;
+                if (snd_pcm_format_physical_width(format) < 32)
+                        widest = SND_PCM_FORMAT_S32;
         }
+        period_room(s, frames, widest);
+}
 
-        if (verbose > 0)
-                snd_pcm_dump(handle, output);
-        samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
-        if (samples == NULL) {
-                printf("No enough memory\n");
-                exit(EXIT_FAILURE);
-        }
+/*
+ *   How many period buffers a stream cycles through, and their room
+ */
+static void stream_periods(struct stream *s)
+{
+        s->nperiods = ring_slots ? ring_slots : zerocopy ? ZC_PERIODS : 1;
+        period_capacity(s);
+}
 
-        areas = calloc(channels, sizeof(snd_pcm_channel_area_t));
-        if (areas == NULL) {
-                printf("No enough memory\n");
+/*
+ *   Arena bytes stream_init() carves for s, the same sizes in the same
+ *   rounding, plus room for ARENA_SUBSCRIBERS in growing arrays
+ */
+static size_t stream_footprint(struct stream *s)
+{
+        size_t subs;
+        stream_periods(s);
+        /* 16, 32, ... up to ARENA_SUBSCRIBERS: less than twice the largest */
+        for (subs = 64; subs < ARENA_SUBSCRIBERS * sizeof(struct subscriber); subs *= 2)
+                ;
+        return periods_footprint(s) + 2 * subs;
+}
+
+/*
+ *   Sample clock the next datagram of the stream is due at
+ */
+static uint64_t next_frame(const struct stream *s)
+{
+        return s->msg_frame ? s->frame + s->msg_frame[s->next_packet] : s->frame;
+}
+
+/*
+ *   Before generating into p again, wait until the kernel let go of it
+ */
+static void zc_reclaim(struct stream *s, struct period *p)
+{
+        while (atomic_load_explicit(&p->zc_pending, memory_order_acquire) != 0 && !stop) {
+                if (zc_reap(s->sock, zc_done, s) == 0)
+                        zc_wait(s->sock, 1);
+        }
+}
+
+/*
+ *   Before laying the periods out anew, wait a while for the kernel to
+ *   let go of all of them
+ */
+static void zc_drain(struct stream *s)
+{
+        unsigned int i, tries;
+        for (i = 0; s->zc && i < s->nperiods; i++)
+                for (tries = 0; atomic_load(&s->periods[i].zc_pending) != 0 && tries < 100; tries++)
+                        if (zc_reap(s->sock, zc_done, s) == 0)
+                                zc_wait(s->sock, 10);
+}
+
+/*
+ *   Subscriber arrays come from the free-lists of the worker's arena, so
+ *   growing one on the send path does not call malloc; past the room
+ *   set aside for them they come from the heap
+ */
+static struct subscriber *subs_get(struct stream *s, unsigned int n)
+{
+        struct subscriber *subs = arena_get(s->arena, n * sizeof(*subs));
+        return subs != NULL ? subs : malloc(n * sizeof(*subs));
+}
+
+static void subs_put(struct stream *s, struct subscriber *subs, unsigned int n)
+{
+        if (arena_owns(s->arena, subs))
+                arena_put(s->arena, subs, n * sizeof(*subs));
+        else
+                free(subs);
+}
+
+/*
+ *   Unicast streams listen for subscriptions on their own port and send
+ *   from the same socket, so replies reach receivers behind NAT.  A
+ *   destination given with -A is subscribed for good.  With a control
+ *   socket multicast streams fan out as well, to their group and to the
+ *   destinations added there, without listening.
+ */
+static int fanout_init(struct stream *s, int subscribers)
+{
+        union inet_addr local;
+        int bufsize = 4 << 20;
+        memset(&local, 0, sizeof(local));
+        local.sa.sa_family = s->addr.sa.sa_family;
+        if (local.sa.sa_family == AF_INET6) {
+                local.in6.sin6_port = htons(s->port);
+                local.in6.sin6_addr = in6addr_any;
+        } else {
+                local.in.sin_port = htons(s->port);
+                local.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+        if (subscribers && bind(s->sock, &local.sa, addr_len(&local)) < 0) {
+                printf("Stream %u: cannot listen on port %d: %s\n", s->index, s->port, strerror(errno));
+                return -errno;
+        }
+        s->listen = subscribers;
+        /* a keepalive round of every subscriber may arrive within one period */
+        setsockopt(s->sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+        setsockopt(s->sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        s->max_subs = 16;
+        s->subs = subs_get(s, s->max_subs);
+        if (s->subs == NULL)
+                return -ENOMEM;
+        if (s->addr_str != NULL && !addr_is_any(&s->addr)) {
+                s->subs[0].addr = s->addr;
+                s->subs[0].seen_ns = 0;
+                s->nsubs = 1;
+        }
+        return 0;
+}
+
+static unsigned int find_subscriber(const struct stream *s, const union inet_addr *addr)
+{
+        unsigned int j;
+        for (j = 0; j < s->nsubs; j++)
+                if (same_addr(&s->subs[j].addr, addr))
+                        break;
+        return j;
+}
+
+static void subscribe(struct stream *s, const union inet_addr *from, int type, long long now)
+{
+        struct subscriber *subs;
+        unsigned int j = find_subscriber(s, from);
+        if (type == SINE_CTRL_UNSUBSCRIBE) {
+                if (j < s->nsubs && s->subs[j].seen_ns != 0)
+                        s->subs[j] = s->subs[--s->nsubs];
+                return;
+        }
+        if (j < s->nsubs) {
+                if (s->subs[j].seen_ns != 0)
+                        s->subs[j].seen_ns = now;
+                return;
+        }
+        if (s->nsubs == s->max_subs) {
+                if (s->max_subs == MAX_SUBSCRIBERS)
+                        return;
+                if ((subs = subs_get(s, 2 * s->max_subs)) == NULL)
+                        return;
+                memcpy(subs, s->subs, s->nsubs * sizeof(*subs));
+                subs_put(s, s->subs, s->max_subs);
+                s->subs = subs;
+                s->max_subs *= 2;
+        }
+        s->subs[s->nsubs].addr = *from;
+        s->subs[s->nsubs].seen_ns = now;
+        s->nsubs++;
+}
+
+/*
+ *   Take pending subscription messages off the stream socket and drop
+ *   receivers whose keepalive lapsed.  Called once per period.
+ */
+static void poll_subscribers(struct stream *s)
+{
+        struct sine_ctrl msg;
+        union inet_addr from;
+        socklen_t len = sizeof(from);
+        long long now = monotonic_ns();
+        unsigned int j;
+        ssize_t n;
+        while (s->listen &&
+               (n = recvfrom(s->sock, &msg, sizeof(msg), MSG_DONTWAIT, &from.sa, &len)) >= 0) {
+                len = sizeof(from);
+                if (n < (ssize_t)sizeof(msg) || msg.version != SINE_VERSION)
+                        continue;
+                if (msg.stream_id != 0 && ntohl(msg.stream_id) != s->id)
+                        continue;
+                subscribe(s, &from, msg.type, now);
+        }
+        for (j = 0; j < s->nsubs; j++) {
+                if (s->subs[j].seen_ns != 0 &&
+                    now - s->subs[j].seen_ns > SINE_EXPIRY_MS * 1000000LL)
+                        s->subs[j--] = s->subs[--s->nsubs];
+        }
+        metric_set(&s->metrics.send.subscribers, s->nsubs);
+}
+
+/*
+ *   Take a destination change posted by the control thread, between two
+ *   periods.  An added destination is permanent like one given with -A,
+ *   a removed one may be any.
+ */
+static void take_destination(struct stream *s)
+{
+        struct control_cmd *cmd = atomic_load_explicit(&s->send_cmd, memory_order_acquire);
+        unsigned int j;
+        if (cmd == NULL || !atomic_compare_exchange_strong(&s->send_cmd, &cmd, NULL))
+                return;
+        j = find_subscriber(s, &cmd->addr);
+        if (cmd->type == CMD_ADD) {
+                /* seen at 0, i.e. never expires */
+                subscribe(s, &cmd->addr, SINE_CTRL_SUBSCRIBE, 0);
+                cmd->result = find_subscriber(s, &cmd->addr) < s->nsubs ? 0 : -ENOSPC;
+        } else if (j < s->nsubs) {
+                s->subs[j] = s->subs[--s->nsubs];
+                cmd->result = 0;
+        } else
+                cmd->result = -ENOENT;
+        metric_set(&s->metrics.send.subscribers, s->nsubs);
+        atomic_store_explicit(&cmd->done, 1, memory_order_release);
+}
+
+/*
+ *   Send vlen datagrams of period p to every subscriber.  Each message
+ *   points at the period's own header and payload iovecs, only the
+ *   destination differs.  A datagram the kernel refuses for one receiver
+ *   is counted and skipped.
+ */
+static void fan_flush(struct stream *s, struct period *p, struct mmsghdr *vec, unsigned int vlen)
+{
+        int sent;
+        while (vlen > 0) {
+                sent = sendmmsg(s->sock, vec, vlen, s->zc ? MSG_ZEROCOPY : 0);
+                if (sent < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == ENOBUFS && s->zc) {
+                                zc_backpressure(s);
+                                continue;
+                        }
+                        metric_add(&s->metrics.send.dropped, 1);
+                        sent = 1;
+                } else {
+                        zc_sent(s, p, sent);
+                        count_sent(s, vec, sent);
+                }
+                vec += sent;
+                vlen -= sent;
+        }
+}
+
+static void fan_send(struct stream *s, struct period *p, unsigned int first, unsigned int vlen)
+{
+        static __thread struct mmsghdr fan[FAN_BATCH];
+        unsigned int n, j, k = 0;
+        for (n = first; n < first + vlen; n++) {
+                for (j = 0; j < s->nsubs; j++) {
+                        fan[k].msg_hdr.msg_name = &s->subs[j].addr;
+                        fan[k].msg_hdr.msg_namelen = addr_len(&s->subs[j].addr);
+                        fan[k].msg_hdr.msg_iov = &p->iovecs[2 * n];
+                        fan[k].msg_hdr.msg_iovlen = 2;
+                        if (++k == FAN_BATCH) {
+                                fan_flush(s, p, fan, k);
+                                k = 0;
+                        }
+                }
+        }
+        fan_flush(s, p, fan, k);
+}
+
+/*
+ *   Set the generator of a stream up for its voices at the current
+ *   format and rate, with a replay cache if they repeat.  A file is
+ *   replayed in place when it holds what the stream sends.
+ */
+static int stream_generator(struct stream *s, snd_pcm_access_t access)
+{
+        int err;
+        generator_init(&s->gen, engine, format, channels, rate, strtod(s->voices.freqs, NULL));
+        if (s->file != NULL) {
+                s->replay = generator_file(&s->gen, s->file) &&
+                            access != SND_PCM_ACCESS_RW_NONINTERLEAVED;
+                return 0;
+        }
+        if ((err = generator_voices(&s->gen, &s->voices)) < 0)
+                return err;
+        s->replay = 0;
+        if (cache_mb) {
+                err = generator_cache(&s->gen, period_size, (size_t)cache_mb << 20);
+                if (err == -ERANGE || err == -E2BIG)
+                        printf("Stream %u: live synthesis, %s\n", s->index, err == -ERANGE ?
+                               "the wave does not repeat" : "its repeat exceeds the cache");
+                else if (err < 0)
+                        return err;
+                else if ((s->replay = access != SND_PCM_ACCESS_RW_NONINTERLEAVED))
+                        return alloc_coded(s, &s->gen);
+        }
+        return 0;
+}
+
+/*
+ *   Socket of stream s for interface k of -i, or for whichever the route
+ *   picks without -i, with the hop limit, loopback and DSCP asked for.
+ *   An IPv6 socket also reaches IPv4 receivers, mapped, so it gets the
+ *   IPv4 options as well.
+ */
+static int stream_socket(struct stream *s, unsigned int k)
+{
+        int family = s->addr.sa.sa_family, ifindex = nifaces ? ifaces[k].index : 0;
+        int sock, err, off = 0, tos = dscp << 2, uindex = htonl(ifindex);
+        struct ip_mreqn mreqn;
+        if ((sock = socket(family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+                perror("Error opening socket");
+                return -errno;
+        }
+        memset(&mreqn, 0, sizeof(mreqn));
+        mreqn.imr_ifindex = ifindex;
+        if (family == AF_INET6) {
+                setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+                if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0 ||
+                    (ifindex && setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_IF, &uindex, sizeof(uindex)) < 0) ||
+                    (mc_hops >= 0 && setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &mc_hops, sizeof(mc_hops)) < 0) ||
+                    (mc_loop >= 0 && setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &mc_loop, sizeof(mc_loop)) < 0) ||
+                    (dscp >= 0 && setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) < 0))
+                        goto fail;
+                /* best effort for the mapped IPv4 receivers */
+                setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn));
+                if (ifindex)
+                        setsockopt(sock, IPPROTO_IP, IP_UNICAST_IF, &uindex, sizeof(uindex));
+                if (dscp >= 0)
+                        setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+                return sock;
+        }
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn)) < 0 ||
+            (ifindex && setsockopt(sock, IPPROTO_IP, IP_UNICAST_IF, &uindex, sizeof(uindex)) < 0) ||
+            (mc_hops >= 0 && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &mc_hops, sizeof(mc_hops)) < 0) ||
+            (mc_loop >= 0 && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &mc_loop, sizeof(mc_loop)) < 0) ||
+            (dscp >= 0 && setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0))
+                goto fail;
+        return sock;
+fail:
+        err = -errno;
+        printf("Stream %u: setting up the socket for %s failed: %s\n", s->index,
+               nifaces ? ifaces[k].name : "any interface", strerror(-err));
+        close(sock);
+        return err;
+}
+
+/*
+ *   Take over the datagram layout of the source, after it was laid out
+ *   anew, and start over with it
+ */
+static void mirror_sync(struct stream *m)
+{
+        const struct stream *s = m->source;
+        m->periods = s->periods;
+        m->nperiods = s->nperiods;
+        m->npackets = s->npackets;
+        m->ngroups = s->ngroups;
+        m->nmsgs = s->nmsgs;
+        m->msg_frame = s->msg_frame;
+        m->code_len = s->code_len;
+        m->packet_frames = s->packet_frames;
+        m->frame = 0;
+        m->next_packet = 0;
+}
+
+/*
+ *   Stream s again on interface k: its own socket, clock and counters,
+ *   sending the periods of s from their slots
+ */
+static int mirror_init(struct stream *m, struct stream *s, unsigned int k)
+{
+        m->index = s->index;
+        m->id = s->id;
+        m->addr_str = s->addr_str;
+        m->port = s->port;
+        m->addr = s->addr;
+        m->source = s;
+        m->reader = k;
+        m->iface = ifaces[k].name;
+        if ((m->sock = stream_socket(m, k)) < 0)
+                return m->sock;
+        mirror_sync(m);
+        return 0;
+}
+
+/*
+ *   Allocate the period buffers of a stream, laid out for the access
+ *   type of the method, and open its socket, bound for subscriptions if
+ *   the method sends to subscribers
+ */
+static int stream_init(struct stream *s, int subscribers, snd_pcm_access_t access)
+{
+        int err;
+        stream_periods(s);
+        if ((err = alloc_periods(s, access)) < 0)
+                return err;
+        if ((err = stream_generator(s, access)) < 0)
+                return err;
+        s->sock = -1;
+        if (s->addr_str == NULL && !subscribers)
+                return 0;
+
+        memset(&s->addr, 0, sizeof(s->addr));
+        s->addr.in.sin_family = AF_INET;
+        s->addr.in.sin_port = htons(s->port);
+        if (s->addr_str != NULL && parse_address(s->addr_str, s->port, AF_UNSPEC, &s->addr) < 0) {
+                printf("Invalid address %s\n", s->addr_str);
+                return -EINVAL;
+        }
+        if ((s->sock = stream_socket(s, 0)) < 0)
+                return s->sock;
+        s->iface = nifaces ? ifaces[0].name : NULL;
+        if ((subscribers || control_addr != NULL) && (err = fanout_init(s, subscribers)) < 0)
+                return err;
+        if (zerocopy) {
+                if ((err = zc_enable(s->sock)) < 0)
+                        printf("Stream %u: no zero-copy transmit (%s), copying\n", s->index, strerror(-err));
+                s->zc = err == 0;
+        }
+        return alloc_datagrams(s);
+}
+
+/*
+ *   Lay a stream out again after a format or rate change, in the buffers
+ *   it has, and start it over at frame 0.  Sequence numbers go on.
+ */
+static int stream_reset(struct stream *s, snd_pcm_access_t access)
+{
+        struct period *p;
+        unsigned int i;
+        int err;
+        generator_free(&s->gen);
+        free(s->old_cache);
+        free(s->old_coded);
+        s->old_cache = NULL;
+        s->old_coded = NULL;
+        if ((err = stream_generator(s, access)) < 0)
+                return err;
+        for (i = 0; i < s->nperiods; i++) {
+                p = &s->periods[i];
+                p->data = p->samples;
+                p->zc_first = p->zc_end = s->zc_next;
+                atomic_store(&p->zc_pending, 0);
+                if ((err = layout_areas(s, p, access)) < 0)
+                        return err;
+                if (s->sock >= 0 && (err = prepare_packets(s, p)) < 0)
+                        return err;
+        }
+        s->produced = 0;
+        s->frame = 0;
+        s->next_packet = 0;
+        s->sending = 0;
+        s->blocked = 0;
+        return 0;
+}
+
+/*
+ *   The buffers go with the arena
+ */
+static void stream_free(struct stream *s)
+{
+        if (s->sock >= 0)
+                close(s->sock);
+        if (s->subs != NULL)
+                subs_put(s, s->subs, s->max_subs);
+        generator_free(&s->gen);
+        free(s->old_cache);
+        free(s->old_coded);
+        free(s->voice_strings);
+}
+
+/*
+ *   The stream to service next: the one with the earliest deadline on the
+ *   pacer clock, or simply the next in turn when the output paces us
+ */
+static struct stream *worker_next(struct worker *w)
+{
+        struct stream *s, *best;
+        long long deadline, best_deadline;
+        unsigned int i;
+        if (!sink->clocked || w->nstreams == 1)
+                return w->streams[w->next++ % w->nstreams];
+        best = w->streams[0];
+        best_deadline = pacer_deadline(&best->pacer, next_frame(best));
+        for (i = 1; i < w->nstreams; i++) {
+                s = w->streams[i];
+                deadline = pacer_deadline(&s->pacer, next_frame(s));
+                if (deadline < best_deadline) {
+                        best = s;
+                        best_deadline = deadline;
+                }
+        }
+        return best;
+}
+
+static int check_destinations(struct worker *w)
+{
+        unsigned int i;
+        for (i = 0; i < w->nstreams; i++) {
+                if (w->streams[i]->sock < 0) {
+                        printf("Stream %u: network transfer needs a destination address (-A)\n",
+                               w->streams[i]->index);
+                        return -EINVAL;
+                }
+        }
+        return 0;
+}
+
+/*
+ *   Wait for the pacer deadline of 'frame' and record how late we were
+ */
+static void pace(struct stream *s, uint64_t frame)
+{
+        hist_record(&s->metrics.send.lateness, pacer_wait(&s->pacer, frame));
+}
+
+/*
+ *   Release the next datagrams of period p: the whole period when the
+ *   output paces us, 'burst' datagrams per deadline on the pacer clock.
+ *   Returns 1 once the last datagram of the period is out, 0 otherwise or
+ *   when a non-blocking socket filled up (s->blocked).
+ */
+static int send_step(struct stream *s, struct period *p)
+{
+        long long start;
+        unsigned int vlen;
+        int err;
+        vlen = sink->clocked ? burst : s->nmsgs;
+        if (vlen > s->nmsgs - s->next_packet)
+                vlen = s->nmsgs - s->next_packet;
+        if (sink->clocked)
+                pace(s, next_frame(s));
+        if (s->zc && s->next_packet == 0)
+                p->zc_first = p->zc_end = s->zc_next;
+        start = monotonic_ns();
+        if (s->subs != NULL) {
+                if (s->next_packet == 0) {
+                        take_destination(s);
+                        poll_subscribers(s);
+                }
+                fan_send(s, p, s->next_packet, vlen);
+        } else if ((err = send_packets(s, p, p->msgs + s->next_packet, vlen)) < 0) {
+                printf("Send error: %s\n", strerror(-err));
+                exit(EXIT_FAILURE);
+        } else if ((unsigned int)err < vlen) {
+                s->next_packet += err;  /* socket full, event mode waits for room */
+                s->blocked = 1;
+                return 0;
+        }
+        hist_record(&s->metrics.send.send, monotonic_ns() - start);
+        if (s->zc)
+                zc_reap(s->sock, zc_done, s);
+        s->next_packet += vlen;
+        if (s->next_packet < s->nmsgs)
+                return 0;
+        s->next_packet = 0;
+        s->frame += period_size;
+        return 1;
+}
+
+static void local_write(struct stream *s, struct period *p)
+{
+        long long start;
+        int err;
+        if (s->index != 0)
+                return;
+        start = monotonic_ns();
+        if ((err = sink->write(sink, p->data, period_size)) < 0) {
+                printf("Write error: %s\n", snd_strerror(err));
+                exit(EXIT_FAILURE);
+        }
+        hist_record(&s->metrics.write.write, monotonic_ns() - start);
+        metric_add(&s->metrics.write.frames, period_size);
+}
+
+/*
+ *   Generate, send and play one stream from the same thread.  Stream 0
+ *   is also played on the local output.
+ */
+static int net_step(struct stream *s)
+{
+        struct period *p;
+        if (s->next_packet == 0) {
+                p = &s->periods[s->produced % s->nperiods];
+                if (s->zc)
+                        zc_reclaim(s, p);
+                produce_period(s, p);
+        }
+        p = &s->periods[(s->produced - 1) % s->nperiods];
+        if (send_step(s, p))
+                local_write(s, p);
+        return 0;
+}
+
+/*
+ *   Back off while a ring is full or empty: spin briefly, then sleep
+ *   for up to a millisecond
+ */
+static void ring_backoff(unsigned int *idle)
+{
+        struct timespec ts = { 0, 0 };
+        if (*idle < 16) {
+                (*idle)++;
+                sched_yield();
+                return;
+        }
+        ts.tv_nsec = 1000L << (*idle - 16 < 10 ? (*idle)++ - 16 : 10);
+        nanosleep(&ts, NULL);
+}
+
+/*
+ *   Generator side of a ring: keep every ring of the worker topped up
+ */
+static int produce_loop(struct worker *w)
+{
+        struct stream *s;
+        unsigned int i, idle = 0;
+        int slot, busy;
+        while (!stop) {
+                busy = 0;
+                for (i = 0; i < w->nstreams; i++) {
+                        s = w->streams[i];
+                        if ((slot = ring_reserve(&s->ring)) < 0)
+                                continue;
+                        /* the sender reaps zero-copy completions for us */
+                        if (atomic_load_explicit(&s->periods[slot].zc_pending, memory_order_acquire))
+                                continue;
+                        produce_period(s, &s->periods[slot]);
+                        ring_publish(&s->ring);
+                        busy = 1;
+                }
+                if (busy)
+                        idle = 0;
+                else
+                        ring_backoff(&idle);
+        }
+        return 0;
+}
+
+/*
+ *   Sender thread of a ring: send periods straight from their slots.  The
+ *   sender of a further interface reads the ring of the stream it sends
+ *   again, as reader k of interface k.
+ */
+static void *send_main(void *arg)
+{
+        struct worker *w = arg;
+        struct stream *s;
+        struct ring *r;
+        unsigned int idle = 0;
+        int slot;
+        while (!stop) {
+                s = worker_next(w);
+                r = s->source ? &s->source->ring : &s->ring;
+                if ((slot = ring_peek(r, s->reader)) < 0) {
+                        if (s->zc)
+                                zc_reap(s->sock, zc_done, s);
+                        ring_backoff(&idle);
+                        continue;
+                }
+                idle = 0;
+                if (send_step(s, &s->periods[slot]))
+                        ring_release(r, s->reader);
+        }
+        return NULL;
+}
+
+/*
+ *   Writer thread of a ring: play stream 0 on the local output.  Without
+ *   a sender it also owns the clock of every stream of its worker.
+ */
+static void *write_main(void *arg)
+{
+        struct worker *w = arg;
+        struct stream *s;
+        unsigned int reader, idle = 0;
+        int slot;
+        while (!stop) {
+                s = w->has_sender ? &streams[0] : worker_next(w);
+                reader = s->ring.nreaders - 1;
+                if ((slot = ring_peek(&s->ring, reader)) < 0) {
+                        ring_backoff(&idle);
+                        continue;
+                }
+                idle = 0;
+                if (!w->has_sender) {
+                        if (sink->clocked)
+                                pace(s, s->frame);
+                        s->frame += period_size;
+                }
+                local_write(s, &s->periods[slot]);
+                ring_release(&s->ring, reader);
+        }
+        return NULL;
+}
+
+/*
+ *   Event mode (-e): a worker waits on the device poll descriptors, its
+ *   stream sockets, a pacing timer and the stop event in one epoll set,
+ *   and only works when a period is due or a full socket drained.
+ */
+enum { EV_WAKE, EV_ALSA, EV_TIMER, EV_SOCK };
+#define   EV_TAG(kind, i)       ((uint64_t)(kind) << 32 | (i))
+#define   EV_BATCH              64
+
+static int event_ctl(int ep, int op, int fd, uint32_t events, uint64_t tag)
+{
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.u64 = tag;
+        return epoll_ctl(ep, op, fd, &ev) < 0 ? -errno : 0;
+}
+
+/*
+ *   Is the next period of s due: room in the device for stream 0 on the
+ *   alsa output, the pacer deadline with a clocked output, else always
+ */
+static int period_due(struct stream *s)
+{
+        snd_pcm_sframes_t avail;
+        if (s->index == 0 && sink->handle != NULL) {
+                avail = snd_pcm_avail_update(sink->handle);
+                if (avail < 0) {
+                        if (xrun_recovery(sink->handle, avail) < 0) {
+                                printf("avail update failed: %s\n", snd_strerror(avail));
+                                exit(EXIT_FAILURE);
+                        }
+                        return 1;
+                }
+                return avail >= period_size;
+        }
+        if (sink->clocked)
+                return pacer_deadline(&s->pacer, s->frame) - s->pacer.spin_ns <= monotonic_ns();
+        return 1;
+}
+
+/*
+ *   Move one stream on without blocking: start at most one period and
+ *   send its datagrams as far as the pacer and the socket allow.
+ *   Returns 1 if it may be able to continue right away.
+ */
+static int event_service(struct stream *s)
+{
+        struct period *p;
+        if (s->blocked)
+                return 0;
+        if (!s->sending) {
+                p = &s->periods[s->produced % s->nperiods];
+                /* zero-copy completions wake us through EPOLLERR */
+                if (s->zc && atomic_load(&p->zc_pending) != 0 &&
+                    (zc_reap(s->sock, zc_done, s), atomic_load(&p->zc_pending) != 0))
+                        return 0;
+                if (!period_due(s))
+                        return 0;
+                produce_period(s, p);
+                local_write(s, p);
+                if (s->sock < 0) {
+                        if (sink->clocked)
+                                pace(s, s->frame);
+                        s->frame += period_size;
+                        return 1;
+                }
+                s->sending = 1;
+        }
+        p = &s->periods[(s->produced - 1) % s->nperiods];
+        while (s->sending) {
+                if (sink->clocked &&
+                    pacer_deadline(&s->pacer, next_frame(s)) -
+                    s->pacer.spin_ns > monotonic_ns())
+                        return 0;
+                if (send_step(s, p))
+                        s->sending = 0;
+                else if (s->blocked)
+                        return 0;
+        }
+        return 1;
+}
+
+static void event_arm_timer(int tfd, long long deadline)
+{
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = deadline / 1000000000LL;
+        its.it_value.tv_nsec = deadline % 1000000000LL;
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int event_loop(struct worker *w)
+{
+        struct epoll_event events[EV_BATCH];
+        struct pollfd *pfds = NULL;
+        struct stream *s, *s0 = NULL;
+        long long deadline, earliest;
+        unsigned short revents;
+        unsigned int i;
+        int ep, tfd, n, j, npfds = 0, alsa_on = 0, runnable, err = 0;
+        uint64_t ticks;
+        if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+                return -errno;
+        if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+                close(ep);
+                return -errno;
+        }
+        event_ctl(ep, EPOLL_CTL_ADD, wake_fd, EPOLLIN, EV_TAG(EV_WAKE, 0));
+        event_ctl(ep, EPOLL_CTL_ADD, tfd, EPOLLIN, EV_TAG(EV_TIMER, 0));
+        for (i = 0; i < w->nstreams; i++) {
+                s = w->streams[i];
+                if (s->index == 0 && sink->handle != NULL)
+                        s0 = s;
+                if (s->sock < 0)
+                        continue;
+                /* fan-out keeps blocking sends, a full socket there is rare */
+                if (s->subs == NULL)
+                        fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK);
+                event_ctl(ep, EPOLL_CTL_ADD, s->sock, s->listen ? EPOLLIN : 0, EV_TAG(EV_SOCK, i));
+        }
+        if (s0 != NULL) {
+                npfds = snd_pcm_poll_descriptors_count(sink->handle);
+                pfds = calloc(npfds, sizeof(*pfds));
+                if (pfds == NULL || snd_pcm_poll_descriptors(sink->handle, pfds, npfds) != npfds) {
+                        err = -ENOMEM;
+                        goto out;
+                }
+                for (j = 0; j < npfds; j++)
+                        event_ctl(ep, EPOLL_CTL_ADD, pfds[j].fd, pfds[j].events, EV_TAG(EV_ALSA, j));
+                alsa_on = 1;
+        }
+
+        runnable = 1;
+        while (!stop) {
+                n = epoll_wait(ep, events, EV_BATCH, runnable ? 0 : -1);
+                if (n < 0 && errno != EINTR) {
+                        err = -errno;
+                        break;
+                }
+                for (j = 0; j < n; j++) {
+                        i = (uint32_t)events[j].data.u64;
+                        switch (events[j].data.u64 >> 32) {
+                        case EV_ALSA:
+                                pfds[i].revents = events[j].events;
+                                snd_pcm_poll_descriptors_revents(sink->handle, pfds, npfds, &revents);
+                                pfds[i].revents = 0;
+                                break;
+                        case EV_TIMER:
+                                if (read(tfd, &ticks, sizeof(ticks)) < 0)
+                                        ;       /* nothing expired */
+                                break;
+                        case EV_SOCK:
+                                s = w->streams[i];
+                                if ((events[j].events & EPOLLERR) && s->zc)
+                                        zc_reap(s->sock, zc_done, s);
+                                if (events[j].events & EPOLLIN)
+                                        poll_subscribers(s);
+                                if ((events[j].events & EPOLLOUT) && s->blocked) {
+                                        s->blocked = 0;
+                                        event_ctl(ep, EPOLL_CTL_MOD, s->sock, s->listen ? EPOLLIN : 0,
+                                                  EV_TAG(EV_SOCK, i));
+                                }
+                                break;
+                        }
+                }
+                runnable = 0;
+                earliest = LLONG_MAX;
+                for (i = 0; i < w->nstreams && !stop; i++) {
+                        s = w->streams[i];
+                        runnable |= event_service(s);
+                        if (s->blocked) {
+                                event_ctl(ep, EPOLL_CTL_MOD, s->sock,
+                                          (s->listen ? EPOLLIN : 0) | EPOLLOUT, EV_TAG(EV_SOCK, i));
+                                continue;
+                        }
+                        if (sink->clocked) {
+                                deadline = pacer_deadline(&s->pacer, next_frame(s));
+                                if (deadline - s->pacer.spin_ns < earliest)
+                                        earliest = deadline - s->pacer.spin_ns;
+                        }
+                }
+                if (earliest != LLONG_MAX) {
+                        if (earliest <= monotonic_ns())
+                                runnable = 1;
+                        else
+                                event_arm_timer(tfd, earliest);
+                }
+                /* a device that has room stays ready, ignore it while its stream waits on the network */
+                if (s0 != NULL && alsa_on == s0->blocked) {
+                        alsa_on = !s0->blocked;
+                        for (j = 0; j < npfds; j++)
+                                event_ctl(ep, EPOLL_CTL_MOD, pfds[j].fd, alsa_on ? pfds[j].events : 0,
+                                          EV_TAG(EV_ALSA, j));
+                }
+        }
+out:
+        free(pfds);
+        close(tfd);
+        close(ep);
+        return err;
+}
+
+/*
+ *   Transfer method - multicast, or unicast to the receivers that
+ *   subscribed to each stream; both send every period to the stream's
+ *   destinations and differ only in how those are found
+ */
+static int net_loop(struct worker *w)
+{
+        int err;
+        if ((err = check_destinations(w)) < 0)
+                return err;
+        if (period_event)
+                return event_loop(w);
+        if (ring_slots)
+                return produce_loop(w);
+        while (!stop)
+                net_step(worker_next(w));
+        return 0;
+}
+
+/*
+ *   Transfer method - write only
+ */
+static int write_loop(struct worker *w)
+{
+        struct stream *s;
+        struct period *p;
+        if (period_event)
+                return event_loop(w);
+        if (ring_slots)
+                return produce_loop(w);
+        while (!stop) {
+                s = worker_next(w);
+                p = &s->periods[0];
+                produce_period(s, p);
+                if (sink->clocked)
+                        pace(s, s->frame);
+                s->frame += period_size;
+                local_write(s, p);
+        }
+        return 0;
+}
+
+/*
+ *   Transfer method - direct write to the mmap'ed device buffer, the
+ *   sine is generated straight into the areas snd_pcm_mmap_begin() hands
+ *   out
+ */
+static int direct_loop(struct worker *w)
+{
+        struct stream *s = w->streams[0];
+        snd_pcm_t *handle = sink->handle;
+        const snd_pcm_channel_area_t *my_areas;
+        snd_pcm_uframes_t offset, frames, size;
+        snd_pcm_sframes_t avail, commitres;
+        snd_pcm_state_t state;
+        long long start;
+        int err, first = 1;
+        while (!stop) {
+                state = snd_pcm_state(handle);
+                if (state == SND_PCM_STATE_XRUN) {
+                        err = xrun_recovery(handle, -EPIPE);
+                        if (err < 0) {
+                                printf("XRUN recovery failed: %s\n", snd_strerror(err));
+                                return err;
+                        }
+                        first = 1;
+                } else if (state == SND_PCM_STATE_SUSPENDED) {
+                        err = xrun_recovery(handle, -ESTRPIPE);
+                        if (err < 0) {
+                                printf("SUSPEND recovery failed: %s\n", snd_strerror(err));
+                                return err;
+                        }
+                }
+                avail = snd_pcm_avail_update(handle);
+                if (avail < 0) {
+                        err = xrun_recovery(handle, avail);
+                        if (err < 0) {
+                                printf("avail update failed: %s\n", snd_strerror(err));
+                                return err;
+                        }
+                        first = 1;
+                        continue;
+                }
+                if (avail < period_size) {
+                        if (first) {
+                                first = 0;
+                                err = snd_pcm_start(handle);
+                                if (err < 0) {
+                                        printf("Start error: %s\n", snd_strerror(err));
+                                        return err;
+                                }
+                        } else {
+                                /* bounded, so a stop request is noticed */
+                                err = snd_pcm_wait(handle, 100);
+                                if (err < 0) {
+                                        if ((err = xrun_recovery(handle, err)) < 0) {
+                                                printf("snd_pcm_wait error: %s\n", snd_strerror(err));
+                                                return err;
+                                        }
+                                        first = 1;
+                                }
+                        }
+                        continue;
+                }
+                take_tune(s);
+                size = period_size;
+                while (size > 0) {
+                        frames = size;
+                        err = snd_pcm_mmap_begin(handle, &my_areas, &offset, &frames);
+                        if (err < 0) {
+                                if ((err = xrun_recovery(handle, err)) < 0) {
+                                        printf("MMAP begin avail error: %s\n", snd_strerror(err));
+                                        return err;
+                                }
+                                first = 1;
+                                break;
+                        }
+                        start = monotonic_ns();
+                        generate_sine(&s->gen, my_areas, offset, frames);
+                        hist_record(&s->metrics.gen.generate, monotonic_ns() - start);
+                        metric_add(&s->metrics.gen.frames, frames);
+                        commitres = snd_pcm_mmap_commit(handle, offset, frames);
+                        if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
+                                if ((err = xrun_recovery(handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
+                                        printf("MMAP commit error: %s\n", snd_strerror(err));
+                                        return err;
+                                }
+                                first = 1;
+                        }
+                        metric_add(&s->metrics.write.frames, frames);
+                        s->frame += frames;
+                        size -= frames;
+                }
+        }
+        return 0;
+}
+
+/*
+ *
+ */
+struct transfer_method {
+        const char *name;
+        snd_pcm_access_t access;
+        int (*transfer_loop)(struct worker *w);
+        int network;                    /* sends datagrams */
+        int subscribe;                  /* to receivers that subscribed */
+};
+
+static struct transfer_method transfer_methods[] = {
+        { "multicast", SND_PCM_ACCESS_RW_INTERLEAVED, net_loop, 1, 0 },
+        { "unicast", SND_PCM_ACCESS_RW_INTERLEAVED, net_loop, 1, 1 },
+        { "write", SND_PCM_ACCESS_RW_INTERLEAVED, write_loop, 0, 0 },
+        { "rw_noninterleaved", SND_PCM_ACCESS_RW_NONINTERLEAVED, write_loop, 0, 0 },
+        { "mmap_interleaved", SND_PCM_ACCESS_MMAP_INTERLEAVED, direct_loop, 0, 0 },
+        { "mmap_noninterleaved", SND_PCM_ACCESS_MMAP_NONINTERLEAVED, direct_loop, 0, 0 },
+        { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL, 0, 0 }
+};
+/*
+ *   Stream specs from the command line and config file
+ */
+struct stream_spec {
+        const char *addr;
+        int port;
+        const char *freq;
+        const char *amps;
+        const char *phases;
+        uint32_t id;
+        int has_id;
+};
+
+static struct stream_spec specs[MAX_STREAMS];
+static unsigned int nspecs = 0;
+
+static struct stream_spec *add_spec(const char *addr)
+{
+        struct stream_spec *spec;
+        if (nspecs == MAX_STREAMS) {
+                printf("Too many streams (max %d)\n", MAX_STREAMS);
+                exit(EXIT_FAILURE);
+        }
+        spec = &specs[nspecs++];
+        spec->addr = addr;
+        spec->port = mc_port;
+        spec->freq = freq;
+        spec->amps = amplitude;
+        spec->phases = phase;
+        spec->has_id = 0;
+        return spec;
+}
+
+/*
+ *   One stream per line: address [port [frequency]], '#' starts a comment
+ */
+static int read_config(const char *path)
+{
+        struct stream_spec *spec;
+        char line[256], addr[64], f[128];
+        int fields, port, lineno = 0;
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+                perror("Error opening config file");
+                return -errno;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                lineno++;
+                line[strcspn(line, "#\n")] = '\0';
+                port = mc_port;
+                fields = sscanf(line, "%63s %d %127s", addr, &port, f);
+                if (fields <= 0)
+                        continue;
+                spec = add_spec(strdup(addr));
+                spec->port = port < MIN_PORT ? MIN_PORT : port > MAX_PORT ? MAX_PORT : port;
+                if (fields == 3)
+                        spec->freq = strdup(f);
+        }
+        fclose(fp);
+        return 0;
+}
+
+/*
+ *   The n-th CPU this process may run on, -1 if there are fewer
+ */
+static int nth_cpu(unsigned int n)
+{
+        cpu_set_t set;
+        int cpu;
+        if (sched_getaffinity(0, sizeof(set), &set) < 0)
+                return -1;
+        n %= CPU_COUNT(&set);
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set) && n-- == 0)
+                        return cpu;
+        return -1;
+}
+
+/*
+ *   CPU nearest the NIC behind interface 'name': the one its first
+ *   interrupt is routed to, else the first CPU local to the device.  -1
+ *   for a virtual interface or a CPU this process may not run on.
+ */
+static int iface_cpu(const char *name)
+{
+        char path[PATH_MAX];
+        unsigned int irq, first = UINT_MAX;
+        struct dirent *e;
+        cpu_set_t set;
+        int cpu = -1;
+        FILE *fp;
+        DIR *dir;
+        snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", name);
+        if ((dir = opendir(path)) != NULL) {
+                while ((e = readdir(dir)) != NULL)
+                        if (sscanf(e->d_name, "%u", &irq) == 1 && irq < first)
+                                first = irq;
+                closedir(dir);
+        }
+        if (first != UINT_MAX)
+                snprintf(path, sizeof(path), "/proc/irq/%u/smp_affinity_list", first);
+        else
+                snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", name);
+        if ((fp = fopen(path, "r")) != NULL) {
+                if (fscanf(fp, "%d", &cpu) != 1)
+                        cpu = -1;
+                fclose(fp);
+        }
+        if (cpu >= 0 && (sched_getaffinity(0, sizeof(set), &set) < 0 || !CPU_ISSET(cpu, &set)))
+                cpu = -1;
+        return cpu;
+}
+
+/*
+ *   -i eth0,eth1: every stream goes out on each of them
+ */
+static int parse_interfaces(char *list)
+{
+        char *name, *save;
+        for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+                if (nifaces == MAX_INTERFACES) {
+                        printf("Too many interfaces (max %d)\n", MAX_INTERFACES);
+                        return -EINVAL;
+                }
+                if ((ifaces[nifaces].index = if_nametoindex(name)) == 0) {
+                        printf("Unknown interface %s\n", name);
+                        return -ENODEV;
+                }
+                ifaces[nifaces].name = name;
+                ifaces[nifaces].cpu = iface_cpu(name);
+                nifaces++;
+        }
+        return 0;
+}
+
+static void *worker_main(void *arg)
+{
+        struct worker *w = arg;
+        w->err = transfer_methods[method].transfer_loop(w);
+        if (w->err < 0)
+                stop = 1;               /* take the output threads down too */
+        return NULL;
+}
+
+/*
+ *   Start a stream thread on 'cpu' (-1 for any), at rt_priority under
+ *   SCHED_FIFO in real-time mode.  Without the privilege for that the
+ *   thread and all later ones run at normal priority.
+ */
+static int spawn(pthread_t *thread, int cpu, void *(*fn)(void *), void *arg)
+{
+        struct sched_param param = { .sched_priority = rt_priority };
+        pthread_attr_t attr;
+        cpu_set_t set;
+        int err;
+        pthread_attr_init(&attr);
+        if (cpu >= 0) {
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (rt_priority) {
+                /* locked memory: keep the stacks small */
+                pthread_attr_setstacksize(&attr, RT_STACK);
+                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+                pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+                pthread_attr_setschedparam(&attr, &param);
+        }
+        err = pthread_create(thread, &attr, fn, arg);
+        if (err == EPERM && rt_priority) {
+                printf("No permission for SCHED_FIFO (needs CAP_SYS_NICE or an RLIMIT_RTPRIO), "
+                       "running at normal priority\n");
+                rt_priority = 0;
+                pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+                err = pthread_create(thread, &attr, fn, arg);
+        }
+        pthread_attr_destroy(&attr);
+        return -err;
+}
+
+/*
+ *   Touch every page of buf so none faults in once streaming
+ */
+static void prefault(void *buf, size_t len)
+{
+        volatile unsigned char *b = buf;
+        size_t i, page = sysconf(_SC_PAGESIZE);
+        for (i = 0; buf != NULL && i < len; i += page)
+                b[i] = b[i];
+}
+
+/*
+ *   mlockall() leaving out the FILE mappings: every other mapping there
+ *   is gets locked and faulted in on its own, later ones as they are made
+ */
+static int lock_all_but_files(void)
+{
+        unsigned long lo, hi;
+        char line[512], perms[5];
+        unsigned int i;
+        int err = 0, file;
+        FILE *fp = fopen("/proc/self/maps", "r");
+        if (fp == NULL)
+                return -errno;
+        if (mlockall(MCL_FUTURE) < 0)
+                err = -errno;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (sscanf(line, "%lx-%lx %4s", &lo, &hi, perms) != 3 || !strcmp(perms, "---p") ||
+                    strstr(line, "[vsyscall]") != NULL)
+                        continue;       /* guard pages and the like hold nothing */
+                for (i = 0, file = 0; i < nfiles; i++)
+                        file |= lo < (unsigned long)files[i].map + files[i].map_len &&
+                                hi > (unsigned long)files[i].map;
+                if (!file && mlock((void *)lo, hi - lo) < 0 && err == 0)
+                        err = -errno;
+        }
+        fclose(fp);
+        return err;
+}
+
+/*
+ *   Real-time mode, before the stream threads start: lock all memory,
+ *   present and future, and fault in every buffer a period goes through.
+ *   FILE mappings are never locked, they could be larger than memory;
+ *   the read ahead keeps their pages in.
+ */
+static void lock_memory(void)
+{
+        struct stream *s;
+        struct period *p;
+        unsigned int i, j, nparity;
+        int err = 0;
+        if (nfiles)
+                err = lock_all_but_files();
+        else if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+                err = -errno;
+        if (err < 0)
+                printf("Locking memory failed: %s, raise the memlock limit (ulimit -l)\n", strerror(-err));
+        for (i = 0; i < nstreams; i++) {
+                s = &streams[i];
+                nparity = s->max_msgs - s->max_packets;
+                for (j = 0; j < s->nperiods; j++) {
+                        p = &s->periods[j];
+                        prefault(p->samples, s->period_bytes);
+                        prefault(p->msgs, s->max_msgs * sizeof(*p->msgs));
+                        prefault(p->iovecs, s->max_msgs * 2 * sizeof(*p->iovecs));
+                        prefault(p->hdrs, s->max_packets * sizeof(*p->hdrs));
+                        prefault(p->parity_hdrs, nparity * sizeof(*p->parity_hdrs));
+                        prefault(p->parity, nparity * (sizeof(struct sine_fec_meta) + PACKETSIZE));
+                        prefault(p->coded, p->coded ? (size_t)s->max_packets * PACKETSIZE : 0);
+                }
+                if (s->file == NULL)
+                        prefault(s->gen.cache, s->gen.cache_frames * channels * s->gen.phys_bytes);
+                prefault(s->gen.coded, s->gen.coded ? coded_room(s, &s->gen) : 0);
+        }
+}
+
+struct probe {
+        int cpu;
+        pthread_t thread;
+        struct pacer pacer;
+};
+
+static void *probe_main(void *arg)
+{
+        struct probe *pr = arg;
+        uint64_t tick;
+        pacer_init(&pr->pacer, 1000, 0, 0);
+        for (tick = 1; tick <= rt_test_ms && !quit; tick++)
+                pacer_wait(&pr->pacer, tick);
+        return NULL;
+}
+
+/*
+ *   Wakeup latency self-test: on every CPU the process may use, a thread
+ *   started like the stream threads sleeps to absolute deadlines 1ms
+ *   apart for rt_test_ms and records how late each wakeup came
+ */
+static void latency_test(void)
+{
+        struct probe *probes;
+        struct pacer total;
+        cpu_set_t set;
+        unsigned int n = 0, i;
+        int cpu;
+        if (sched_getaffinity(0, sizeof(set), &set) < 0 ||
+            (probes = calloc(CPU_COUNT(&set), sizeof(*probes))) == NULL)
+                return;
+        printf("Measuring wakeup latency on %d CPUs for %ums\n", CPU_COUNT(&set), rt_test_ms);
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &set))
+                        continue;
+                probes[n].cpu = cpu;
+                if (spawn(&probes[n].thread, cpu, probe_main, &probes[n]) == 0)
+                        n++;
+        }
+        pacer_init(&total, 1000, 0, 0);
+        for (i = 0; i < n; i++) {
+                pthread_join(probes[i].thread, NULL);
+                pacer_merge(&total, &probes[i].pacer);
+        }
+        pacer_report(&total, "Wakeup latency", stdout);
+        for (i = 0; i < n; i++)
+                printf("  CPU %d: worst %.1fus\n", probes[i].cpu, probes[i].pacer.late_max_ns / 1e3);
+        free(probes);
+}
+
+/*
+ *   CPU for the sender of interface k of worker w: the one taking the
+ *   NIC's interrupts, else with -j one of its own past the workers and
+ *   writers
+ */
+static int sender_cpu(unsigned int w, unsigned int k)
+{
+        if (nifaces && ifaces[k].cpu >= 0)
+                return ifaces[k].cpu;
+        if (!pin_workers)
+                return -1;
+        return nth_cpu((k ? k + 2 : 1) * nworkers + w);
+}
+
+static void *touch_main(void *arg)
+{
+        arena_touch(arg);
+        return NULL;
+}
+
+/*
+ *   An arena per worker, as large as its streams need.  Its pages are
+ *   faulted in from the CPU of the thread that sends from them, the
+ *   sender with a ring and the worker without, so they land on that
+ *   CPU's NUMA node.
+ */
+static int arenas_init(void)
+{
+        size_t *sizes;
+        pthread_t toucher;
+        unsigned int i;
+        int err = 0, cpu;
+        nworkers = nworkers > nstreams ? nstreams : nworkers;
+        arenas = calloc(nworkers, sizeof(*arenas));
+        sizes = calloc(nworkers, sizeof(*sizes));
+        if (arenas == NULL || sizes == NULL) {
+                free(sizes);
+                return -ENOMEM;
+        }
+        for (i = 0; i < nstreams; i++)
+                sizes[i % nworkers] += stream_footprint(&streams[i]);
+        for (i = 0; i < nworkers && err == 0; i++) {
+                if ((err = arena_init(&arenas[i], sizes[i], hugepages)) < 0)
+                        break;
+                cpu = ring_slots && transfer_methods[method].network ? sender_cpu(i, 0) :
+                      pin_workers ? nth_cpu(i) : -1;
+                if (cpu >= 0 && spawn(&toucher, cpu, touch_main, &arenas[i]) == 0)
+                        pthread_join(toucher, NULL);
+                if (verbose)
+                        printf("Arena %u: %.1f MiB%s, placed from CPU %d\n", i, arenas[i].size / 1048576.,
+                               arenas[i].huge ? " on 2 MiB pages" : arenas[i].thp ? ", transparent hugepages" : "",
+                               cpu);
+        }
+        free(sizes);
+        return err;
+}
+
+/*
+ *   With a ring, every worker generates and a sender thread per worker
+ *   and interface drains its rings onto the network, each from the same
+ *   slots.  Stream 0 is played by a writer thread reading them too;
+ *   without a network method there is a writer per worker and no sender.
+ */
+static int start_outputs(struct worker *w)
+{
+        int network = transfer_methods[method].network;
+        unsigned int nsenders = network ? (nifaces > 1 ? nifaces : 1) : 0;
+        struct worker *mw;
+        struct stream *m;
+        unsigned int i, k;
+        int err;
+        w->has_sender = network;
+        w->has_writer = !network || w->streams[0]->index == 0;
+        for (i = 0; i < w->nstreams; i++)
+                ring_init(&w->streams[i]->ring, ring_slots,
+                          nsenders + (!network || w->streams[i]->index == 0));
+        if (network && (err = check_destinations(w)) < 0)
+                return err;
+        if (w->has_sender &&
+            (err = spawn(&w->sender, sender_cpu(w->index, 0), send_main, w)) < 0)
+                return err;
+        if (w->has_writer &&
+            (err = spawn(&w->writer, pin_workers ? nth_cpu(2 * nworkers + w->index) : -1, write_main, w)) < 0)
+                return err;
+        if (nsenders > 1 && (w->mirrors = calloc(nsenders - 1, sizeof(*w->mirrors))) == NULL)
+                return -ENOMEM;
+        for (k = 1; k < nsenders; k++) {
+                mw = &w->mirrors[k - 1];
+                mw->index = w->index;
+                mw->cpu = sender_cpu(w->index, k);
+                if ((mw->streams = calloc(w->nstreams, sizeof(*mw->streams))) == NULL)
+                        return -ENOMEM;
+                for (i = 0; i < w->nstreams; i++) {
+                        m = &mirrors[(k - 1) * nstreams + w->streams[i]->index];
+                        mirror_sync(m);
+                        pacer_init(&m->pacer, rate, spin_time * 1000, buffer_time * 1000L);
+                        mw->streams[mw->nstreams++] = m;
+                }
+                if ((err = spawn(&mw->thread, mw->cpu, send_main, mw)) < 0)
+                        return err;
+                w->nmirrors++;
+        }
+        return 0;
+}
+
+/*
+ *   Spread the streams round robin over the workers and start them
+ */
+static int start_workers(void)
+{
+        unsigned int i;
+        int err;
+        nworkers = nworkers > nstreams ? nstreams : nworkers;
+        workers = calloc(nworkers, sizeof(*workers));
+        if (workers == NULL)
+                return -ENOMEM;
+        for (i = 0; i < nworkers; i++) {
+                workers[i].index = i;
+                workers[i].cpu = pin_workers ? nth_cpu(i) : -1;
+                workers[i].streams = calloc(nstreams / nworkers + 1, sizeof(struct stream *));
+                if (workers[i].streams == NULL)
+                        return -ENOMEM;
+        }
+        for (i = 0; i < nstreams; i++) {
+                struct worker *w = &workers[i % nworkers];
+                w->streams[w->nstreams++] = &streams[i];
+                pacer_init(&streams[i].pacer, rate, spin_time * 1000, buffer_time * 1000L);
+        }
+        for (i = 0; i < nworkers; i++) {
+                if (ring_slots && (err = start_outputs(&workers[i])) < 0)
+                        return err;
+                if ((err = spawn(&workers[i].thread, workers[i].cpu, worker_main, &workers[i])) < 0)
+                        return err;
+                if (verbose)
+                        printf("Worker %u: %u streams, CPU %d\n", i, workers[i].nstreams, workers[i].cpu);
+        }
+        return 0;
+}
+
+/*
+ *   Process CPU time against the audio it produced, to compare methods
+ */
+static void cpu_report(void)
+{
+        struct rusage ru;
+        double cpu, audio = audio_done;
+        if (audio <= 0 || getrusage(RUSAGE_SELF, &ru) < 0)
+                return;
+        cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+              ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        printf("CPU %.3fs for %.1fs of audio: %.3fms per second of audio (%s)\n",
+               cpu, audio, cpu * 1e3 / audio, transfer_methods[method].name);
+}
+
+/*
+ *   Wait for the workers to finish and fold the pacer and ring statistics
+ *   of their streams into the totals
+ */
+static void join_workers(void)
+{
+        unsigned int i, k;
+        for (i = 0; workers != NULL && i < nworkers; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (workers[i].has_sender)
+                        pthread_join(workers[i].sender, NULL);
+                if (workers[i].has_writer)
+                        pthread_join(workers[i].writer, NULL);
+                for (k = 0; k < workers[i].nmirrors; k++) {
+                        pthread_join(workers[i].mirrors[k].thread, NULL);
+                        free(workers[i].mirrors[k].streams);
+                }
+                free(workers[i].mirrors);
+                if (workers[i].err < 0) {
+                        printf("Transfer failed: %s\n", snd_strerror(workers[i].err));
+                        quit = 1;
+                }
+                free(workers[i].streams);
+        }
+        free(workers);
+        workers = NULL;
+        for (i = 0; i < nstreams; i++) {
+                pacer_merge(&lateness, &streams[i].pacer);
+                ring_merge(&fill, &streams[i].ring);
+                audio_done += (double)streams[i].frame / rate;
+        }
+        for (i = 0; i < nmirrors; i++)
+                pacer_merge(&lateness, &mirrors[i].pacer);
+}
+
+/*
+ *   Open the local output at the current format and rate, or just size
+ *   the periods when there is no device to negotiate with
+ */
+static int open_output(void)
+{
+        int err;
+        if (sink->open != NULL &&
+            (err = sink->open(sink, sink_arg, transfer_methods[method].access)) < 0) {
+                printf("Opening %s output failed: %s\n", sink->name, snd_strerror(err));
+                return err;
+        }
+        if (sink->handle == NULL) {
+                /* no device to negotiate with, take the sizes as requested */
+                period_size = (snd_pcm_sframes_t)rate * period_time / 1000000;
+                buffer_size = (snd_pcm_sframes_t)rate * buffer_time / 1000000;
+                period_size = period_size < 1 ? 1 : period_size;
+        }
+        return 0;
+}
+
+static int reopen_streams(void)
+{
+        unsigned int i;
+        int err;
+        if (sink->handle != NULL) {
+                sink->close(sink);
+                sink->handle = NULL;
+        }
+        if ((err = open_output()) < 0)
+                return err;
+        if (compress)
+                codec_layout(format, &layout);
+        for (i = 0; i < nstreams; i++)
+                if ((err = stream_reset(&streams[i], transfer_methods[method].access)) < 0)
+                        return err;
+        return 0;
+}
+
+/*
+ *   Switch every stream to another format and rate: stop the workers,
+ *   open the output again and lay the streams out anew in the buffers
+ *   they have, then start over.  A change the device or the buffers
+ *   cannot take is undone.
+ */
+static int reconfigure(snd_pcm_format_t new_format, unsigned int new_rate)
+{
+        snd_pcm_format_t old_format = format;
+        unsigned int old_rate = rate, i;
+        uint64_t one = 1;
+        int err;
+        stop = 1;
+        if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+                ;       /* already signalled */
+        join_workers();
+        if (quit)
+                return -ECANCELED;
+        for (i = 0; i < nstreams; i++)
+                zc_drain(&streams[i]);
+        format = new_format;
+        rate = new_rate;
+        if ((err = reopen_streams()) < 0) {
+                printf("Switching to %uHz, %s failed: %s\n", rate, snd_pcm_format_name(format),
+                       snd_strerror(err));
+                format = old_format;
+                rate = old_rate;
+                if (reopen_streams() < 0) {
+                        printf("Cannot go back to %uHz, %s\n", rate, snd_pcm_format_name(format));
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (wake_fd >= 0 && read(wake_fd, &one, sizeof(one)) < 0)
+                ;       /* not signalled */
+        stop = quit;
+        if (start_workers() < 0) {
+                printf("Restarting workers failed\n");
+                exit(EXIT_FAILURE);
+        }
+        printf("Stream parameters are %iHz, %s, %i channels\n", rate, snd_pcm_format_name(format), channels);
+        return err;
+}
+
+/*
+ *   Format and rate changes are carried out by the main thread, the
+ *   control thread waits for them here
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        snd_pcm_format_t format;
+        unsigned int rate;
+        int pending;
+        int closed;                     /* main is on its way out */
+        int result;
+} reconf = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int request_reconfigure(snd_pcm_format_t new_format, unsigned int new_rate)
+{
+        int err;
+        pthread_mutex_lock(&reconf.lock);
+        reconf.format = new_format;
+        reconf.rate = new_rate;
+        reconf.pending = !reconf.closed;
+        pthread_cond_broadcast(&reconf.cond);
+        while (reconf.pending && !reconf.closed)
+                pthread_cond_wait(&reconf.cond, &reconf.lock);
+        err = reconf.pending || reconf.closed ? -ECANCELED : reconf.result;
+        pthread_mutex_unlock(&reconf.lock);
+        return err;
+}
+
+/*
+ *   Main thread with a control socket: carry out format and rate changes
+ *   until told to stop
+ */
+static void serve_reconfigure(void)
+{
+        struct timespec ts;
+        int err;
+        pthread_mutex_lock(&reconf.lock);
+        while (!stop) {
+                if (reconf.pending) {
+                        pthread_mutex_unlock(&reconf.lock);
+                        err = reconfigure(reconf.format, reconf.rate);
+                        pthread_mutex_lock(&reconf.lock);
+                        reconf.result = err;
+                        reconf.pending = 0;
+                        pthread_cond_broadcast(&reconf.cond);
+                        continue;
+                }
+                /* a signal does not wake us, look at stop now and then */
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 100000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&reconf.cond, &reconf.lock, &ts);
+        }
+        reconf.closed = 1;
+        pthread_cond_broadcast(&reconf.cond);
+        pthread_mutex_unlock(&reconf.lock);
+}
+
+/*
+ *   Loopback self-test: receivers of every stream in this process, one
+ *   socket each, count what arrives while the streams step up in rate
+ */
+struct rx_path {
+        uint32_t first_seq, last_seq;
+        long long last_transit;         /* arrival minus sample clock, in ns */
+        uint64_t received;
+        int seen;
+};
+
+struct receiver {
+        int sock;
+        pthread_t thread;
+        volatile int quit;
+        long long from, until;          /* CLOCK_MONOTONIC window that counts */
+        unsigned char *bufs;            /* SELFTEST_BATCH datagrams */
+        struct rx_path *paths;          /* one per stream */
+        struct pacer jitter;            /* |D| of RFC 3550 between datagrams in sequence */
+};
+
+static int receiver_open(struct receiver *r)
+{
+        int subscribe = transfer_methods[method].subscribe, on = 1, rcvbuf = 4 << 20;
+        struct timeval tv = { 0, 100000 };
+        struct sockaddr_in addr;
+        struct ip_mreqn mreq;
+        r->paths = calloc(nstreams, sizeof(*r->paths));
+        r->bufs = malloc(SELFTEST_BATCH * (SINE_HDR_SIZE + PACKETSIZE));
+        if (r->paths == NULL || r->bufs == NULL)
+                return -ENOMEM;
+        if ((r->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+                return -errno;
+        setsockopt(r->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(r->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(r->sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+        setsockopt(r->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = subscribe ? 0 : htons(mc_port);
+        if (bind(r->sock, (SA *)&addr, sizeof(addr)) < 0)
+                return -errno;
+        if (subscribe)
+                return 0;
+        memset(&mreq, 0, sizeof(mreq));
+        inet_pton(AF_INET, SELFTEST_GROUP, &mreq.imr_multiaddr);
+        mreq.imr_ifindex = ifaces[0].index;
+        if (setsockopt(r->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+                return -errno;
+        return 0;
+}
+
+static void receiver_close(struct receiver *r)
+{
+        if (r->sock >= 0)
+                close(r->sock);
+        free(r->paths);
+        free(r->bufs);
+}
+
+/*
+ *   Subscribe to every unicast stream, again every SINE_KEEPALIVE_MS
+ */
+static void receiver_subscribe(struct receiver *r)
+{
+        struct sine_ctrl ctrl = { SINE_VERSION, SINE_CTRL_SUBSCRIBE, 0, 0 };
+        struct sockaddr_in to;
+        unsigned int i;
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (i = 0; i < nstreams; i++) {
+                to.sin_port = htons(streams[i].port);
+                sendto(r->sock, &ctrl, sizeof(ctrl), 0, (SA *)&to, sizeof(to));
+        }
+}
+
+static void receiver_count(struct receiver *r, const struct sine_hdr *hdr,
+                           const struct timespec *arrival)
+{
+        uint32_t i = ntohl(hdr->stream_id) - stream_id, seq = ntohl(hdr->seq), hz = ntohl(hdr->rate);
+        struct rx_path *p;
+        long long transit;
+        if (i >= nstreams || hz != rate || (hdr->flags & SINE_FLAG_PARITY))
+                return;         /* not ours, sent before the last step, or parity */
+        p = &r->paths[i];
+        transit = arrival->tv_sec * 1000000000LL + arrival->tv_nsec -
+                  (long long)((uint64_t)ntohl(hdr->timestamp) * 1000000000ULL / hz);
+        if (!p->seen) {
+                p->first_seq = p->last_seq = seq;
+                p->seen = 1;
+        } else {
+                if (seq == p->last_seq + 1)
+                        pacer_record(&r->jitter, llabs(transit - p->last_transit));
+                if ((int32_t)(seq - p->last_seq) > 0)
+                        p->last_seq = seq;
+        }
+        p->last_transit = transit;
+        p->received++;
+}
+
+static void *receiver_main(void *arg)
+{
+        struct receiver *r = arg;
+        struct mmsghdr msgs[SELFTEST_BATCH];
+        struct iovec iovecs[SELFTEST_BATCH];
+        char cbufs[SELFTEST_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+        long long now, keepalive = 0;
+        struct timespec arrival, wall;
+        struct cmsghdr *cmsg;
+        int n, i;
+        while (!r->quit) {
+                now = monotonic_ns();
+                if (transfer_methods[method].subscribe && now >= keepalive) {
+                        receiver_subscribe(r);
+                        keepalive = now + SINE_KEEPALIVE_MS * 1000000LL;
+                }
+                memset(msgs, 0, sizeof(msgs));
+                for (i = 0; i < SELFTEST_BATCH; i++) {
+                        iovecs[i].iov_base = r->bufs + i * (SINE_HDR_SIZE + PACKETSIZE);
+                        iovecs[i].iov_len = SINE_HDR_SIZE + PACKETSIZE;
+                        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                        msgs[i].msg_hdr.msg_control = cbufs[i];
+                        msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+                }
+                n = recvmmsg(r->sock, msgs, SELFTEST_BATCH, MSG_WAITFORONE, NULL);
+                now = monotonic_ns();
+                if (now < r->from || now >= r->until)
+                        continue;       /* settling, or done: drained only */
+                clock_gettime(CLOCK_REALTIME, &wall);
+                for (i = 0; i < n; i++) {
+                        if (msgs[i].msg_len < SINE_HDR_SIZE)
+                                continue;
+                        arrival = wall;
+                        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+                             cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+                                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                                        memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+                        receiver_count(r, iovecs[i].iov_base, &arrival);
+                }
+        }
+        return NULL;
+}
+
+static long long thread_cpu_ns(pthread_t thread)
+{
+        struct timespec ts;
+        clockid_t clock;
+        if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &ts) < 0)
+                return 0;
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *   CPU time of the streams so far: the process less the receivers
+ */
+static long long stream_cpu_ns(struct receiver *rx)
+{
+        struct timespec ts;
+        long long ns;
+        unsigned int i;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        for (i = 0; i < selftest_receivers; i++)
+                ns -= thread_cpu_ns(rx[i].thread);
+        return ns;
+}
+
+static uint64_t send_drops(void)
+{
+        uint64_t n = 0;
+        unsigned int i;
+        for (i = 0; i < nstreams; i++)
+                n += atomic_load_explicit(&streams[i].metrics.send.dropped, memory_order_relaxed);
+        return n;
+}
+
+/*
+ *   Sleep until 'deadline' on CLOCK_MONOTONIC, 0 if interrupted by a stop
+ */
+static int sleep_until(long long deadline)
+{
+        long long left;
+        while (!stop && (left = deadline - monotonic_ns()) > 0)
+                usleep(left > 100000000LL ? 100000 : left / 1000);
+        return !stop;
+}
+
+/*
+ *   Count one step of the ramp at the current rate and print its line.
+ *   Returns whether it was sustained: nothing lost, and the streams kept
+ *   to their clock within a period.  The datagrams per second sent to all
+ *   receivers and received go to 'offered' and 'delivered'.
+ */
+static int selftest_step(struct receiver *rx, double *offered, double *delivered)
+{
+        uint64_t expected = 0, received = 0, lost, drops, due = 0, slack = 0;
+        long long from, cpu;
+        unsigned int i, j, silent = 0;
+        struct pacer jitter;
+        int behind;
+        for (i = 0; i < nstreams; i++) {
+                due += (uint64_t)streams[i].npackets * rate * selftest_secs / period_size;
+                slack += streams[i].npackets;
+        }
+        due *= selftest_receivers;
+        slack *= selftest_receivers;
+        from = monotonic_ns() + SELFTEST_SETTLE_MS * 1000000LL;
+        for (i = 0; i < selftest_receivers; i++) {
+                memset(rx[i].paths, 0, nstreams * sizeof(*rx[i].paths));
+                pacer_init(&rx[i].jitter, rate, 0, 0);
+                rx[i].from = from;
+                rx[i].until = from + selftest_secs * 1000000000LL;
+                rx[i].quit = 0;
+                if (pthread_create(&rx[i].thread, NULL, receiver_main, &rx[i]) != 0) {
+                        printf("Starting receiver %u failed\n", i);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        sleep_until(from);
+        cpu = stream_cpu_ns(rx);
+        drops = send_drops();
+        sleep_until(from + selftest_secs * 1000000000LL);
+        cpu = stream_cpu_ns(rx) - cpu;
+        drops = send_drops() - drops;
+        pacer_init(&jitter, rate, 0, 0);
+        for (i = 0; i < selftest_receivers; i++) {
+                rx[i].quit = 1;
+                pthread_join(rx[i].thread, NULL);
+                pacer_merge(&jitter, &rx[i].jitter);
+                for (j = 0; j < nstreams; j++) {
+                        if (!rx[i].paths[j].seen) {
+                                silent++;
+                                continue;
+                        }
+                        expected += rx[i].paths[j].last_seq - rx[i].paths[j].first_seq + 1;
+                        received += rx[i].paths[j].received;
+                }
+        }
+        lost = expected > received ? expected - received : 0;
+        behind = expected + slack < due;
+        *offered = (double)expected / selftest_secs;
+        *delivered = (double)received / selftest_secs;
+        printf("%7u %11.0f %11.0f %11.0f %9.4f%% %7llu %7llu %7llu %9.2f%%", rate,
+               (double)due / selftest_secs, *offered, *delivered,
+               expected ? 100. * lost / expected : 0.,
+               (unsigned long long)pacer_quantile_us(&jitter, 0.5),
+               (unsigned long long)pacer_quantile_us(&jitter, 0.99),
+               (unsigned long long)pacer_quantile_us(&jitter, 0.999),
+               100. * cpu / (selftest_secs * 1e9) / nstreams);
+        if (drops)
+                printf(", %llu not sent", (unsigned long long)drops);
+        if (silent)
+                printf(", %u of %u paths silent", silent, nstreams * selftest_receivers);
+        if (behind)
+                printf(", behind schedule");
+        printf("\n");
+        return lost == 0 && drops == 0 && silent == 0 && !behind;
+}
+
+/*
+ *   -W: step the streams up from 8kHz, doubling, to the -r rate and
+ *   measure each step end to end through the transfer method in use
+ */
+static void selftest(void)
+{
+        struct receiver *rx;
+        unsigned int i, next, best_rate = 0, onset = 0;
+        double offered, delivered, best = 0, onset_offered = 0;
+        uint64_t one = 1;
+        int err;
+        if ((rx = calloc(selftest_receivers, sizeof(*rx))) == NULL)
                 exit(EXIT_FAILURE);
+        for (i = 0; i < selftest_receivers; i++)
+                rx[i].sock = -1;
+        for (i = 0; i < selftest_receivers; i++) {
+                if ((err = receiver_open(&rx[i])) < 0) {
+                        printf("Receiver %u setup failed: %s\n", i, strerror(-err));
+                        exit(EXIT_FAILURE);
+                }
+        }
+        printf("Self-test: %u streams to %u receivers over loopback %s, %us a step\n",
+               nstreams, selftest_receivers, transfer_methods[method].name, selftest_secs);
+        printf("   rate       due/s   offered/s delivered/s      lost  jitter p50     p99   p99.9 CPU/stream\n");
+        while (!stop) {
+                if (!selftest_step(rx, &offered, &delivered) && onset == 0) {
+                        onset = rate;
+                        onset_offered = offered;
+                } else if (onset == 0 && delivered > best) {
+                        best = delivered;
+                        best_rate = rate;
+                }
+                if (stop || rate >= selftest_top)
+                        break;
+                next = rate * 2 > selftest_top ? selftest_top : rate * 2;
+                if ((err = reconfigure(format, next)) < 0) {
+                        printf("Self-test stopped at %uHz: %s\n", rate, snd_strerror(err));
+                        break;
+                }
+        }
+        if (best_rate)
+                printf("Max sustained %.0f datagrams/s delivered at %uHz (%.1f per stream and receiver)\n",
+                       best, best_rate, best / nstreams / selftest_receivers);
+        if (onset)
+                printf("Loss or falling behind from %uHz on, at %.0f datagrams/s offered\n",
+                       onset, onset_offered);
+        else
+                printf("No loss up to %uHz\n", rate);
+        for (i = 0; i < selftest_receivers; i++)
+                receiver_close(&rx[i]);
+        free(rx);
+        stop = 1;
+        quit = 1;
+        if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+                ;       /* already signalled */
+}
+
+/*
+ *   Hand cmd to the thread owning the state through a stream mailbox and
+ *   wait for it to be carried out.  One nobody takes in time is taken
+ *   back, e.g. while the workers are stopped.
+ */
+static int post(_Atomic(struct control_cmd *) *box, struct control_cmd *cmd)
+{
+        struct timespec ts = { 0, 1000000 };
+        struct control_cmd *none = NULL;
+        long long give_up = monotonic_ns() + CONTROL_WAIT_MS * 1000000LL;
+        if (!atomic_compare_exchange_strong(box, &none, cmd))
+                return -EBUSY;
+        while (!atomic_load_explicit(&cmd->done, memory_order_acquire)) {
+                none = cmd;
+                if (monotonic_ns() > give_up && atomic_compare_exchange_strong(box, &none, NULL))
+                        return -ETIMEDOUT;
+                nanosleep(&ts, NULL);
+        }
+        return cmd->result;
+}
+
+/*
+ *   New voices for a stream, and their replay cache, built here so the
+ *   generator only swaps them in.  The strings stay with the stream for a
+ *   later format change.
+ */
+static int control_tune(struct stream *s, const char *freqs, const char *amps)
+{
+        struct control_cmd cmd;
+        struct voices v = s->voices;
+        size_t flen = strlen(freqs) + 1;
+        char *strings;
+        int err;
+        if (s->file != NULL)
+                return -EOPNOTSUPP;
+        if ((strings = malloc(flen + (amps ? strlen(amps) + 1 : 0))) == NULL)
+                return -ENOMEM;
+        v.freqs = memcpy(strings, freqs, flen);
+        if (amps != NULL)
+                v.amps = strcpy(strings + flen, amps);
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.type = CMD_TUNE;
+        generator_init(&cmd.gen, engine, format, channels, rate, strtod(v.freqs, NULL));
+        err = generator_voices(&cmd.gen, &v);
+        if (err >= 0 && cache_mb) {
+                err = generator_cache(&cmd.gen, period_size, (size_t)cache_mb << 20);
+                if (err == -ERANGE || err == -E2BIG)
+                        err = 0;        /* synthesised live, as at start-up */
+                cmd.replay = cmd.gen.cache != NULL &&
+                             transfer_methods[method].access != SND_PCM_ACCESS_RW_NONINTERLEAVED;
+                if (cmd.replay)
+                        err = alloc_coded(s, &cmd.gen);
+        }
+        if (err < 0 || (err = post(&s->gen_cmd, &cmd)) < 0) {
+                generator_free(&cmd.gen);
+                free(strings);
+                return err;
+        }
+        /* the generator handed back what it played before */
+        generator_free(&cmd.gen);
+        free(s->voice_strings);
+        s->voice_strings = strings;
+        s->voices.freqs = v.freqs;
+        s->voices.amps = v.amps;
+        return 0;
+}
+
+static int control_destination(struct stream *s, int type, char *where)
+{
+        struct control_cmd cmd;
+        char *colon = strrchr(where, ':');
+        int port;
+        if (s->subs == NULL)
+                return -EOPNOTSUPP;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.type = type;
+        if (colon == NULL)
+                return -EINVAL;
+        *colon = '\0';
+        port = atoi(colon + 1);
+        /* [2001:db8::1]:2305 */
+        if (where[0] == '[' && colon[-1] == ']') {
+                colon[-1] = '\0';
+                where++;
+        }
+        if (port < 1 || port > MAX_PORT || parse_address(where, port, s->addr.sa.sa_family, &cmd.addr) < 0)
+                return -EINVAL;
+        return post(&s->send_cmd, &cmd);
+}
+
+static int control_format(const char *name)
+{
+        struct codec_layout l;
+        snd_pcm_format_t f;
+        const char *n;
+        for (f = 0; f < SND_PCM_FORMAT_LAST; f++)
+                if ((n = snd_pcm_format_name(f)) != NULL && !strcasecmp(n, name))
+                        break;
+        if (f == SND_PCM_FORMAT_LAST ||
+            (!snd_pcm_format_linear(f) && f != SND_PCM_FORMAT_FLOAT_LE && f != SND_PCM_FORMAT_FLOAT_BE) ||
+            (compress && codec_layout(f, &l) < 0))
+                return -EINVAL;
+        return request_reconfigure(f, rate);
+}
+
+static void control_streams(FILE *reply)
+{
+        struct stream *s;
+        unsigned int i;
+        fprintf(reply, "%uHz, %s, %u channels\n", rate, snd_pcm_format_name(format), channels);
+        for (i = 0; i < nstreams; i++) {
+                s = &streams[i];
+                if (s->file != NULL)
+                        fprintf(reply, "%u: %s:%d, ID 0x%08x, file %s", i, s->addr_str ? s->addr_str : "-",
+                                s->port, s->id, s->file->path);
+                else
+                        fprintf(reply, "%u: %s:%d, ID 0x%08x, %s %sHz", i, s->addr_str ? s->addr_str : "-",
+                                s->port, s->id, waveform_name(s->voices.wave), s->voices.freqs);
+                if (s->file == NULL && s->voices.amps != NULL)
+                        fprintf(reply, " at %s", s->voices.amps);
+                if (s->subs != NULL)
+                        fprintf(reply, ", %u destinations", s->nsubs);
+                fprintf(reply, "\n");
         }
+}
 
-        for (chn = 0; chn < channels; chn++) {
-                areas[chn].addr = samples;
-                areas[chn].first = chn * snd_pcm_format_physical_width(format);
-                areas[chn].step = channels * snd_pcm_format_physical_width(format);
+/*
+ *   One line from the control socket
+ */
+static void control_command(char *line, FILE *reply)
+{
+        char *arg[4], *save = NULL, *tok;
+        struct stream *s = NULL;
+        unsigned int n = 0, i;
+        int err;
+        for (tok = strtok_r(line, " \t", &save); tok != NULL && n < NELEMS(arg);
+             tok = strtok_r(NULL, " \t", &save))
+                arg[n++] = tok;
+        if (n == 0)
+                return;
+        if (!strcmp(arg[0], "tune") || !strcmp(arg[0], "add") || !strcmp(arg[0], "del")) {
+                if (n < 3 || (i = strtoul(arg[1], NULL, 10)) >= nstreams) {
+                        fprintf(reply, "error: %s S ..., S is a stream from 0 to %u\n", arg[0], nstreams - 1);
+                        return;
+                }
+                s = &streams[i];
+        } else if ((!strcmp(arg[0], "format") || !strcmp(arg[0], "rate")) && n < 2) {
+                fprintf(reply, "error: %s needs a value\n", arg[0]);
+                return;
+        }
+        if (!strcmp(arg[0], "help")) {
+                fprintf(reply, "streams | tune S FREQS [AMPS] | add S ADDR:PORT | del S ADDR:PORT | "
+                        "format FMT | rate HZ\n");
+                err = 0;
+        } else if (!strcmp(arg[0], "streams")) {
+                control_streams(reply);
+                err = 0;
+        } else if (!strcmp(arg[0], "tune")) {
+                err = control_tune(s, arg[2], n > 3 ? arg[3] : NULL);
+        } else if (!strcmp(arg[0], "add") || !strcmp(arg[0], "del")) {
+                err = control_destination(s, arg[0][0] == 'a' ? CMD_ADD : CMD_DEL, arg[2]);
+        } else if (sink->write == file_write && (!strcmp(arg[0], "format") || !strcmp(arg[0], "rate"))) {
+                err = -EOPNOTSUPP;      /* the file holds raw PCM of one format */
+        } else if (!strcmp(arg[0], "format")) {
+                err = control_format(arg[1]);
+        } else if (!strcmp(arg[0], "rate")) {
+                i = strtoul(arg[1], NULL, 10);
+                err = i < 4000 || i > MAX_RATE ? -ERANGE : request_reconfigure(format, i);
+        } else {
+                fprintf(reply, "error: unknown command %s, try help\n", arg[0]);
+                return;
         }
-        err = transfer_methods[method].transfer_loop(handle, samples, areas);
         if (err < 0)
-                printf("Transfer failed: %s\n", snd_strerror(err));
-        free(areas);
-        free(samples);
-        snd_pcm_close(handle);
+                fprintf(reply, "error: %s\n", strerror(-err));
+        else
+                fprintf(reply, "ok\n");
+}
+
+static void help(void)
+{
+        int k;
+        printf(
+          "Usage: pcm [OPTION]... [FILE]...\n"
+          "\n"
+          "-h,--help            help\n"
+          "-D,--device          playback device\n"
+          "-r,--rate            stream rate in Hz\n"
+          "-c,--channels        count of channels in stream\n"
+          "-f,--frequency       wave frequency in Hz, per channel (see below)\n"
+          "-a,--amplitude       amplitude 0 to 1, per channel\n"
+          "-F,--phase           start phase in degrees, per channel\n"
+          "-w,--wave            wave shape (sine, square, saw, noise)\n"
+          "-L,--sweep           seconds per frequency sweep\n"
+          "-b,--buffer          ring buffer size in us\n"
+          "-p,--period          period size in us\n"
+          "-m,--method          transfer method\n"
+          "-o,--format          sample format\n"
+          "-v,--verbose         show the PCM setup parameters\n"
+          "-n,--noresample      do not resample\n"
+          "-e,--pevent          enable poll event after each period, event driven loop\n"
+          "-A,--address         public ip address, starts a new stream\n"
+          "-P,--port            public port number\n"
+          "-I,--id              stream ID put on the wire\n"
+          "-C,--config          read streams from a file (address [port [frequency]])\n"
+          "-j,--threads         worker threads, pinned to one CPU each\n"
+          "-E,--engine          sine engine (libm, table, recursive)\n"
+          "-O,--sink            local output (alsa, null, net, file:PATH)\n"
+          "-B,--burst           datagrams released per deadline (null output)\n"
+          "-T,--spin            busy-poll this many us before each release\n"
+          "-R,--ring            periods queued between generator and output threads\n"
+          "-Z,--zerocopy        send without copying the payload (MSG_ZEROCOPY)\n"
+          "-M,--metrics         serve Prometheus metrics on a local port or socket path\n"
+          "-K,--cache           replay periodic waves from a cache of up to this many MiB\n"
+          "-X,--fec             K:M, M parity datagrams after every K (XOR for M = 1)\n"
+          "-z,--compress        code datagram payloads losslessly (integer formats)\n"
+          "-Q,--control         take commands on a local port or socket path (help lists them)\n"
+          "-i,--interface       send every stream on each of these interfaces (eth0,eth1)\n"
+          "-t,--ttl             multicast TTL or hop limit\n"
+          "-l,--loop            loop multicast back to local receivers (0 or 1)\n"
+          "-d,--dscp            DiffServ code point of the datagrams (0 to 63)\n"
+          "-H,--hugepages       period and packet buffers on 2 MiB pages\n"
+          "-G,--realtime[=PRIO] SCHED_FIFO stream threads (priority 80), pinned, memory locked\n"
+          "-Y,--rt-test         measure the wakeup latency of every CPU for this many ms first\n"
+          "-W,--selftest        N:M[:S] N streams to M receivers in this process over loopback,\n"
+          "                     stepped up from 8kHz to -r, S seconds counted a step\n"
+          "\n"
+          "-P, -f, -a, -F and -I after an -A apply to that stream, before the\n"
+          "first -A they set the default for all streams\n"
+          "-f, -a and -F take one value per channel separated by ',', repeated\n"
+          "when shorter; -f 440+660 sums tones, -f 100~1000 sweeps over -L seconds\n"
+          "unicast streams serve receivers subscribed to their port, -A adds a\n"
+          "permanent one (0.0.0.0 or :: for none)\n"
+          "addresses may be IPv4 or IPv6 (ff02::1%%eth0 names the interface of a\n"
+          "link-local group)\n"
+          "FILE arguments play in a loop instead of the wave, the first on the\n"
+          "first stream and so on: WAV, or raw samples in the stream format\n"
+          "--------------------------------------------------------\n"
+          "\n");
+        printf("Recognized sample formats are:\n");
+        for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
+                const char *s = snd_pcm_format_name(k);
+                if (s)
+                        printf(" %s,", s);
+        }
+        printf("\n--------------------------------------------------------\n\n");
+
+        printf("Recognized transfer methods are:\n");
+        for (k = 0; transfer_methods[k].name; k++)
+                printf(" - %s\n", transfer_methods[k].name);
+        printf("\n");
+
+        printf("Recognized outputs are:\n");
+        for (k = 0; sinks[k].name; k++)
+                printf(" - %s\n", sinks[k].name);
+        printf("\n");
+}
+int main(int argc, char *argv[])
+{
+        struct option long_option[] =
+        {
+                {"help", 0, NULL, 'h'},
+                {"device", 1, NULL, 'D'},
+                {"rate", 1, NULL, 'r'},
+                {"channels", 1, NULL, 'c'},
+                {"frequency", 1, NULL, 'f'},
+                {"amplitude", 1, NULL, 'a'},
+                {"phase", 1, NULL, 'F'},
+                {"wave", 1, NULL, 'w'},
+                {"sweep", 1, NULL, 'L'},
+                {"buffer", 1, NULL, 'b'},
+                {"period", 1, NULL, 'p'},
+                {"method", 1, NULL, 'm'},
+                {"format", 1, NULL, 'o'},
+                {"verbose", 1, NULL, 'v'},
+                {"noresample", 1, NULL, 'n'},
+                {"pevent", 1, NULL, 'e'},
+                {"address", 1, NULL, 'A'},
+                {"port", 1, NULL, 'P'},
+                {"id", 1, NULL, 'I'},
+                {"engine", 1, NULL, 'E'},
+                {"sink", 1, NULL, 'O'},
+                {"burst", 1, NULL, 'B'},
+                {"spin", 1, NULL, 'T'},
+                {"config", 1, NULL, 'C'},
+                {"threads", 1, NULL, 'j'},
+                {"ring", 1, NULL, 'R'},
+                {"zerocopy", 0, NULL, 'Z'},
+                {"metrics", 1, NULL, 'M'},
+                {"cache", 1, NULL, 'K'},
+                {"fec", 1, NULL, 'X'},
+                {"compress", 0, NULL, 'z'},
+                {"control", 1, NULL, 'Q'},
+                {"interface", 1, NULL, 'i'},
+                {"ttl", 1, NULL, 't'},
+                {"loop", 1, NULL, 'l'},
+                {"dscp", 1, NULL, 'd'},
+                {"hugepages", 0, NULL, 'H'},
+                {"realtime", 2, NULL, 'G'},
+                {"rt-test", 1, NULL, 'Y'},
+                {"selftest", 1, NULL, 'W'},
+                {NULL, 0, NULL, 0},
+        };
+        struct stream_spec *spec = NULL;
+        unsigned int nsubs = 0;
+        uint64_t dropped = 0, zc_total = 0, zc_copied = 0, raw = 0, coded = 0, encode_ns = 0, frames = 0;
+        int err, morehelp;
+        unsigned int i, k;
+        morehelp = 0;
+        stream_id = ((uint32_t)getpid() << 16) ^ (uint32_t)time(NULL);
+        while (1) {
+                int c;
+                if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:A:P:I:E:O:B:T:C:j:R:ZM:Q:K:X:za:F:w:L:i:t:l:d:G::Y:W:Hvne", long_option, NULL)) < 0)
+                        break;
+                switch (c) {
+                case 'h':
+                        morehelp++;
+                        break;
+                case 'D':
+                        device = strdup(optarg);
+                        break;
+                case 'r':
+                        rate = atoi(optarg);
+                        rate = rate < 4000 ? 4000 : rate;
+                        rate = rate > MAX_RATE ? MAX_RATE : rate;
+                        break;
+                case 'c':
+                        channels = atoi(optarg);
+                        channels = channels < 1 ? 1 : channels;
+                        channels = channels > 1024 ? 1024 : channels;
+                        break;
+                case 'f':
+                        if (spec != NULL)
+                                spec->freq = optarg;
+                        else
+                                freq = optarg;
+                        break;
+                case 'a':
+                        if (spec != NULL)
+                                spec->amps = optarg;
+                        else
+                                amplitude = optarg;
+                        break;
+                case 'F':
+                        if (spec != NULL)
+                                spec->phases = optarg;
+                        else
+                                phase = optarg;
+                        break;
+                case 'w':
+                        if ((err = waveform_parse(optarg)) < 0) {
+                                printf("Unknown wave shape %s\n", optarg);
+                                return 1;
+                        }
+                        wave = err;
+                        break;
+                case 'L':
+                        sweep_time = atof(optarg);
+                        break;
+                case 'b':
+                        buffer_time = atoi(optarg);
+                        buffer_time = buffer_time < 1000 ? 1000 : buffer_time;
+                        buffer_time = buffer_time > 1000000 ? 1000000 : buffer_time;
+                        break;
+                case 'p':
+                        period_time = atoi(optarg);
+                        period_time = period_time < 1000 ? 1000 : period_time;
+                        period_time = period_time > 1000000 ? 1000000 : period_time;
+                        break;
+                case 'm':
+                        for (method = 0; transfer_methods[method].name; method++)
+                                        if (!strcasecmp(transfer_methods[method].name, optarg))
+                                        break;
+                        if (transfer_methods[method].name == NULL)
+                                method = 0;
+                        break;
+                case 'o':
+                        for (format = 0; format < SND_PCM_FORMAT_LAST; format++) {
+                                const char *format_name = snd_pcm_format_name(format);
+                                if (format_name)
+                                        if (!strcasecmp(format_name, optarg))
+                                        break;
+                        }
+                        if (format == SND_PCM_FORMAT_LAST)
+                                format = SND_PCM_FORMAT_S16;
+                        if (!snd_pcm_format_linear(format) &&
+                            !(format == SND_PCM_FORMAT_FLOAT_LE ||
+                              format == SND_PCM_FORMAT_FLOAT_BE)) {
+                                printf("Invalid (non-linear/float) format %s\n",
+                                       optarg);
+                                return 1;
+                        }
+                        break;
+                case 'v':
+                        verbose = 1;
+                        break;
+                case 'n':
+                        resample = 0;
+                        break;
+                case 'e':
+                        period_event = 1;
+                        break;
+                case 'A':
+                        spec = add_spec(optarg);
+                        break;
+                case 'P': {
+                        int port = atoi(optarg);
+                        port = port < MIN_PORT ? MIN_PORT : port;
+                        port = port > MAX_PORT ? MAX_PORT : port;
+                        if (spec != NULL)
+                                spec->port = port;
+                        else
+                                mc_port = port;
+                        break;
+                }
+                case 'I':
+                        if (spec != NULL) {
+                                spec->id = strtoul(optarg, NULL, 0);
+                                spec->has_id = 1;
+                        } else
+                                stream_id = strtoul(optarg, NULL, 0);
+                        break;
+                case 'C':
+                        if (read_config(optarg) < 0)
+                                return 1;
+                        spec = NULL;
+                        break;
+                case 'j':
+                        nworkers = atoi(optarg);
+                        nworkers = nworkers < 1 ? 1 : nworkers;
+                        pin_workers = 1;
+                        break;
+                case 'E':
+                        if ((err = engine_parse(optarg)) < 0) {
+                                printf("Unknown sine engine %s\n", optarg);
+                                return 1;
+                        }
+                        engine = err;
+                        break;
+                case 'B':
+                        burst = atoi(optarg);
+                        burst = burst < 1 ? 1 : burst;
+                        break;
+                case 'T':
+                        spin_time = atol(optarg);
+                        spin_time = spin_time < 0 ? 0 : spin_time;
+                        break;
+                case 'R':
+                        ring_slots = atoi(optarg);
+                        ring_slots = ring_slots < 2 ? 0 : ring_slots;
+                        ring_slots = ring_slots > RING_MAX_SLOTS ? RING_MAX_SLOTS : ring_slots;
+                        break;
+                case 'Z':
+                        zerocopy = 1;
+                        break;
+                case 'M':
+                        metrics_addr = optarg;
+                        break;
+                case 'Q':
+                        control_addr = optarg;
+                        break;
+                case 'K':
+                        if ((err = atoi(optarg)) < 0) {
+                                printf("Invalid cache size %s\n", optarg);
+                                return 1;
+                        }
+                        cache_mb = err;
+                        break;
+                case 'i':
+                        if (parse_interfaces(optarg) < 0)
+                                return 1;
+                        break;
+                case 't':
+                        mc_hops = atoi(optarg);
+                        mc_hops = mc_hops < 0 ? 0 : mc_hops;
+                        mc_hops = mc_hops > 255 ? 255 : mc_hops;
+                        break;
+                case 'l':
+                        mc_loop = atoi(optarg) != 0;
+                        break;
+                case 'G':
+                        rt_priority = optarg ? atoi(optarg) : RT_PRIORITY;
+                        rt_priority = rt_priority < 1 ? 1 : rt_priority;
+                        rt_priority = rt_priority > sched_get_priority_max(SCHED_FIFO) ?
+                                      sched_get_priority_max(SCHED_FIFO) : rt_priority;
+                        pin_workers = 1;
+                        /* what is freed stays mapped and locked */
+                        mallopt(M_TRIM_THRESHOLD, -1);
+                        mallopt(M_MMAP_MAX, 0);
+                        break;
+                case 'H':
+                        hugepages = 1;
+                        break;
+                case 'Y':
+                        rt_test_ms = atoi(optarg);
+                        break;
+                case 'W':
+                        if (sscanf(optarg, "%u:%u:%u", &selftest_streams, &selftest_receivers,
+                                   &selftest_secs) < 2 || selftest_streams == 0 ||
+                            selftest_streams > MAX_STREAMS || selftest_receivers == 0 || selftest_secs == 0) {
+                                printf("-W takes STREAMS:RECEIVERS[:SECONDS]\n");
+                                return 1;
+                        }
+                        break;
+                case 'd':
+                        dscp = atoi(optarg);
+                        dscp = dscp < 0 ? 0 : dscp;
+                        dscp = dscp > 63 ? 63 : dscp;
+                        break;
+                case 'z':
+                        compress = 1;
+                        break;
+                case 'X':
+                        fec_m = 1;
+                        if (sscanf(optarg, "%u:%u", &fec_k, &fec_m) < 1 ||
+                            fec_k < 1 || fec_k > SINE_FEC_MAX_K || fec_m < 1 || fec_m > SINE_FEC_MAX_M) {
+                                printf("Invalid FEC ratio %s, K 1 to %d, M 1 to %d\n",
+                                       optarg, SINE_FEC_MAX_K, SINE_FEC_MAX_M);
+                                return 1;
+                        }
+                        break;
+                case 'O': {
+                        size_t len = strcspn(optarg, ":");
+                        for (sink = sinks; sink->name; sink++)
+                                if (strlen(sink->name) == len && !strncasecmp(sink->name, optarg, len))
+                                        break;
+                        if (sink->name == NULL) {
+                                printf("Unknown output %s\n", optarg);
+                                return 1;
+                        }
+                        sink_arg = optarg[len] == ':' ? optarg + len + 1 : NULL;
+                        break;
+                }
+                }
+        }
+        if (morehelp) {
+                help();
+                return 0;
+        }
+
+        err = snd_output_stdio_attach(&output, stdout, 0);
+        if (err < 0) {
+                printf("Output failed: %s\n", snd_strerror(err));
+                return 0;
+        }
+
+        if (selftest_streams) {
+                int subscribe = transfer_methods[method].subscribe;
+                static char lo[] = "lo";
+                if (nspecs || control_addr != NULL || optind < argc) {
+                        printf("The self-test sets its streams up itself, leave out -A, -C, -Q and files\n");
+                        return 1;
+                }
+                if (!transfer_methods[method].network ||
+                    (subscribe && mc_port + selftest_streams - 1 > MAX_PORT)) {
+                        printf("The self-test needs the multicast or unicast method and a port per unicast stream\n");
+                        return 1;
+                }
+                if (sink->write != discard_write)
+                        sink = &sinks[1];       /* paced by the clock, nothing played */
+                if (!subscribe && nifaces == 0 && parse_interfaces(lo) < 0)
+                        return 1;
+                mc_loop = 1;
+                for (i = 0; i < selftest_streams; i++) {
+                        spec = add_spec(subscribe ? NULL : SELFTEST_GROUP);
+                        spec->port = subscribe ? mc_port + i : mc_port;
+                }
+                selftest_top = rate;
+                rate = rate < 8000 ? rate : 8000;
+        }
+        if (nspecs == 0)
+                add_spec(NULL);         /* local output only */
+        nfiles = argc - optind;
+        if (nfiles > nspecs) {
+                printf("%u files for %u streams\n", nfiles, nspecs);
+                return 1;
+        }
+        /* the device or file reader paces a single stream */
+        if (nspecs > 1 && !sink->clocked && sink->write != discard_write) {
+                printf("The %s output can only carry one stream, use -O null or -O net\n", sink->name);
+                return 1;
+        }
+        nstreams = nspecs;
+        if (posix_memalign((void **)&streams, CACHELINE, nstreams * sizeof(*streams))) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
+        memset(streams, 0, nstreams * sizeof(*streams));
+
+        printf("\n");
+        printf("Local output is %s\n", sink->name);
+        printf("Stream parameters are %iHz, %s, %i channels\n", rate, snd_pcm_format_name(format), channels);
+        printf("Sine engine %s, %s packing\n",
+               engine_name(engine), pack_kernel_name(pack_select(KERNEL_AUTO)));
+        printf("Using transfer method: %s\n", transfer_methods[method].name);
+        if (compress) {
+                if (codec_layout(format, &layout) < 0) {
+                        printf("Compression needs an integer sample format, not %s\n",
+                               snd_pcm_format_name(format));
+                        return 1;
+                }
+                printf("Compressing payloads losslessly\n");
+        }
+        if (fec_k) {
+                fec_init();
+                printf("FEC: %u parity datagram%s after every %u, %s coding (%s)\n", fec_m,
+                       fec_m > 1 ? "s" : "", fec_k, fec_m > 1 ? "Reed-Solomon" : "XOR", fec_kernel_name());
+        }
+
+        if (open_output() < 0)
+                exit(EXIT_FAILURE);
+        if (transfer_methods[method].transfer_loop == direct_loop) {
+                if (sink->handle == NULL) {
+                        printf("The %s method needs the alsa output\n", transfer_methods[method].name);
+                        exit(EXIT_FAILURE);
+                }
+                ring_slots = 0;         /* generates into the device buffer */
+        }
+        if (period_event) {
+                if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                        perror("Creating stop event failed");
+                        exit(EXIT_FAILURE);
+                }
+                if (ring_slots)
+                        printf("Event mode services every stream from its worker, ignoring -R\n");
+                ring_slots = 0;
+        }
+        if (nifaces > 1 && transfer_methods[method].network) {
+                /* every interface has a sender reading the same ring slots */
+                if (transfer_methods[method].subscribe || period_event) {
+                        printf("Sending on several interfaces needs the multicast method without -e\n");
+                        exit(EXIT_FAILURE);
+                }
+                ring_slots = ring_slots ? ring_slots : 4;
+                nmirrors = (nifaces - 1) * nstreams;
+                if (posix_memalign((void **)&mirrors, CACHELINE, nmirrors * sizeof(*mirrors))) {
+                        printf("No enough memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                memset(mirrors, 0, nmirrors * sizeof(*mirrors));
+                for (i = 0; i < nmirrors; i++)
+                        mirrors[i].sock = -1;
+        }
+        for (i = 0; i < nifaces; i++)
+                printf("Interface %s: index %u, sender on CPU %d\n",
+                       ifaces[i].name, ifaces[i].index, ifaces[i].cpu);
+        if ((err = arenas_init()) < 0) {
+                printf("Allocating buffers failed: %s\n", strerror(-err));
+                exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < nstreams; i++) {
+                struct stream *s = &streams[i];
+                s->index = i;
+                s->arena = &arenas[i % nworkers];
+                s->addr_str = specs[i].addr;
+                s->port = specs[i].port;
+                s->voices.wave = wave;
+                s->voices.freqs = specs[i].freq;
+                s->voices.amps = specs[i].amps;
+                s->voices.phases = specs[i].phases;
+                s->voices.sweep = sweep_time;
+                s->id = specs[i].has_id ? specs[i].id : stream_id + i;
+                if (i < nfiles) {
+                        if ((err = pcm_file_open(&files[i], argv[optind + i], format, channels, rate)) < 0) {
+                                printf("Cannot play %s: %s\n", argv[optind + i],
+                                       err == -EINVAL ? "not a WAV file of PCM or float samples" : strerror(-err));
+                                exit(EXIT_FAILURE);
+                        }
+                        s->file = &files[i];
+                }
+                if ((err = stream_init(s, transfer_methods[method].subscribe,
+                                       transfer_methods[method].access)) < 0) {
+                        printf("Stream %u setup failed: %s\n", i, snd_strerror(err));
+                        exit(EXIT_FAILURE);
+                }
+                if (s->file != NULL)
+                        printf("Stream %u: %s:%d, file %s, ID 0x%08x\n", i,
+                               s->addr_str ? s->addr_str : "-", s->port, s->file->path, s->id);
+                else
+                        printf("Stream %u: %s:%d, %s %sHz, ID 0x%08x\n", i,
+                               s->addr_str ? s->addr_str : "-", s->port, waveform_name(wave),
+                               s->voices.freqs, s->id);
+                for (k = 0; s->sock >= 0 && k < nmirrors / nstreams; k++) {
+                        if ((err = mirror_init(&mirrors[k * nstreams + i], s, k + 1)) < 0) {
+                                printf("Stream %u setup failed: %s\n", i, strerror(-err));
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                if (s->file != NULL) {
+                        printf("Stream %u: %llu frames of %s, %u channels, %uHz, %s\n", i,
+                               (unsigned long long)s->file->frames, snd_pcm_format_name(s->file->format),
+                               s->file->channels, s->file->rate,
+                               s->gen.cache != NULL ? "sent as stored" : "converted");
+                        if (s->file->rate != rate)
+                                printf("Stream %u: the file is %uHz, it plays at %uHz\n", i, s->file->rate, rate);
+                } else if (s->gen.cache != NULL)
+                        printf("Stream %u: replaying %llu frames (%.1f MiB)\n", i,
+                               (unsigned long long)s->gen.cache_frames,
+                               s->gen.cache_frames * channels * snd_pcm_format_physical_width(format) / 8 / 1048576.);
+        }
+
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        if (rt_priority)
+                lock_memory();
+        if (rt_test_ms)
+                latency_test();
+        ring_init(&fill, 0, 0);
+        if ((err = start_workers()) < 0) {
+                printf("Starting workers failed: %s\n", snd_strerror(err));
+                exit(EXIT_FAILURE);
+        }
+        if (metrics_addr != NULL && (err = metrics_start(metrics_addr, streams, nstreams, mirrors, nmirrors)) < 0) {
+                printf("Metrics endpoint %s failed: %s\n", metrics_addr, strerror(-err));
+                exit(EXIT_FAILURE);
+        }
+        if (control_addr != NULL) {
+                if ((err = control_start(control_addr, control_command)) < 0) {
+                        printf("Control socket %s failed: %s\n", control_addr, strerror(-err));
+                        exit(EXIT_FAILURE);
+                }
+                serve_reconfigure();
+        }
+        if (selftest_streams)
+                selftest();
+        join_workers();
+        control_stop();
+        metrics_stop();
+        for (i = 0; i < nstreams; i++) {
+                nsubs += streams[i].nsubs;
+                dropped += streams[i].metrics.send.dropped;
+                zc_total += streams[i].zc_sent;
+                zc_copied += streams[i].zc_copied;
+                raw += streams[i].metrics.gen.raw_bytes;
+                coded += streams[i].metrics.gen.coded_bytes;
+                encode_ns += streams[i].metrics.gen.encode.sum_ns;
+                frames += streams[i].metrics.gen.frames;
+                stream_free(&streams[i]);
+        }
+        for (i = 0; i < nmirrors; i++)
+                dropped += mirrors[i].metrics.send.dropped;
+        for (i = 0; i < nfiles; i++)
+                pcm_file_close(&files[i]);
+        for (i = 0; i < nifaces && transfer_methods[method].network; i++) {
+                uint64_t sent = 0, lost = 0;
+                for (k = 0; k < nstreams; k++) {
+                        struct stream *m = i == 0 ? &streams[k] : &mirrors[(i - 1) * nstreams + k];
+                        sent += m->metrics.send.packets;
+                        lost += m->metrics.send.dropped;
+                }
+                printf("Interface %s: %llu datagrams, %llu dropped\n", ifaces[i].name,
+                       (unsigned long long)sent, (unsigned long long)lost);
+        }
+        for (i = 0; i < nmirrors; i++)
+                if (mirrors[i].sock >= 0)
+                        close(mirrors[i].sock);
+        free(mirrors);
+        for (i = 0; i < nworkers; i++)
+                arena_destroy(&arenas[i]);
+        free(arenas);
+        pacer_report(&lateness, "Send lateness", stdout);
+        cpu_report();
+        if (transfer_methods[method].subscribe)
+                printf("%u subscribers at exit, %llu datagrams dropped\n",
+                       nsubs, (unsigned long long)dropped);
+        if (compress && coded)
+                printf("Compressed payloads %.2f:1 (%.3f of %.3f MB), %.1fns per frame encoding\n",
+                       (double)raw / coded, coded / 1e6, raw / 1e6, frames ? (double)encode_ns / frames : 0);
+        if (zc_total)
+                printf("%llu datagrams sent zero-copy, %llu of them copied by the kernel\n",
+                       (unsigned long long)zc_total, (unsigned long long)zc_copied);
+        if (ring_slots) {
+                const char *readers[RING_MAX_READERS] = { "sender", "writer" };
+                if (!transfer_methods[method].network)
+                        readers[0] = "writer";
+                else if (nifaces > 1) {
+                        for (i = 0; i < nifaces; i++)
+                                readers[i] = ifaces[i].name;
+                        readers[nifaces] = "writer";
+                }
+                ring_report(&fill, readers, (unsigned int)(period_size * 1000000ULL / rate), stdout);
+        }
+        free(streams);
+        if (sink->close != NULL)
+                sink->close(sink);
         return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef SINESERVER_H_   /* Include guard */
 #define SINESERVER_H_
 
+#define _GNU_SOURCE             /* sendmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,18 +11,200 @@
 #include <getopt.h>
 #include <alsa/asoundlib.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <math.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <alloca.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "protocol.h"
+#include "generator.h"
+#include "pacer.h"
+#include "ring.h"
+#include "zerocopy.h"
+#include "metrics.h"
+#include "fec.h"
+#include "codec.h"
+#include "control.h"
+#include "arena.h"
+#include "pcmfile.h"
+#include "period.h"
 
 #define   SA  struct sockaddr
 #define   PACKETSIZE 16384
 #define	  MIN_PORT 1024
 #define   MAX_PORT 65535
 #define   NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
+#define   CACHELINE  64
+#define   MAX_STREAMS 1024
+#define   MAX_SUBSCRIBERS 65536
+#define   MAX_INTERFACES 4              /* egress interfaces of every stream */
+#define   MAX_RATE   196000
+#define   FAN_BATCH  512                /* messages per sendmmsg() when fanning out */
+#define   ZC_PERIODS 4                  /* period buffers cycled by zero-copy without a ring */
+#define   CONTROL_WAIT_MS 5000          /* before a command no thread took is withdrawn */
+#define   RT_PRIORITY 80                /* SCHED_FIFO priority of --realtime */
+#define   RT_STACK   (1 << 20)          /* stack of a stream thread with locked memory */
+#define   ARENA_SUBSCRIBERS 256         /* subscribers per stream the arena has room for */
+#define   SELFTEST_GROUP "239.255.0.1"  /* every multicast stream of the self-test */
+#define   SELFTEST_SETTLE_MS 300        /* after a rate step, before counting */
+#define   SELFTEST_BATCH 64             /* datagrams per recvmmsg() of a receiver */
+
+/*
+ *  Header of a parity datagram
+ */
+struct parity_hdr {
+        struct sine_hdr hdr;
+        struct sine_fec fec;
+};
+
+/*
+ *  One generated period and the datagrams that carry it
+ */
+struct period {
+        unsigned char *samples;         /* one period, interleaved */
+        unsigned char *data;            /* what is sent: samples or a slice of the replay cache */
+        snd_pcm_channel_area_t *areas;
+        struct mmsghdr *msgs;           /* one message per datagram, in sending order */
+        struct iovec *iovecs;           /* header and payload of each datagram */
+        struct sine_hdr *hdrs;          /* header of each data datagram */
+        struct parity_hdr *parity_hdrs; /* header and code of each parity datagram */
+        unsigned char *parity;
+        unsigned char *coded;           /* compressed payload of each data datagram */
+        uint32_t zc_first;              /* zero-copy IDs of the datagrams sent from here */
+        uint32_t zc_end;
+        _Atomic unsigned int zc_pending;        /* of those, still held by the kernel */
+};
+
+/*
+ *  An IPv4 or IPv6 socket address
+ */
+union inet_addr {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+};
+
+/*
+ *  A unicast destination of a stream
+ */
+struct subscriber {
+        union inet_addr addr;
+        long long seen_ns;              /* last keepalive, 0 for one given with -A */
+};
+
+/*
+ *  A change handed from the control thread to the thread that owns the
+ *  state: the generator side retunes, the output side adds or removes a
+ *  destination.  The owner takes it at a period boundary and sets done.
+ */
+enum { CMD_TUNE, CMD_ADD, CMD_DEL };
+
+struct control_cmd {
+        int type;
+        struct generator gen;           /* CMD_TUNE: the new voices, the old ones after */
+        union inet_addr addr;           /* CMD_ADD, CMD_DEL */
+        int replay;                     /* CMD_TUNE: periods can be sliced out of gen.cache */
+        int result;
+        _Atomic int done;
+};
+
+/*
+ *  One sine stream: its own generator, clock and destination.  A stream
+ *  is serviced by one worker thread, or with a period ring by the worker
+ *  generating and its output threads consuming.  Generator state, output
+ *  state and the set-up fields each start a cache line, and every stream
+ *  starts on its own, so no two threads write to the same line.
+ */
+struct stream {
+        /* per period, generator side */
+        struct generator gen;
+        uint64_t produced;              /* periods generated */
+        uint32_t seq;                   /* next packet sequence number */
+        _Atomic(struct control_cmd *) gen_cmd;  /* pending retune */
+        unsigned char *old_cache;       /* replay cache before the last retune */
+        unsigned char *old_coded;       /* and its coded payloads */
+        uint64_t old_until;             /* periods produced from it */
+        /* per release, output side */
+        uint64_t frame __attribute__((aligned(CACHELINE)));     /* sample clock of the period being sent */
+        unsigned int next_packet;       /* next datagram of that period */
+        int sending;                    /* event mode: a period is partly sent */
+        int blocked;                    /* event mode: waiting for room in the socket */
+        struct pacer pacer;
+        struct subscriber *subs;        /* unicast destinations */
+        unsigned int nsubs;
+        unsigned int max_subs;
+        uint32_t zc_next;               /* zero-copy ID of the next datagram */
+        uint64_t zc_sent;
+        uint64_t zc_copied;             /* sent zero-copy but copied after all */
+        struct ring ring;               /* periods between generator and outputs */
+        _Atomic(struct control_cmd *) send_cmd; /* pending destination change */
+        /* set up once */
+        unsigned int index __attribute__((aligned(CACHELINE)));
+        uint32_t id;                    /* stream ID put on the wire */
+        struct voices voices;           /* what every channel plays */
+        struct pcm_file *file;          /* played instead of the voices, NULL for none */
+        char *voice_strings;            /* owns freqs and amps after a retune */
+        const char *addr_str;
+        int port;
+        int sock;
+        int zc;                         /* socket sends with MSG_ZEROCOPY */
+        int listen;                     /* socket takes subscriptions */
+        union inet_addr addr;
+        struct arena *arena;            /* of the worker, holds the buffers below */
+        struct stream *source;          /* the stream this one sends again on another interface */
+        const char *iface;              /* egress interface given with -i, NULL if routed */
+        unsigned int reader;            /* ring reader of its sender, the interface */
+        struct period *periods;         /* ring slots, just one without a ring */
+        unsigned int nperiods;
+        size_t period_bytes;            /* room for samples in each, for any format or rate with -Q */
+        unsigned int max_packets;       /* room for datagrams in each */
+        unsigned int max_msgs;
+        unsigned int npackets;          /* data datagrams per period */
+        unsigned int ngroups;           /* FEC groups per period */
+        unsigned int nmsgs;             /* datagrams per period, parity included */
+        uint32_t *msg_frame;            /* frame of the period each datagram is due at */
+        size_t code_len;                /* bytes of code per parity datagram */
+        snd_pcm_uframes_t packet_frames;        /* frames per full datagram */
+        int replay;                     /* periods are sent straight from the generator cache */
+        struct stream_metrics metrics;
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ *  A thread servicing a fixed set of streams
+ */
+struct worker {
+        unsigned int index;
+        int cpu;                        /* pinned to this CPU, -1 for none */
+        pthread_t thread;
+        struct stream **streams;
+        unsigned int nstreams;
+        unsigned int next;              /* round robin position */
+        int err;
+        pthread_t sender;               /* output threads when running a ring */
+        pthread_t writer;
+        int has_sender;
+        int has_writer;
+        struct worker *mirrors;         /* a sender per further interface */
+        unsigned int nmirrors;
+};
 
 #endif //SINESERVER_H_
@@ -0,0 +1,57 @@
+/*
+ *  Completion handling for MSG_ZEROCOPY sends.
+ */
+
+#include "sineserver.h"
+#include <poll.h>
+#include <linux/errqueue.h>
+
+int zc_enable(int fd)
+{
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+                return -errno;
+        return 0;
+}
+
+/*
+ *   Drain the error queue of fd without blocking, returns the number of
+ *   completion ranges seen
+ */
+int zc_reap(int fd, zc_done_fn done, void *arg)
+{
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct sock_extended_err *ee;
+        struct cmsghdr *cm;
+        struct msghdr msg;
+        int count = 0;
+        for (;;) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                        return errno == EAGAIN || errno == EWOULDBLOCK ? count : -errno;
+                for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+                        if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                                continue;
+                        ee = (struct sock_extended_err *)CMSG_DATA(cm);
+                        if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                                continue;
+                        done(arg, ee->ee_info, ee->ee_data,
+                             (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+                        count++;
+                }
+        }
+}
+
+/*
+ *   Sleep until completions are queued on fd or timeout_ms passed
+ */
+int zc_wait(int fd, int timeout_ms)
+{
+        struct pollfd pfd = { fd, 0, 0 };       /* POLLERR is always reported */
+        if (poll(&pfd, 1, timeout_ms) < 0)
+                return -errno;
+        return (pfd.revents & POLLERR) != 0;
+}
@@ -0,0 +1,26 @@
+#ifndef ZEROCOPY_H_   /* Include guard */
+#define ZEROCOPY_H_
+
+#include <stdint.h>
+
+/*
+ *  MSG_ZEROCOPY transmit support.  Every datagram sent with MSG_ZEROCOPY
+ *  on a socket gets the next 32 bit notification ID; the kernel reports
+ *  ranges of IDs on the socket's error queue once it no longer needs
+ *  the user pages, and only then may the buffer be written again.
+ */
+#ifndef SO_ZEROCOPY
+#define   SO_ZEROCOPY   60
+#endif
+#ifndef MSG_ZEROCOPY
+#define   MSG_ZEROCOPY  0x4000000
+#endif
+
+/* called for every completed range lo..hi, copied if the kernel fell back to a copy */
+typedef void (*zc_done_fn)(void *arg, uint32_t lo, uint32_t hi, int copied);
+
+int zc_enable(int fd);
+int zc_reap(int fd, zc_done_fn done, void *arg);
+int zc_wait(int fd, int timeout_ms);
+
+#endif //ZEROCOPY_H_